@@ -68,6 +68,9 @@ int ConfigurationParserBase::parse(void* baseptr, int argc, char* argv[]) {
       if (0 == strcmp(name, "-"))
         return i;
 
+      // Accept GNU-style long options (--name) as well:
+      if (name[0] == '-') name++;
+
       ConfigurationOption* option = options;
       while (option) {
         if (option->type == OPTION_TYPE_SECTION) {
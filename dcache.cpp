@@ -774,6 +774,38 @@ void CacheHierarchy::clock() {
   missbuf.clock();
 }
 
+//
+// Number of upcoming cycles in which clock() only counts down the
+// miss buffer entries, without delivering anything or waking up
+// any loads (limits<int>::max if nothing is in flight):
+//
+int CacheHierarchy::idle_cycles() const {
+  if unlikely (*lfrq.ready) return 0;
+
+  int n = limits<int>::max;
+  if likely (missbuf.freemap.allset()) return n;
+
+  foreach (i, MISSBUF_COUNT) {
+    const MissBuffer<MISSBUF_COUNT>::Entry& mb = missbuf.missbufs[i];
+    if (mb.state == STATE_IDLE) continue;
+    n = min(n, (int)mb.cycles - 1);
+  }
+
+  return max(n, 0);
+}
+
+//
+// Advance the miss buffer by n cycles counted by idle_cycles():
+//
+void CacheHierarchy::skip_idle_cycles(int n) {
+  foreach (i, MISSBUF_COUNT) {
+    MissBuffer<MISSBUF_COUNT>::Entry& mb = missbuf.missbufs[i];
+    if (mb.state == STATE_IDLE) continue;
+    assert(mb.cycles > n);
+    mb.cycles -= n;
+  }
+}
+
 void CacheHierarchy::complete() {
   lfrq.restart();
   missbuf.restart();
@@ -797,6 +829,18 @@ void CacheHierarchy::reset() {
   dtlb.reset();
 }
 
+//
+// Functional warming: bring the line into the caches as if a miss on
+// it had completed, without taking any time
+//
+void CacheHierarchy::warm(W64 addr, bool icache) {
+#ifdef ENABLE_L3_CACHE
+  L3.validate(addr);
+#endif
+  L2.validate(addr);
+  if (icache) L1I.validate(addr, bitvec<L1I_LINE_SIZE>().setall()); else L1.validate(addr, bitvec<L1_LINE_SIZE>().setall());
+}
+
 ostream& CacheHierarchy::print(ostream& os) {
   os << "Data Cache Subsystem:", endl;
   os << lfrq;
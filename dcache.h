@@ -646,8 +646,11 @@ namespace CacheSubsystem {
     bool probe_icache(Waddr virtaddr, Waddr physaddr);
     int initiate_icache_miss(W64 addr, int rob = 0xffff, int threadid = 0xff);
 
+    void warm(W64 addr, bool icache);
     void reset();
     void clock();
+    int idle_cycles() const;
+    void skip_idle_cycles(int n);
     void complete();
     void complete(int threadid);
     ostream& print(ostream& os);
@@ -14,23 +14,6 @@
 
 BasicBlockCache bbcache;
 
-struct BasicBlockChunkListHashtableLinkManager {
-  static inline BasicBlockChunkList* objof(selflistlink* link) {
-    return baseof(BasicBlockChunkList, hashlink, link);
-  }
-
-  static inline W64& keyof(BasicBlockChunkList* obj) {
-    return obj->mfn;
-  }
-
-  static inline selflistlink* linkof(BasicBlockChunkList* obj) {
-    return &obj->hashlink;
-  }
-};
-
-typedef SelfHashtable<W64, BasicBlockChunkList, 16384, BasicBlockChunkListHashtableLinkManager> BasicBlockPageCache;
-
-BasicBlockPageCache bbpages;
 CycleTimer translate_timer("translate");
 
 odstream bbcache_dump_file;
@@ -1400,20 +1383,22 @@ bool BasicBlockCache::invalidate(BasicBlock* bb, int reason) {
     bbcache_dump_file.write(bb->transops, bb->count * sizeof(TransOp));
   }
 
-  pagelist = bbpages.get(bb->rip.mfnlo);
+  pagelist = pages.get(bb->rip.mfnlo);
   if (logable(3) | log_code_page_ops) logfile << "Remove bb ", bb, " (", bb->rip, ", ", bb->bytes, " bytes) from low page list ", pagelist, ": loc ", bb->mfnlo_loc.chunk, ":", bb->mfnlo_loc.index, endl;
   assert(pagelist);
   pagelist->remove(bb->mfnlo_loc);
 
   int page_crossing = ((lowbits(bb->rip, 12) + (bb->bytes-1)) >> 12);
   if (page_crossing) {
-    pagelist = bbpages.get(bb->rip.mfnhi);
+    pagelist = pages.get(bb->rip.mfnhi);
     if (logable(3) | log_code_page_ops) logfile << "Remove bb ", bb, " (", bb->rip, ", ", bb->bytes, " bytes) from high page list ", pagelist, ": loc ", bb->mfnhi_loc.chunk, ":", bb->mfnhi_loc.index, endl;
     assert(pagelist);
     pagelist->remove(bb->mfnhi_loc);
   }
 
   remove(bb);
+  clock_remove(bb);
+  generation++;
   stats.decoder.bbcache.count = bbcache.count;
   stats.decoder.bbcache.invalidates[reason]++;
 
@@ -1433,7 +1418,7 @@ bool BasicBlockCache::invalidate(const RIPVirtPhys& rvp, int reason) {
 int BasicBlockCache::get_page_bb_count(Waddr mfn) {
   if unlikely (mfn == RIPVirtPhys::INVALID) return 0;
 
-  BasicBlockChunkList* pagelist = bbpages.get(mfn);
+  BasicBlockChunkList* pagelist = pages.get(mfn);
 
   if unlikely (!pagelist) return 0;
 
@@ -1452,7 +1437,7 @@ bool BasicBlockCache::invalidate_page(Waddr mfn, int reason) {
   //
   if unlikely (mfn == RIPVirtPhys::INVALID) return 0;
 
-  BasicBlockChunkList* pagelist = bbpages.get(mfn);
+  BasicBlockChunkList* pagelist = pages.get(mfn);
 
   if (logable(3) | log_code_page_ops) logfile << "Invalidate page mfn ", mfn, ": pagelist ", pagelist, " has ", (pagelist ? pagelist->count() : 0), " entries (dirty? ", smc_isdirty(mfn), ")", endl;
 
@@ -1478,128 +1463,131 @@ bool BasicBlockCache::invalidate_page(Waddr mfn, int reason) {
   assert(pagelist->count() == 0);
 
   pagelist->clear();
-  stats.decoder.pagecache.count = bbpages.count;
+  stats.decoder.pagecache.count = pages.count;
   stats.decoder.pagecache.invalidates[reason]++;
 
   return true;
 }
 
 //
-// Scan through the BB cache and try to free up
-// <bytesreq> bytes, starting with the least
-// recently used BBs.
+// The BB cache keeps its blocks on a ring, visited in turn by a
+// clock hand (the CLOCK approximation of LRU). New blocks go in
+// just behind the hand, and BasicBlock::use() sets the referenced
+// bit of each block the core fetches from.
 //
-int BasicBlockCache::reclaim(size_t bytesreq, int urgency) {
-  bool DEBUG = 1; // logable(1);
+void BasicBlockCache::clock_insert(BasicBlock* bb) {
+  if unlikely (!clockhand) {
+    bb->clocknext = bb;
+    bb->clockprev = bb;
+    clockhand = bb;
+  } else {
+    bb->clocknext = clockhand;
+    bb->clockprev = clockhand->clockprev;
+    clockhand->clockprev->clocknext = bb;
+    clockhand->clockprev = bb;
+  }
 
-  if (!count) return 0;
+  bb->referenced = 1;
+  bytes += bb->memsize();
+}
 
-  if (DEBUG) logfile << "Reclaiming cached basic blocks at ", sim_cycle, " cycles, ", total_user_insns_committed, " commits:", endl;
+void BasicBlockCache::clock_remove(BasicBlock* bb) {
+  if (bb->clocknext == bb) {
+    clockhand = null;
+  } else {
+    if (clockhand == bb) clockhand = bb->clocknext;
+    bb->clockprev->clocknext = bb->clocknext;
+    bb->clocknext->clockprev = bb->clockprev;
+  }
 
-  stats.decoder.reclaim_rounds++;
+  bb->clocknext = null;
+  bb->clockprev = null;
+  bytes -= bb->memsize();
+}
 
-  W64 oldest = limits<W64>::max;
-  W64 newest = 0;
-  W64 average = 0;
-  W64 total_bytes = 0;
+//
+// Free the list head of a code page once no blocks remain on it
+//
+static void release_empty_page(Waddr mfn) {
+  BasicBlockChunkList* page = bbcache.pages.get(mfn);
+  if ((!page) || (!page->empty()) || page->refcount) return;
 
-  int n = 0;
+  bbcache.pages.remove(page);
+  delete page;
+  stats.decoder.pagecache.count = bbcache.pages.count;
+}
 
-  Iterator iter(this);
-  BasicBlock* bb;
+//
+// Free up at least <bytesreq> bytes of basic blocks (or an eighth
+// of the cache if none are requested), advancing the clock hand
+// only as far as needed: blocks referenced since the hand last
+// passed them get a second chance, and blocks still in the
+// pipeline are skipped. Every block is passed at most twice.
+//
+int BasicBlockCache::reclaim(size_t bytesreq, int urgency) {
+  if (!count) return 0;
 
-  while (bb = iter.next()) {
-    oldest = min(oldest, bb->lastused);
-    newest = max(newest, bb->lastused);
-    average += bb->lastused;
-    total_bytes += ptl_mm_getsize(bb);
-    n++;
-  }
+  stats.decoder.reclaim_rounds++;
 
-  assert(count == n);
-  assert(n > 0);
-  average /= n;
+  W64 target = (bytesreq) ? bytesreq : max(bytes / 8, (W64)1);
+  bool everything = (urgency >= MAX_URGENCY);
 
-  if unlikely (urgency >= MAX_URGENCY) {
+  if unlikely (everything) {
     //
     // The allocator is so strapped for memory, we need to free
     // everything possible at all costs:
     //
-    average = infinity;
+    target = bytes;
   }
 
-  if (DEBUG) {
-    logfile << "Before:", endl;
-    logfile << "  Basic blocks:   ", intstring(count, 12), endl;
-    logfile << "  Bytes occupied: ", intstring(total_bytes, 12), endl;
-    logfile << "  Oldest cycle:   ", intstring(oldest, 12), endl;
-    logfile << "  Average cycle:  ", intstring(average, 12), endl;
-    logfile << "  Newest cycle:   ", intstring(newest, 12), endl;
-  }
+  if (logable(1)) logfile << "Reclaiming ", target, " of ", bytes, " bytes in ", count, " cached basic blocks at ", sim_cycle, " cycles, ", total_user_insns_committed, " commits", endl;
 
-  //
-  // Reclaim all objects older than the average
-  //
-  n = 0;
   W64 reclaimed_bytes = 0;
   int reclaimed_objs = 0;
+  W64 steps = 2 * count;
+
+  while (clockhand && (reclaimed_bytes < target) && steps) {
+    BasicBlock* bb = clockhand;
+    clockhand = bb->clocknext;
+    steps--;
+    stats.decoder.eviction.scanned++;
 
-  iter.reset(this);
-  while (bb = iter.next()) {
     if unlikely (bb->refcount) {
       //
       // We cannot invalidate anything that's still in the pipeline.
       // If this is required, the pipeline must be flushed before
       // the forced invalidation can occur.
       //
-      logfile << "Warning: eligible bb ", bb, " ", bb->rip, " (lastused ", bb->lastused, ") still has refcount ", bb->refcount, endl;
+      stats.decoder.eviction.in_use++;
       continue;
     }
 
-    // We use '<=' to guarantee even a uniform distribution will eventually be reclaimed:
-    if likely (bb->lastused <= average) {
-      reclaimed_bytes += ptl_mm_getsize(bb);
-      reclaimed_objs++;
-      invalidate(bb, INVALIDATE_REASON_RECLAIM);
+    if (bb->referenced && (!everything)) {
+      bb->referenced = 0;
+      stats.decoder.eviction.second_chances++;
+      continue;
     }
-    n++;
-  }
 
-  if (DEBUG) {
-    logfile << "After:", endl;
-    logfile << "  Basic blocks:   ", intstring(reclaimed_objs, 12), " BBs reclaimed", endl;
-    logfile << "  Bytes occupied: ", intstring(reclaimed_bytes, 12), " bytes reclaimed", endl;
-    logfile << "  New pool size:  ", intstring(count, 12), " BBs", endl;
-    logfile.flush();
-  }
+    Waddr mfnlo = bb->rip.mfnlo;
+    Waddr mfnhi = bb->rip.mfnhi;
+    int page_crossing = ((lowbits(bb->rip, 12) + (bb->bytes-1)) >> 12);
+    W64 size = bb->memsize();
 
-  //
-  // Reclaim per-page chunklist heads
-  //
+    invalidate(bb, INVALIDATE_REASON_RECLAIM);
 
-  {
-    BasicBlockPageCache::Iterator iter(&bbpages);
-    BasicBlockChunkList* page;
-    int pages_freed = 0;
+    release_empty_page(mfnlo);
+    if (page_crossing) release_empty_page(mfnhi);
 
-    if (DEBUG) logfile << "Scanning ", bbpages.count, " code pages:", endl;
-    while (page = iter.next()) {
-      if (page->empty()) {
-        if (!page->refcount) {
-          if (DEBUG) logfile << "  mfn ", page->mfn, " has no entries; freeing", endl;
-          bbpages.remove(page);
-          delete page;
-          pages_freed++;
-        } else {
-          if (DEBUG) logfile << "  mfn ", page->mfn, " still has refs to it: cannot free it yet", endl;
-        }
-      }
-    }
-
-    if (DEBUG) logfile << "Freed ", pages_freed, " empty pages", endl;
+    reclaimed_bytes += size;
+    reclaimed_objs++;
   }
 
-  return n;
+  stats.decoder.eviction.blocks += reclaimed_objs;
+  stats.decoder.eviction.bytes += reclaimed_bytes;
+
+  if (logable(1)) logfile << "  Reclaimed ", reclaimed_objs, " basic blocks (", reclaimed_bytes, " bytes); ", count, " left (", bytes, " bytes)", endl;
+
+  return reclaimed_objs;
 }
 
 //
@@ -1608,7 +1596,7 @@ int BasicBlockCache::reclaim(size_t bytesreq, int urgency) {
 // references are allowed.
 //
 void BasicBlockCache::flush() {
-  bool DEBUG = 1;
+  bool DEBUG = logable(1);
 
   if (DEBUG) logfile << "Flushing basic block cache at ", sim_cycle, " cycles, ", total_user_insns_committed, " commits:", endl;
 
@@ -1627,18 +1615,33 @@ void BasicBlockCache::flush() {
   //
 
   {
-    BasicBlockPageCache::Iterator iter(&bbpages);
+    BasicBlockPageCache::Iterator iter(&pages);
     BasicBlockChunkList* page;
     int pages_freed = 0;
 
     while (page = iter.next()) {
       assert(page->empty());
-      bbpages.remove(page);
+      pages.remove(page);
       delete page;
     }
   }
 }
 
+//
+// Exchange all translations with another cache, e.g. those of another
+// guest address space set aside while it is not simulated. Blocks the
+// seq core chained together are only trusted within one generation, so
+// both caches start a new one.
+//
+void BasicBlockCache::swap(BasicBlockCache& other) {
+  OpenSelfHashtable<RIPVirtPhys, BasicBlock, BasicBlockHashtableLinkManager>::swap(other);
+  pages.swap(other.pages);
+  ::swap(clockhand, other.clockhand);
+  ::swap(bytes, other.bytes);
+  generation = max(generation, other.generation) + 1;
+  other.generation = generation;
+}
+
 void assist_exec_page_fault(Context& ctx) {
   //
   // We need to check if faultaddr is now a valid page, since the page tables
@@ -1998,6 +2001,412 @@ ostream& printflags(ostream& os, W64 flags) {
   return os;
 }
 
+//
+// Persistent basic block store
+//
+// The file holds a header, a bucket table (offsets of the first entry of
+// each hash chain) and the entries. Each entry has the code bytes the
+// block was decoded from: its own bytes plus what the decoder may have
+// looked at beyond them, or fewer if the valid code ended there, in which
+// case a match also needs the same number of valid bytes. Uops and the
+// block's direct branch targets hold code addresses relative to the
+// block's rip. Only 64-bit blocks which decoded without faults are kept.
+//
+// The header records decoder_build_hash, a hash of the decoder objects
+// made at link time: stores written by any other decoder build are
+// ignored. A store is checked entry by entry when mapped, and ignored as
+// a whole if any entry reachable from the buckets lies outside the file.
+//
+
+#define BB_STORE_MAGIC 0x5453424250534152ULL // "RASPBBST"
+#define BB_STORE_VERSION 2
+#define BB_STORE_LOOKAHEAD 16
+#define BB_STORE_BUCKETS 16384
+
+// Decoder statistics replayed when a block comes from the store:
+enum {
+  BB_STORE_STAT_DECODE_TYPE = 0,
+  BB_STORE_STAT_UOPS = DECODE_TYPE_COUNT,
+  BB_STORE_STAT_X86_INSNS,
+  BB_STORE_STAT_BYTES,
+  BB_STORE_STAT_ALL_INSNS_FAST,
+  BB_STORE_STAT_SOME_COMPLEX_INSNS,
+  BB_STORE_STAT_COUNT,
+};
+
+struct BasicBlockStoreHeader {
+  W64 magic;
+  W32 version;
+  W32 reserved;
+  W64 decoder_hash;          // decoder_build_hash
+  W32 bb_size;               // sizeof(BasicBlockBase)
+  W32 transop_size;          // sizeof(TransOp)
+  W32 bucket_count;          // followed by W32 buckets[bucket_count]
+  W32 entry_count;
+};
+
+struct BasicBlockStoreEntry {
+  W32 next;                  // file offset of the next entry in the chain, or 0
+  W32 hash;                  // of the mode and the first code bytes
+  W16 size;                  // of the whole entry, a multiple of 8 bytes
+  W16 window;                // code bytes which must match
+  byte mode;                 // see bbstore_mode()
+  byte reserved[3];
+  W32 stats[BB_STORE_STAT_COUNT];
+  BasicBlockBase bb;         // followed by code[window] (padded) and TransOp[bb.count]
+
+  byte* code() { return (byte*)(this + 1); }
+  TransOp* transops() { return (TransOp*)(code() + ceil(window, 8)); }
+};
+
+struct BasicBlockStoreLocalEntry {
+  BasicBlockStoreLocalEntry* next;
+  BasicBlockStoreEntry entry;
+};
+
+BasicBlockStore bbstore;
+
+// The parts of the block's RIPVirtPhys which the decoder depends on:
+static inline byte bbstore_mode(const RIPVirtPhys& rvp) {
+  return (rvp.use64) | (rvp.kernel << 1) | (rvp.df << 2);
+}
+
+static W32 bbstore_hash(const byte* code, int bytes, byte mode) {
+  CRC32 crc;
+  crc.update(mode);
+  crc.update((byte*)code, min(bytes, BB_STORE_LOOKAHEAD));
+  return crc;
+}
+
+static void capture_decoder_counts(W64* counts) {
+  foreach (i, DECODE_TYPE_COUNT) counts[BB_STORE_STAT_DECODE_TYPE + i] = stats.decoder.x86_decode_type[i];
+  counts[BB_STORE_STAT_UOPS] = stats.decoder.throughput.uops;
+  counts[BB_STORE_STAT_X86_INSNS] = stats.decoder.throughput.x86_insns;
+  counts[BB_STORE_STAT_BYTES] = stats.decoder.throughput.bytes;
+  counts[BB_STORE_STAT_ALL_INSNS_FAST] = stats.decoder.bb_decode_type.all_insns_fast;
+  counts[BB_STORE_STAT_SOME_COMPLEX_INSNS] = stats.decoder.bb_decode_type.some_complex_insns;
+}
+
+static void replay_decoder_counts(const W32* counts) {
+  foreach (i, DECODE_TYPE_COUNT) stats.decoder.x86_decode_type[i] += counts[BB_STORE_STAT_DECODE_TYPE + i];
+  stats.decoder.throughput.uops += counts[BB_STORE_STAT_UOPS];
+  stats.decoder.throughput.x86_insns += counts[BB_STORE_STAT_X86_INSNS];
+  stats.decoder.throughput.bytes += counts[BB_STORE_STAT_BYTES];
+  stats.decoder.bb_decode_type.all_insns_fast += counts[BB_STORE_STAT_ALL_INSNS_FAST];
+  stats.decoder.bb_decode_type.some_complex_insns += counts[BB_STORE_STAT_SOME_COMPLEX_INSNS];
+}
+
+//
+// Move the code addresses of a block by delta. The decoder only puts
+// code addresses into "add rd = trace,imm" uops (abs_code_addr_immediate())
+// and into the targets of direct branches; assists keep their assist id
+// in the branch target.
+//
+static void relocate_basic_block(BasicBlockBase& bb, TransOp* transops, W64s delta) {
+  if ((bb.type == BB_TYPE_COND) || (bb.type == BB_TYPE_UNCOND)) {
+    bb.rip_taken += delta;
+    bb.rip_not_taken += delta;
+  }
+
+  foreach (i, bb.count) {
+    TransOp& uop = transops[i];
+    if ((uop.opcode == OP_add) && (uop.ra == REG_trace) && (uop.rb == REG_imm)) {
+      uop.rbimm = signext64(uop.rbimm + delta, 48);
+    } else if ((uop.opcode == OP_br) || (uop.opcode == OP_bru)) {
+      uop.riptaken += delta;
+      uop.ripseq += delta;
+    }
+  }
+}
+
+static bool bbstore_entry_matches(BasicBlockStoreEntry& e, W32 hash, const byte* code, int valid_byte_count, byte mode) {
+  if ((e.hash != hash) || (e.mode != mode)) return false;
+  int window = min(valid_byte_count, e.bb.bytes + BB_STORE_LOOKAHEAD);
+  if (window != e.window) return false;
+  return (!memcmp(e.code(), code, window));
+}
+
+static BasicBlockStoreEntry* bbstore_find(W8* base, W32 hash, const byte* code, int valid_byte_count, byte mode) {
+  const BasicBlockStoreHeader& hdr = *(const BasicBlockStoreHeader*)base;
+  const W32* buckets = (const W32*)(base + sizeof(BasicBlockStoreHeader));
+
+  for (W32 offset = buckets[hash % hdr.bucket_count]; offset; ) {
+    BasicBlockStoreEntry& e = *(BasicBlockStoreEntry*)(base + offset);
+    if (bbstore_entry_matches(e, hash, code, valid_byte_count, mode)) return &e;
+    offset = e.next;
+  }
+
+  return null;
+}
+
+//
+// Whether the entry at offset, with its code and uops, lies within the
+// store's size bytes
+//
+static bool bbstore_entry_ok(const W8* base, W64 size, W64 offset) {
+  if ((offset > size) || ((size - offset) < sizeof(BasicBlockStoreEntry))) return false;
+  const BasicBlockStoreEntry& e = *(const BasicBlockStoreEntry*)(base + offset);
+  W64 payload = sizeof(BasicBlockStoreEntry) + ceil((W64)e.window, 8) + ((W64)e.bb.count * sizeof(TransOp));
+  return (e.size >= payload) && (e.size <= (size - offset));
+}
+
+//
+// Check every hash chain of a mapped store: each entry must lie within
+// the file, and chains only lead to later entries, so they end
+//
+static bool bbstore_check(const W8* base, W64 size) {
+  const BasicBlockStoreHeader& hdr = *(const BasicBlockStoreHeader*)base;
+  const W32* buckets = (const W32*)(base + sizeof(BasicBlockStoreHeader));
+  W64 first = sizeof(BasicBlockStoreHeader) + ((W64)hdr.bucket_count * sizeof(W32));
+
+  foreach (i, hdr.bucket_count) {
+    W64 prev = first - 1;
+    for (W32 offset = buckets[i]; offset; ) {
+      if ((offset <= prev) || (!bbstore_entry_ok(base, size, offset))) return false;
+      prev = offset;
+      offset = ((const BasicBlockStoreEntry*)(base + offset))->next;
+    }
+  }
+
+  return true;
+}
+
+//
+// Map a store file, if it exists, was made by this decoder build and is
+// intact
+//
+static W8* bbstore_map(const char* filename, W64& size) {
+  int fd = sys_open(filename, O_RDONLY, 0);
+  if (fd < 0) return null;
+
+  size = sys_seek(fd, 0, SEEK_END);
+  W8* base = (size >= sizeof(BasicBlockStoreHeader)) ? (W8*)sys_mmap(null, ceil(size, PAGE_SIZE), PROT_READ, MAP_SHARED, fd, 0) : null;
+  sys_close(fd);
+  if ((!base) || mmap_invalid(base)) return null;
+
+  const BasicBlockStoreHeader& hdr = *(const BasicBlockStoreHeader*)base;
+  if ((hdr.magic != BB_STORE_MAGIC) || (hdr.version != BB_STORE_VERSION) || (hdr.decoder_hash != decoder_build_hash) ||
+      (hdr.bb_size != sizeof(BasicBlockBase)) || (hdr.transop_size != sizeof(TransOp)) || (!hdr.bucket_count) ||
+      (sizeof(BasicBlockStoreHeader) + (W64)hdr.bucket_count * sizeof(W32) > size)) {
+    logfile << "Basic block store ", filename, " is from another version: ignored", endl;
+    sys_munmap(base, ceil(size, PAGE_SIZE));
+    return null;
+  }
+
+  if (!bbstore_check(base, size)) {
+    logfile << "Basic block store ", filename, " is truncated or corrupt: ignored", endl;
+    sys_munmap(base, ceil(size, PAGE_SIZE));
+    return null;
+  }
+
+  return base;
+}
+
+bool BasicBlockStore::open(const char* filename) {
+  close();
+  this->filename << filename;
+  local = new BasicBlockStoreLocalEntry*[BB_STORE_BUCKETS];
+  foreach (i, BB_STORE_BUCKETS) local[i] = null;
+  base = bbstore_map(filename, size);
+  return (base != null);
+}
+
+BasicBlock* BasicBlockStore::lookup(const RIPVirtPhys& rvp, const byte* insnbuf, int valid_byte_count) {
+  if unlikely (!rvp.use64) return null;
+
+  byte mode = bbstore_mode(rvp);
+  W32 hash = bbstore_hash(insnbuf, valid_byte_count, mode);
+  BasicBlockStoreEntry* e = (base) ? bbstore_find(base, hash, insnbuf, valid_byte_count, mode) : null;
+
+  if (!e) {
+    for (BasicBlockStoreLocalEntry* le = local[hash % BB_STORE_BUCKETS]; le; le = le->next) {
+      if (bbstore_entry_matches(le->entry, hash, insnbuf, valid_byte_count, mode)) { e = &le->entry; break; }
+    }
+  }
+
+  if (!e) {
+    stats.decoder.bbstore.misses++;
+    return null;
+  }
+
+  stats.decoder.bbstore.hits++;
+  replay_decoder_counts(e->stats);
+
+  BasicBlock* bb = (BasicBlock*)malloc(sizeof(BasicBlockBase) + (e->bb.count * sizeof(TransOp)));
+  memcpy(bb, &e->bb, sizeof(BasicBlockBase));
+  foreach (i, e->bb.count) bb->transops[i] = e->transops()[i];
+  relocate_basic_block(*bb, bb->transops, rvp.rip);
+
+  bb->rip = rvp;
+  bb->synthops = null;
+  bb->refcount = 0;
+  bb->chain[0] = null;
+  bb->chain[1] = null;
+  bb->chaingen = 0;
+  bb->use(0);
+  return bb;
+}
+
+void BasicBlockStore::add(const BasicBlock& bb, const byte* insnbuf, int valid_byte_count, const W64* statsbefore) {
+  if ((!bb.rip.use64) || bb.invalidblock) return;
+
+  int window = min(valid_byte_count, bb.bytes + BB_STORE_LOOKAHEAD);
+  W64 entrysize = sizeof(BasicBlockStoreEntry) + ceil(window, 8) + (bb.count * sizeof(TransOp));
+
+  BasicBlockStoreLocalEntry* le = (BasicBlockStoreLocalEntry*)malloc(sizeof(BasicBlockStoreLocalEntry) - sizeof(BasicBlockStoreEntry) + entrysize);
+  BasicBlockStoreEntry& e = le->entry;
+  memset(&e, 0, entrysize);
+
+  e.mode = bbstore_mode(bb.rip);
+  e.hash = bbstore_hash(insnbuf, valid_byte_count, e.mode);
+  e.size = entrysize;
+  e.window = window;
+
+  W64 counts[BB_STORE_STAT_COUNT];
+  capture_decoder_counts(counts);
+  foreach (i, BB_STORE_STAT_COUNT) e.stats[i] = counts[i] - statsbefore[i];
+
+  memcpy(&e.bb, &bb, sizeof(BasicBlockBase));
+  setzero(e.bb.rip);
+  e.bb.clocknext = null;
+  e.bb.clockprev = null;
+  e.bb.chain[0] = null;
+  e.bb.chain[1] = null;
+  e.bb.chaingen = 0;
+  e.bb.mfnlo_loc.reset();
+  e.bb.mfnhi_loc.reset();
+  e.bb.synthops = null;
+  e.bb.refcount = 0;
+  e.bb.hitcount = 0;
+  e.bb.predcount = 0;
+  e.bb.confidence = 0;
+  e.bb.lastused = 0;
+  e.bb.lasttarget = 0;
+
+  memcpy(e.code(), insnbuf, window);
+  foreach (i, bb.count) e.transops()[i] = bb.transops[i];
+  relocate_basic_block(e.bb, e.transops(), -(W64s)(Waddr)bb.rip.rip);
+
+  BasicBlockStoreLocalEntry*& head = local[e.hash % BB_STORE_BUCKETS];
+  le->next = head;
+  head = le;
+  local_count++;
+  stats.decoder.bbstore.inserts++;
+}
+
+//
+// Merge the blocks translated by this process into the store file. It
+// is read again first, since other processes may have saved since.
+//
+bool BasicBlockStore::save() {
+  if (!local_count) return true;
+
+  W64 cursize = 0;
+  W8* cur = bbstore_map(filename, cursize);
+
+  dynarray<BasicBlockStoreEntry*> entries;
+  if (cur) {
+    const BasicBlockStoreHeader& hdr = *(const BasicBlockStoreHeader*)cur;
+    entries.reserve(hdr.entry_count + local_count);
+    W64 offset = sizeof(BasicBlockStoreHeader) + hdr.bucket_count * sizeof(W32);
+    while (bbstore_entry_ok(cur, cursize, offset)) {
+      BasicBlockStoreEntry* e = (BasicBlockStoreEntry*)(cur + offset);
+      entries.push(e);
+      offset += e->size;
+    }
+  } else {
+    entries.reserve(local_count);
+  }
+
+  foreach (i, BB_STORE_BUCKETS) {
+    for (BasicBlockStoreLocalEntry* le = local[i]; le; le = le->next) {
+      BasicBlockStoreEntry& e = le->entry;
+      if (cur && bbstore_find(cur, e.hash, e.code(), e.window, e.mode)) continue;
+      entries.push(&e);
+    }
+  }
+
+  W32 bucket_count = BB_STORE_BUCKETS;
+  while (bucket_count < entries.length) bucket_count *= 2;
+
+  W64 total = sizeof(BasicBlockStoreHeader) + bucket_count * sizeof(W32);
+  W32* buckets = new W32[bucket_count];
+  W32* offsets = new W32[entries.length];
+  W32* next = new W32[entries.length];
+  foreach (i, bucket_count) buckets[i] = 0;
+  foreach (i, entries.length) {
+    offsets[i] = total;
+    total += entries[i]->size;
+  }
+
+  for (int i = entries.length-1; i >= 0; i--) {
+    W32& head = buckets[entries[i]->hash % bucket_count];
+    next[i] = head;
+    head = offsets[i];
+  }
+
+  stringbuf tempname;
+  tempname << filename, ".", sys_getpid();
+
+  bool ok = (total < (1ULL << 32));
+  odstream os;
+  if (ok) ok = os.open(tempname);
+
+  if (ok) {
+    BasicBlockStoreHeader hdr;
+    setzero(hdr);
+    hdr.magic = BB_STORE_MAGIC;
+    hdr.version = BB_STORE_VERSION;
+    hdr.decoder_hash = decoder_build_hash;
+    hdr.bb_size = sizeof(BasicBlockBase);
+    hdr.transop_size = sizeof(TransOp);
+    hdr.bucket_count = bucket_count;
+    hdr.entry_count = entries.length;
+    os.write(&hdr, sizeof(hdr));
+    os.write(buckets, bucket_count * sizeof(W32));
+
+    foreach (i, entries.length) {
+      BasicBlockStoreEntry e = *entries[i];
+      e.next = next[i];
+      os.write(&e, sizeof(e));
+      os.write(entries[i] + 1, entries[i]->size - sizeof(BasicBlockStoreEntry));
+    }
+
+    os.close();
+    ok = (sys_rename(tempname, filename) == 0);
+    if (!ok) sys_unlink(tempname);
+  }
+
+  if (!ok) logfile << "Warning: cannot save basic block store ", filename, endl;
+
+  delete[] buckets;
+  delete[] offsets;
+  delete[] next;
+  if (cur) sys_munmap(cur, ceil(cursize, PAGE_SIZE));
+  return ok;
+}
+
+void BasicBlockStore::close() {
+  if (base) sys_munmap(base, ceil(size, PAGE_SIZE));
+  base = null;
+  size = 0;
+
+  if (local) {
+    foreach (i, BB_STORE_BUCKETS) {
+      BasicBlockStoreLocalEntry* le = local[i];
+      while (le) {
+        BasicBlockStoreLocalEntry* next = le->next;
+        ::free(le);
+        le = next;
+      }
+    }
+    delete[] local;
+  }
+  local = null;
+  local_count = 0;
+  filename.reset();
+}
+
 //
 // Translate one basic block. This function always returns
 // a BasicBlock, except in the very rare case where one or
@@ -2041,14 +2450,23 @@ BasicBlock* BasicBlockCache::translate(Context& ctx, const RIPVirtPhys& rvp) {
     assert(trans.valid_byte_count == 0);
   }
 
-  for (;;) {
-    // if (DEBUG) logfile << "rip ", (void*)trans.rip, ", relrip = ", (void*)(trans.rip - trans.bb.rip), endl;
-    if (!trans.translate()) break;
-  }
+  bb = (bbstore.enabled()) ? bbstore.lookup(rvp, insnbuf, trans.valid_byte_count) : null;
 
-  trans.bb.hitcount = 0;
-  trans.bb.predcount = 0;
-  bb = trans.bb.clone();
+  if (!bb) {
+    W64 statsbefore[BB_STORE_STAT_COUNT];
+    if (bbstore.enabled()) capture_decoder_counts(statsbefore);
+
+    for (;;) {
+      // if (DEBUG) logfile << "rip ", (void*)trans.rip, ", relrip = ", (void*)(trans.rip - trans.bb.rip), endl;
+      if (!trans.translate()) break;
+    }
+
+    trans.bb.hitcount = 0;
+    trans.bb.predcount = 0;
+    bb = trans.bb.clone();
+
+    if (bbstore.enabled()) bbstore.add(*bb, insnbuf, trans.valid_byte_count, statsbefore);
+  }
   //
   // Acquire a reference to the new basic block right away,
   // since we make allocations below that might reclaim it
@@ -2057,6 +2475,7 @@ BasicBlock* BasicBlockCache::translate(Context& ctx, const RIPVirtPhys& rvp) {
   bb->acquire();
 
   add(bb);
+  clock_insert(bb);
   stats.decoder.bbcache.count = this->count;
   stats.decoder.bbcache.inserts++;
 
@@ -2065,13 +2484,13 @@ BasicBlock* BasicBlockCache::translate(Context& ctx, const RIPVirtPhys& rvp) {
   BasicBlockChunkList* pagelist;
 
   //smc_cleardirty(bb->rip.mfnlo);
-  pagelist = bbpages.get(bb->rip.mfnlo);
+  pagelist = pages.get(bb->rip.mfnlo);
   if (!pagelist) {
     pagelist = new BasicBlockChunkList(bb->rip.mfnlo);
     pagelist->refcount++;
-    bbpages.add(pagelist);
+    pages.add(pagelist);
     stats.decoder.pagecache.inserts++;
-    stats.decoder.pagecache.count = bbpages.count;
+    stats.decoder.pagecache.count = pages.count;
     pagelist->refcount--;
   }
   pagelist->refcount++;
@@ -2089,13 +2508,13 @@ BasicBlock* BasicBlockCache::translate(Context& ctx, const RIPVirtPhys& rvp) {
 
   if (page_crossing) {
     //smc_cleardirty(bb->rip.mfnhi);
-    BasicBlockChunkList* pagelisthi = bbpages.get(bb->rip.mfnhi);
+    BasicBlockChunkList* pagelisthi = pages.get(bb->rip.mfnhi);
     if (!pagelisthi) {
       pagelisthi = new BasicBlockChunkList(bb->rip.mfnhi);
       pagelisthi->refcount++;
-      bbpages.add(pagelisthi);
+      pages.add(pagelisthi);
       stats.decoder.pagecache.inserts++;
-      stats.decoder.pagecache.count = bbpages.count;
+      stats.decoder.pagecache.count = pages.count;
       pagelisthi->refcount--;
     }
     pagelisthi->refcount++;
@@ -2109,7 +2528,16 @@ BasicBlock* BasicBlockCache::translate(Context& ctx, const RIPVirtPhys& rvp) {
   if (logable(5)) {
     logfile << "=====================================================================", endl;
     logfile << *bb, endl;
-    logfile << "End of basic block: rip ", trans.bb.rip, " -> taken rip 0x", (void*)(Waddr)trans.bb.rip_taken, ", not taken rip 0x", (void*)(Waddr)trans.bb.rip_not_taken, endl;
+    logfile << "End of basic block: rip ", bb->rip, " -> taken rip 0x", (void*)(Waddr)bb->rip_taken, ", not taken rip 0x", (void*)(Waddr)bb->rip_not_taken, endl;
+  }
+
+  //
+  // Stay within the byte budget; the new block is still
+  // acquired, so the clock hand passes over it.
+  //
+  if unlikely (config.bbcache_budget && (bytes > config.bbcache_budget)) {
+    stats.decoder.eviction.over_budget++;
+    reclaim(bytes - config.bbcache_budget + (config.bbcache_budget / 16));
   }
 
   translate_timer.stop();
@@ -2234,4 +2662,8 @@ void init_decode() {
 void shutdown_decode() {
   bbcache.flush();
   if (bbcache_dump_file) bbcache_dump_file.close();
+  if (bbstore.enabled()) {
+    bbstore.save();
+    bbstore.close();
+  }
 }
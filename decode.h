@@ -492,40 +492,35 @@ void assist_ioport_out(Context& ctx);
 void init_decode();
 void shutdown_decode();
 
-static const int BB_CACHE_SIZE = 16384;
-
 namespace superstl {
-  template <int setcount>
-  struct HashtableKeyManager<RIPVirtPhys, setcount> {
-    static inline int hash(const RIPVirtPhys& key) {
-      W64 rip = key.rip;
-      W64 slot = foldbits<log2(setcount)>(rip);
+  template <>
+  struct OpenHashtableKeyManager<RIPVirtPhys> {
+    static inline W64 hash(const RIPVirtPhys& key) {
+      W64 h = key.rip;
 #ifdef PTLSIM_HYPERVISOR
-      slot ^= key.mfnlo;
+      h ^= ((W64)key.mfnlo << 36);
 #endif
-      return slot;
+      return mixbits64(h);
     }
 
     static inline bool equal(const RIPVirtPhys& a, const RIPVirtPhys& b) { return (a == b); }
-    static inline RIPVirtPhys dup(const RIPVirtPhys& key) { return key; }
-    static inline void free(RIPVirtPhys& key) { }
   };
 };
 
 struct BasicBlockHashtableLinkManager {
-  static inline BasicBlock* objof(selflistlink* link) {
-    return baseof(BasicBlock, hashlink, link);
-  }
-
   static inline RIPVirtPhys& keyof(BasicBlock* obj) {
     return obj->rip;
   }
+};
 
-  static inline selflistlink* linkof(BasicBlock* obj) {
-    return &obj->hashlink;
+struct BasicBlockChunkListHashtableLinkManager {
+  static inline W64& keyof(BasicBlockChunkList* obj) {
+    return obj->mfn;
   }
 };
 
+typedef OpenSelfHashtable<W64, BasicBlockChunkList, BasicBlockChunkListHashtableLinkManager> BasicBlockPageCache;
+
 enum {
   INVALIDATE_REASON_SMC = 0,
   INVALIDATE_REASON_DMA,
@@ -536,8 +531,16 @@ enum {
   INVALIDATE_REASON_COUNT
 };
 
-struct BasicBlockCache: public SelfHashtable<RIPVirtPhys, BasicBlock, BB_CACHE_SIZE, BasicBlockHashtableLinkManager> {
-  BasicBlockCache(): SelfHashtable<RIPVirtPhys, BasicBlock, BB_CACHE_SIZE, BasicBlockHashtableLinkManager>() { }
+struct BasicBlockCache: public OpenSelfHashtable<RIPVirtPhys, BasicBlock, BasicBlockHashtableLinkManager> {
+  // Blocks in insertion order around a ring; see reclaim():
+  BasicBlock* clockhand;
+  W64 bytes;
+  // Bumped whenever a block is freed: pointers to blocks saved earlier are stale
+  W64 generation;
+  // Blocks on each code page, by mfn:
+  BasicBlockPageCache pages;
+
+  BasicBlockCache(): OpenSelfHashtable<RIPVirtPhys, BasicBlock, BasicBlockHashtableLinkManager>() { clockhand = null; bytes = 0; generation = 1; }
 
   BasicBlock* translate(Context& ctx, const RIPVirtPhys& rvp);
   void translate_in_place(BasicBlock& targetbb, Context& ctx, Waddr rip);
@@ -548,12 +551,47 @@ struct BasicBlockCache: public SelfHashtable<RIPVirtPhys, BasicBlock, BB_CACHE_S
   int get_page_bb_count(Waddr mfn);
   int reclaim(size_t reqbytes = 0, int urgency = 0);
   void flush();
+  void swap(BasicBlockCache& other);
+protected:
+  void clock_insert(BasicBlock* bb);
+  void clock_remove(BasicBlock* bb);
+public:
 
   ostream& print(ostream& os);
 };
 
 extern BasicBlockCache bbcache;
 
+//
+// Persistent store of translations (-bbstore <file>), shared by all
+// runs and processes using the same file. Blocks are found by their
+// code bytes and decode mode rather than their address: code addresses
+// in the uops are kept relative to the block start. The store file is
+// mapped read only; blocks translated by this process are merged into
+// it (under a new name, then renamed over it) by save().
+//
+struct BasicBlockStoreLocalEntry;
+
+struct BasicBlockStore {
+  stringbuf filename;
+  W8* base;
+  W64 size;
+  // Blocks translated since the store was mapped, by hash bucket:
+  BasicBlockStoreLocalEntry** local;
+  int local_count;
+
+  BasicBlockStore(): base(null), size(0), local(null), local_count(0) { }
+
+  bool enabled() const { return filename.set(); }
+  bool open(const char* filename);
+  BasicBlock* lookup(const RIPVirtPhys& rvp, const byte* insnbuf, int valid_byte_count);
+  void add(const BasicBlock& bb, const byte* insnbuf, int valid_byte_count, const W64* statsbefore);
+  bool save();
+  void close();
+};
+
+extern BasicBlockStore bbstore;
+
 extern odstream bbcache_dump_file;
 
 //
@@ -229,6 +229,47 @@ inline vec16b x86_sse_onesb() { vec16b rd; asm("pcmpeqb %[rd],%[rd]" : [rd] "+x"
 inline vec8w x86_sse_zerow() { vec8w rd; asm("pxor %[rd],%[rd]" : [rd] "+x" (rd)); return rd; }
 inline vec8w x86_sse_onesw() { vec8w rd; asm("pcmpeqw %[rd],%[rd]" : [rd] "+x" (rd)); return rd; }
 
+//
+// AVX2 and AVX-512 (BW, VL) versions of the associative search
+// primitives. These may only be called from functions compiled with
+// the matching x86_avx2 or x86_avx512 attribute, after checking
+// host_simd: the rest of PTLsim still targets SSE2 hosts.
+//
+typedef byte v32qi __attribute__ ((vector_size(32)));
+typedef v32qi vec32b;
+typedef W16 v16hi __attribute__ ((vector_size(32)));
+typedef v16hi vec16w;
+typedef byte v64qi __attribute__ ((vector_size(64)));
+typedef v64qi vec64b;
+typedef W16 v32hi __attribute__ ((vector_size(64)));
+typedef v32hi vec32w;
+
+#define x86_avx2 __attribute__ ((target("avx2")))
+#define x86_avx512 __attribute__ ((target("avx2,avx512f,avx512bw,avx512vl")))
+
+enum { HOST_SIMD_SSE2, HOST_SIMD_AVX2, HOST_SIMD_AVX512 };
+extern int host_simd;
+int detect_host_simd();
+
+x86_avx2 inline vec32b x86_avx_dupb(vec16b a) { vec32b rd; asm("vpbroadcastb %[a],%[rd]" : [rd] "=x" (rd) : [a] "x" (a)); return rd; }
+x86_avx2 inline vec16w x86_avx_dupw(vec8w a) { vec16w rd; asm("vpbroadcastw %[a],%[rd]" : [rd] "=x" (rd) : [a] "x" (a)); return rd; }
+x86_avx2 inline vec32b x86_avx_pcmpeqb(vec32b a, const void* m) { asm("vpcmpeqb %[m],%[a],%[a]" : [a] "+x" (a) : [m] "m" (*(const vec32b*)m)); return a; }
+x86_avx2 inline vec32b x86_avx_pandb(vec32b a, vec32b b) { asm("vpand %[b],%[a],%[a]" : [a] "+x" (a) : [b] "x" (b)); return a; }
+x86_avx2 inline W32 x86_avx_pmovmskb(vec32b vec) { W32 mask; asm("vpmovmskb %[vec],%[mask]" : [mask] "=r" (mask) : [vec] "x" (vec)); return mask; }
+// One bit per word: packsswb works within each 128-bit lane, leaving the high lane's bits at 16-23
+x86_avx2 inline W32 x86_avx_pcmpeqw_mask(vec16w a, const void* m) { W32 mask; asm("vpcmpeqw %[m],%[a],%[a]; vpacksswb %[a],%[a],%[a]; vpmovmskb %[a],%[mask]" : [mask] "=r" (mask), [a] "+x" (a) : [m] "m" (*(const vec16w*)m)); return (mask & 0xff) | ((mask >> 8) & 0xff00); }
+x86_avx2 inline vec32b x86_avx_ldvbu(const void* m) { vec32b rd; asm("vmovdqu %[m],%[rd]" : [rd] "=x" (rd) : [m] "m" (*(const vec32b*)m)); return rd; }
+x86_avx2 inline void x86_avx_stvbu(void* m, const vec32b ra) { asm("vmovdqu %[ra],%[m]" : [m] "=m" (*(vec32b*)m) : [ra] "x" (ra) : "memory"); }
+
+x86_avx512 inline vec64b x86_avx512_dupb(vec16b a) { vec64b rd; asm("vpbroadcastb %[a],%[rd]" : [rd] "=v" (rd) : [a] "v" (a)); return rd; }
+x86_avx512 inline vec32w x86_avx512_dupw(vec8w a) { vec32w rd; asm("vpbroadcastw %[a],%[rd]" : [rd] "=v" (rd) : [a] "v" (a)); return rd; }
+#ifdef __x86_64__
+x86_avx512 inline W64 x86_avx512_pcmpeqb_mask(vec64b a, const void* m) { W64 mask; asm("vpcmpeqb %[m],%[a],%%k1; kmovq %%k1,%[mask]" : [mask] "=r" (mask) : [a] "v" (a), [m] "m" (*(const vec64b*)m) : "k1"); return mask; }
+#else
+x86_avx512 inline W64 x86_avx512_pcmpeqb_mask(vec64b a, const void* m) { W32 lo, hi; asm("vpcmpeqb %[m],%[a],%%k1; kshiftrq $32,%%k1,%%k2; kmovd %%k1,%[lo]; kmovd %%k2,%[hi]" : [lo] "=r" (lo), [hi] "=r" (hi) : [a] "v" (a), [m] "m" (*(const vec64b*)m) : "k1", "k2"); return ((W64)hi << 32) | lo; }
+#endif
+x86_avx512 inline W32 x86_avx512_pcmpeqw_mask(vec32w a, const void* m) { W32 mask; asm("vpcmpeqw %[m],%[a],%%k1; kmovd %%k1,%[mask]" : [mask] "=r" (mask) : [a] "v" (a), [m] "m" (*(const vec32w*)m) : "k1"); return mask; }
+
 // If lddqu is available (SSE3: Athlon 64 (some cores, like X2), Pentium 4 Prescott), use that instead. It may be faster. 
 
 extern const byte byte_to_vec16b[256][16];
@@ -1729,6 +1729,7 @@ W64 handle_ptlcall(W64 rip, W64 callid, W64 arg1, W64 arg2, W64 arg3, W64 arg4,
   }
   case PTLCALL_MARKER: {
     logfile << "  MARKER: iteration ", iterations, ", cycle ", sim_cycle, ", user commits ", total_user_insns_committed, endl;
+    if (sequential_mode && (arg1 == config.sequential_mode_marker)) sequential_mode_marker_hit = 1;
     break;
   };
   case PTLCALL_SWITCH_TO_SIM: {
@@ -2271,7 +2272,8 @@ void init_signal_callback() {
 bool check_for_async_sim_break() {
   if unlikely ((sim_cycle >= config.stop_at_cycle) |
                (iterations >= config.stop_at_iteration) |
-               (total_user_insns_committed >= config.stop_at_user_insns)) {
+               (total_user_insns_committed >= config.stop_at_user_insns) |
+               sequential_mode_marker_hit) {
     logfile << "Stopping simulation loop at specified limits (", iterations, " iterations, ", total_user_insns_committed, " commits)", endl;
     return true;
   }
@@ -1415,9 +1415,13 @@ int format_float(char* buf, int bufsize, double v, int precision, int pad) {
   buf[n] = '.';
   total++;
   remaining--;
-  n = format_integer(buf + n + 1, max(min(remaining, precision+1), 0), fracint, 0, 0);
+  // The fraction has logM digits, including any leading zeros (but 0 is just "0"):
+  char fracbuf[32];
+  format_integer(fracbuf, sizeof(fracbuf), fracint, (fracint) ? logM : 0, FMT_ZEROPAD);
+  n = max(min(remaining - 1, min(precision, (int)strlen(fracbuf))), 0);
+  memcpy(buf + total - signbit, fracbuf, n);
   total += n;
-  buf[total] = 0;
+  buf[total - signbit] = 0;
   return total;
 }
 
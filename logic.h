@@ -490,6 +490,10 @@ stringbuf& operator <<(stringbuf& sb, const FullyAssociativeTags<T, ways>& tags)
 // for best performance. Both classes use the
 // same principle for very fast one-hot matching.
 //
+// On AVX2 or AVX-512 hosts (see host_simd), arrays
+// filling whole 32 or 64 entry blocks are matched
+// one block at a time instead.
+//
 // Limitations:
 //
 // - Every tag in the array must be unique,
@@ -512,6 +516,10 @@ struct FullyAssociativeTagsNbitOneHot {
   static const int chunkcount = (size+15) / 16;
   static const int padchunkcount = (padsize+15) / 16;
 
+  // Wide (AVX2, AVX-512) searches only pay off from 64 bytes of tags up:
+  static const bool avx2_blocks = ((chunkcount % 2) == 0) & (chunkcount >= 4);
+  static const bool avx512_blocks = ((chunkcount % 4) == 0);
+
   vec16b tags[slices][chunkcount + padchunkcount] alignto(16);
   base_t tagsmirror[size]; // for fast scalar access
   bitvec<size> valid;
@@ -529,6 +537,9 @@ struct FullyAssociativeTagsNbitOneHot {
   }
 
   int match(const vec16b* targetslices) const {
+    if likely ((host_simd >= HOST_SIMD_AVX512) & avx512_blocks) return match_avx512(targetslices);
+    if likely ((host_simd >= HOST_SIMD_AVX2) & avx2_blocks) return match_avx2(targetslices);
+
     vec16b sum = x86_sse_zerob();
 
     foreach (i, chunkcount) {
@@ -544,6 +555,33 @@ struct FullyAssociativeTagsNbitOneHot {
     return idx-1;
   }
 
+  x86_avx2 int match_avx2(const vec16b* targetslices) const {
+    vec32b t[slices];
+    foreach (j, slices) t[j] = x86_avx_dupb(targetslices[j]);
+
+    foreach (i, chunkcount / 2) {
+      vec32b eq = x86_avx_pcmpeqb(t[0], &tags[0][i*2]);
+      for (int j = 1; j < slices; j++) eq = x86_avx_pandb(eq, x86_avx_pcmpeqb(t[j], &tags[j][i*2]));
+      W32 m = x86_avx_pmovmskb(eq);
+      if (m) return (i*32) + lsbindex32(m);
+    }
+
+    return -1;
+  }
+
+  x86_avx512 int match_avx512(const vec16b* targetslices) const {
+    vec64b t[slices];
+    foreach (j, slices) t[j] = x86_avx512_dupb(targetslices[j]);
+
+    foreach (i, chunkcount / 4) {
+      W64 m = x86_avx512_pcmpeqb_mask(t[0], &tags[0][i*4]);
+      for (int j = 1; j < slices; j++) m &= x86_avx512_pcmpeqb_mask(t[j], &tags[j][i*4]);
+      if (m) return (i*64) + lsbindex64(m);
+    }
+
+    return -1;
+  }
+
   static void prep(vec16b* targetslices, base_t tag) {
     foreach (i, slices) {
       targetslices[i] = x86_sse_dupb((byte)tag);
@@ -1534,6 +1572,10 @@ struct FullyAssociativeTags8bit {
   static const int chunkcount = (size+15) / 16;
   static const int padchunkcount = (padsize+15) / 16;
 
+  // Wide (AVX2, AVX-512) searches only pay off from 64 bytes of tags up:
+  static const bool avx2_blocks = ((chunkcount % 2) == 0) & (chunkcount >= 4);
+  static const bool avx512_blocks = ((chunkcount % 4) == 0);
+
   vec_t tags[chunkcount + padchunkcount] alignto(16);
   bitvec<size> valid;
 
@@ -1578,6 +1620,9 @@ struct FullyAssociativeTags8bit {
   }
 
   bitvec<size> match(const vec_t target) const {
+    if likely ((host_simd >= HOST_SIMD_AVX512) & avx512_blocks) return match_avx512(target);
+    if likely ((host_simd >= HOST_SIMD_AVX2) & avx2_blocks) return match_avx2(target);
+
     bitvec<size> m = 0;
 
     foreach (i, chunkcount) {
@@ -1587,6 +1632,28 @@ struct FullyAssociativeTags8bit {
     return m & valid;
   }
 
+  x86_avx2 bitvec<size> match_avx2(const vec_t target) const {
+    vec32b t = x86_avx_dupb(target);
+    bitvec<size> m = 0;
+
+    foreach (i, chunkcount / 2) {
+      m = m.accum(i*32, 32, x86_avx_pmovmskb(x86_avx_pcmpeqb(t, &tags[i*2])));
+    }
+
+    return m & valid;
+  }
+
+  x86_avx512 bitvec<size> match_avx512(const vec_t target) const {
+    vec64b t = x86_avx512_dupb(target);
+    bitvec<size> m = 0;
+
+    foreach (i, chunkcount / 4) {
+      m = m.accum(i*64, 64, x86_avx512_pcmpeqb_mask(t, &tags[i*4]));
+    }
+
+    return m & valid;
+  }
+
   bitvec<size> match(base_t target) const {
     return match(prep(target));
   }
@@ -1645,6 +1712,24 @@ struct FullyAssociativeTags8bit {
     return invalidate(prep(target));
   }
 
+  //
+  // Invalidate the target in each of <count> arrays (e.g. one per
+  // issue queue operand), with one wide call for all of them.
+  //
+  static void invalidate_each(FullyAssociativeTags8bit* arrays, int count, const vec_t target) {
+    if likely ((host_simd >= HOST_SIMD_AVX512) & avx512_blocks) { invalidate_each_avx512(arrays, count, target); return; }
+    if likely ((host_simd >= HOST_SIMD_AVX2) & avx2_blocks) { invalidate_each_avx2(arrays, count, target); return; }
+    foreach (i, count) arrays[i].invalidate(target);
+  }
+
+  x86_avx2 static void invalidate_each_avx2(FullyAssociativeTags8bit* arrays, int count, const vec_t target) {
+    foreach (i, count) arrays[i].invalidatemask(arrays[i].match_avx2(target));
+  }
+
+  x86_avx512 static void invalidate_each_avx512(FullyAssociativeTags8bit* arrays, int count, const vec_t target) {
+    foreach (i, count) arrays[i].invalidatemask(arrays[i].match_avx512(target));
+  }
+
   void collapse(int index) {
     base_t* tagbase = (base_t*)&tags;
     base_t* base = tagbase + index;
@@ -1696,6 +1781,10 @@ struct FullyAssociativeTags16bit {
   static const int chunkcount = ((size*2)+15) / 16;
   static const int padchunkcount = ((padsize*2)+15) / 16;
 
+  // Wide (AVX2, AVX-512) searches only pay off from 64 bytes of tags up:
+  static const bool avx2_blocks = ((chunkcount % 2) == 0) & (chunkcount >= 4);
+  static const bool avx512_blocks = ((chunkcount % 4) == 0);
+
   vec_t tags[chunkcount + padchunkcount] alignto(16);
   bitvec<size> valid;
 
@@ -1740,6 +1829,9 @@ struct FullyAssociativeTags16bit {
   }
 
   bitvec<size> match(const vec_t target) const {
+    if likely ((host_simd >= HOST_SIMD_AVX512) & avx512_blocks) return match_avx512(target);
+    if likely ((host_simd >= HOST_SIMD_AVX2) & avx2_blocks) return match_avx2(target);
+
     bitvec<size> m = 0;
 
     foreach (i, chunkcount) {
@@ -1749,6 +1841,28 @@ struct FullyAssociativeTags16bit {
     return m & valid;
   }
 
+  x86_avx2 bitvec<size> match_avx2(const vec_t target) const {
+    vec16w t = x86_avx_dupw(target);
+    bitvec<size> m = 0;
+
+    foreach (i, chunkcount / 2) {
+      m = m.accum(i*16, 16, x86_avx_pcmpeqw_mask(t, &tags[i*2]));
+    }
+
+    return m & valid;
+  }
+
+  x86_avx512 bitvec<size> match_avx512(const vec_t target) const {
+    vec32w t = x86_avx512_dupw(target);
+    bitvec<size> m = 0;
+
+    foreach (i, chunkcount / 4) {
+      m = m.accum(i*32, 32, x86_avx512_pcmpeqw_mask(t, &tags[i*4]));
+    }
+
+    return m & valid;
+  }
+
   bitvec<size> match(base_t target) const {
     return match(prep(target));
   }
@@ -1807,6 +1921,24 @@ struct FullyAssociativeTags16bit {
     return invalidate(prep(target));
   }
 
+  //
+  // Invalidate the target in each of <count> arrays (e.g. one per
+  // issue queue operand), with one wide call for all of them.
+  //
+  static void invalidate_each(FullyAssociativeTags16bit* arrays, int count, const vec_t target) {
+    if likely ((host_simd >= HOST_SIMD_AVX512) & avx512_blocks) { invalidate_each_avx512(arrays, count, target); return; }
+    if likely ((host_simd >= HOST_SIMD_AVX2) & avx2_blocks) { invalidate_each_avx2(arrays, count, target); return; }
+    foreach (i, count) arrays[i].invalidate(target);
+  }
+
+  x86_avx2 static void invalidate_each_avx2(FullyAssociativeTags16bit* arrays, int count, const vec_t target) {
+    foreach (i, count) arrays[i].invalidatemask(arrays[i].match_avx2(target));
+  }
+
+  x86_avx512 static void invalidate_each_avx512(FullyAssociativeTags16bit* arrays, int count, const vec_t target) {
+    foreach (i, count) arrays[i].invalidatemask(arrays[i].match_avx512(target));
+  }
+
   void collapse(int index) {
     base_t* tagbase = (base_t*)&tags;
     base_t* base = tagbase + index;
@@ -1507,6 +1507,9 @@ void ptl_mm_free(void* p, void* caller) {
 
   static const bool DEBUG = 0;
 
+  // As in libc (e.g. a dynarray that never allocated):
+  if unlikely (!p) return;
+
   if likely (sa = SlabAllocator::pointer_to_slaballoc(p)) {
     //
     // From slab allocation pool: all objects on a given page are the same size
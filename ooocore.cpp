@@ -89,7 +89,11 @@ static void init_luts() {
   }
 }
 
-void ThreadContext::reset() {
+//
+// With keep_warm_state, the branch predictor keeps its training
+// (after -warmup); all in-flight state is reset either way.
+//
+void ThreadContext::reset(bool keep_warm_state) {
   setzero(specrrt);
   setzero(commitrrt);
 
@@ -120,7 +124,7 @@ void ThreadContext::reset() {
   dispatch_deadlock_countdown = 0;    
   issueq_count = 0;
   queued_mem_lock_release_count = 0;
-  branchpred.init();
+  if (!keep_warm_state) branchpred.init();
 }
 
 void ThreadContext::init() {
@@ -146,10 +150,16 @@ void ThreadContext::init() {
   reset();
 }
 
-void OutOfOrderCore::reset() {
+void OutOfOrderCore::reset(bool keep_warm_state) {
   round_robin_tid = 0;
   round_robin_reg_file_offset = 0;
-  caches.reset();
+  if (keep_warm_state) {
+    // Keep the cache and TLB contents, but not the misses in flight:
+    caches.lfrq.reset();
+    caches.missbuf.reset();
+  } else {
+    caches.reset();
+  }
   caches.callback = &cache_callbacks;
   setzero(robs_on_fu);
   foreach_issueq(reset(coreid));
@@ -160,9 +170,9 @@ void OutOfOrderCore::reset() {
   foreach_issueq(set_reserved_entries(reserved_iq_entries * MAX_THREADS_PER_CORE));
   foreach_issueq(reset_shared_entries());
 
-  unaligned_predictor.reset();
+  if (!keep_warm_state) unaligned_predictor.reset();
 
-  foreach (i, threadcount) threads[i]->reset();
+  foreach (i, threadcount) threads[i]->reset(keep_warm_state);
 }
 
 void OutOfOrderCore::init_generic() {
@@ -367,7 +377,6 @@ bool OutOfOrderCore::runcycle() {
   //
   // Backend and issue pipe stages run with round robin priority
   //
-  int commitrc[MAX_THREADS_PER_CORE];
   commitcount = 0;
   writecount = 0;
 
@@ -595,6 +604,82 @@ bool OutOfOrderCore::runcycle() {
   return exiting;
 }
 
+//
+// Count the cycles after this one that are certain to be idle while
+// waiting on long latency operations: nothing can issue, dispatch,
+// rename, fetch, complete or write back, so the only state that changes
+// is the countdown of uops in the frontend and the functional units and
+// of misses in the miss buffer. The commit stage is not covered here:
+// the caller has to check that it did nothing in the first of these
+// cycles (see OutOfOrderMachine::run()).
+//
+int OutOfOrderCore::idle_cycles() {
+  if unlikely (threadcount != 1) return 0;
+
+  ThreadContext& thread = *threads[0];
+  if unlikely (!thread.ctx.running) return 0;
+
+  if unlikely (!thread.rob_tlb_miss_list.empty()) return 0;
+
+  // Rename and fetch must both be stalled:
+  if unlikely (!thread.rename_stalled()) return 0;
+  if unlikely (!(thread.stall_frontend | thread.waiting_for_icache_fill | (!thread.fetchq.remaining()))) return 0;
+
+  // Memory fences wake up when they reach the head of the ROB:
+  if unlikely ((!thread.ROB.empty()) && (thread.ROB.peekhead()->uop.opcode == OP_mf)) return 0;
+
+  bool ready = 0;
+  for_each_cluster(i) {
+    bool r;
+    issueq_operation_on_cluster_with_result((*this), i, r, allready.nonzero());
+    ready |= r;
+  }
+  if unlikely (ready) return 0;
+
+  int n = caches.idle_cycles();
+
+  // Dispatch may only be waiting for issue queue entries (until its deadlock timeout):
+  ReorderBufferEntry* rob;
+  if unlikely (!thread.rob_ready_to_dispatch_list.empty()) {
+    int avail[MAX_CLUSTERS];
+    sched_get_all_issueq_free_slots(avail);
+    foreach_list_mutable(thread.rob_ready_to_dispatch_list, rob, entry, nextentry) {
+      // As in ReorderBufferEntry::select_cluster(), for the first uop:
+      foreach (i, MAX_CLUSTERS) {
+        if unlikely (((MAX_CLUSTERS == 1) | bit(rob->executable_on_cluster_mask, i)) & (avail[i] > 0)) return 0;
+      }
+      break;
+    }
+    n = min(n, thread.dispatch_deadlock_countdown - 1);
+  }
+
+  for_each_cluster(i) {
+    if unlikely (!(thread.rob_completed_list[i].empty() & thread.rob_ready_to_writeback_list[i].empty())) return 0;
+    foreach_list_mutable(thread.rob_issued_list[i], rob, entry, nextentry) n = min(n, rob->cycles_left - 1);
+  }
+
+  foreach_list_mutable(thread.rob_frontend_list, rob, entry, nextentry) n = min(n, (int)rob->cycles_left);
+
+  return max(n, 0);
+}
+
+//
+// Advance the countdowns by n cycles counted by idle_cycles():
+//
+void OutOfOrderCore::skip_idle_cycles(int n) {
+  ThreadContext& thread = *threads[0];
+  ReorderBufferEntry* rob;
+
+  if unlikely (!thread.rob_ready_to_dispatch_list.empty()) thread.dispatch_deadlock_countdown -= n;
+
+  for_each_cluster(i) {
+    foreach_list_mutable(thread.rob_issued_list[i], rob, entry, nextentry) rob->cycles_left -= n;
+  }
+  foreach_list_mutable(thread.rob_frontend_list, rob, entry, nextentry) rob->cycles_left -= n;
+
+  caches.skip_idle_cycles(n);
+}
+
 //
 // ReorderBufferEntry
 //
@@ -1040,6 +1125,12 @@ bool ThreadContext::handle_exception() {
   // Flush again, but restart at modified rip
   flush_pipeline();
 
+#ifndef PTLSIM_HYPERVISOR
+  if (requested_switch_to_native) {
+    logfile << "Exception requested switch to native mode at rip ", (void*)(Waddr)ctx.commitarf[REG_rip], endl;
+    return false;
+  }
+#endif
   return true;
 }
 
@@ -1681,6 +1772,55 @@ bool OutOfOrderMachine::init(PTLsimConfig& config) {
   return true;
 }
 
+//
+// Idle cycle skipping: when OutOfOrderCore::idle_cycles() finds that
+// the next n cycles can only count down, the first of them is still
+// simulated in full as a probe. If it did not commit anything either,
+// the other n-1 cycles repeat it exactly, so the stats it updated are
+// advanced by n-1 times the same amount, together with the countdowns.
+// Returns the number of cycles skipped.
+//
+static const int MIN_IDLE_CYCLES_TO_SKIP = 16;
+static PTLsimStats stats_before_idle_probe;
+
+static W64 skip_idle_cycles(OutOfOrderCore& core, W64 n, bool running) {
+  ThreadContext& thread = *core.threads[0];
+  int rc = core.commitrc[0];
+
+  if unlikely (core.commitcount | ((rc != COMMIT_RESULT_NONE) & (rc != COMMIT_RESULT_OK))) return 0;
+  if unlikely (stats.ooocore.commit.free_regs_recycled != stats_before_idle_probe.ooocore.commit.free_regs_recycled) return 0;
+  if unlikely (core.idle_cycles() < (n - 1)) return 0;
+
+  //
+  // Stop short of the cycle limit, the deadlock check, logging
+  // and the cache statistics wraparound:
+  //
+  W64 since_commit = sim_cycle - thread.last_commit_at_cycle;
+  if unlikely (since_commit > 4096) return 0;
+  if unlikely ((!logenable) & (iterations >= config.start_log_at_iteration)) return 0;
+
+  W64 m = n - 1;
+  m = min(m, config.stop_at_cycle - sim_cycle);
+  if unlikely (!logenable) m = min(m, config.start_log_at_iteration - iterations);
+  m = min(m, 4097 - since_commit);
+  m = min(m, (W64)(0x7fffffff - (sim_cycle & 0x7fffffff)));
+  if unlikely (!m) return 0;
+
+  W64* p = (W64*)&stats;
+  const W64* q = (const W64*)&stats_before_idle_probe;
+  foreach (i, sizeof(PTLsimStats) / sizeof(W64)) {
+    W64 delta = p[i] - q[i];
+    if unlikely (delta) p[i] += delta * m;
+  }
+
+  core.skip_idle_cycles(m);
+  sim_cycle += m;
+  iterations += m;
+  unhalted_cycle_count += (running) ? m : 0;
+
+  return m;
+}
+
 //
 // Run the processor model, until a stopping point
 // is hit (as configured elsewhere in config).
@@ -1698,7 +1838,7 @@ int OutOfOrderMachine::run(PTLsimConfig& config) {
     logenable = 1;
   }
 
-  cores[0]->reset();
+  cores[0]->reset(warm);
   cores[0]->flush_pipeline_all();
 
   logfile << "IssueQueue states:", endl;
@@ -1711,6 +1851,10 @@ int OutOfOrderMachine::run(PTLsimConfig& config) {
   bool exiting = false;
   bool stopping = false;
 
+  W64 idle_probe = 0;
+  W64 skipped_cycles = 0;
+  bool skip_idle = (!config.no_idle_skip) & (!config.event_log_enabled) & (config.snapshot_cycles == infinity);
+
   for (;;) {
     if unlikely (iterations >= config.start_log_at_iteration) {
       if unlikely (!logenable) logfile << "Start logging at level ", config.loglevel, " in cycle ", iterations, endl, flush;
@@ -1761,6 +1905,26 @@ int OutOfOrderMachine::run(PTLsimConfig& config) {
     unhalted_cycle_count += (running_thread_count > 0);
     iterations++;
 
+    // Start of the measured part of a sampling window (see -sample):
+    if unlikely (total_user_insns_committed >= sample_mark_at_insn) {
+      sample_mark_cycle = sim_cycle;
+      sample_mark_insns = total_user_insns_committed;
+      sample_mark_at_insn = infinity;
+    }
+
+#ifndef PTLSIM_HYPERVISOR
+    if unlikely (idle_probe) {
+      if likely (!(exiting | stopping)) skipped_cycles += skip_idle_cycles(core, idle_probe, (running_thread_count > 0));
+      idle_probe = 0;
+    } else if likely (skip_idle & (!logable(1))) {
+      W64 n = core.idle_cycles();
+      if unlikely (n >= MIN_IDLE_CYCLES_TO_SKIP) {
+        idle_probe = n;
+        stats_before_idle_probe = stats;
+      }
+    }
+#endif
+
     if unlikely (stopping) {
       // logfile << "Waiting for all VCPUs to stop at ", sim_cycle, ": mask = ", stopped, " (need ", contextcount, " VCPUs)", endl;
       exiting |= (stopped.integer() == bitmask(contextcount));
@@ -1769,7 +1933,7 @@ int OutOfOrderMachine::run(PTLsimConfig& config) {
     if unlikely (exiting) break;
   }
 
-  logfile << "Exiting out-of-order core at ", total_user_insns_committed, " commits, ", total_uops_committed, " uops and ", iterations, " iterations (cycles)", endl;
+  logfile << "Exiting out-of-order core at ", total_user_insns_committed, " commits, ", total_uops_committed, " uops and ", iterations, " iterations (cycles), ", skipped_cycles, " of them skipped while idle", endl;
 
   OutOfOrderCore& core =* cores[0]; /// only one core for now.
 
@@ -1833,6 +1997,36 @@ void OutOfOrderMachine::flush_tlb_virt(Context& ctx, Waddr virtaddr) {
   cores[coreid]->flush_tlb(ctx, threadid, true, virtaddr);
 }
 
+//
+// Functional warming (see -sample): cores[0] keeps its caches, TLBs and
+// branch predictor up to date with what the seq core executes. They
+// start empty, unless -warmup already trained them.
+//
+void OutOfOrderMachine::warm_reset() {
+  cores[0]->reset(warm);
+}
+
+void OutOfOrderMachine::warm_fetch(const RIPVirtPhys& rvp, int bytes) {
+  CacheSubsystem::CacheHierarchy& caches = cores[0]->caches;
+#ifdef PTLSIM_HYPERVISOR
+  Waddr physaddr = (rvp.mfnlo << 12) + lowbits(rvp.rip, 12);
+#else
+  Waddr physaddr = rvp.rip;
+#endif
+  caches.itlb.insert(rvp.rip);
+  for (Waddr line = floor(physaddr, CacheSubsystem::L1I_LINE_SIZE); line < physaddr + bytes; line += CacheSubsystem::L1I_LINE_SIZE) caches.warm(line, true);
+}
+
+void OutOfOrderMachine::warm_access(Waddr virtaddr, Waddr physaddr) {
+  CacheSubsystem::CacheHierarchy& caches = cores[0]->caches;
+  caches.dtlb.insert(virtaddr);
+  caches.warm(physaddr, false);
+}
+
+void OutOfOrderMachine::warm_branch(const TransOp& uop, Waddr rip, Waddr target) {
+  cores[0]->threads[0]->warm_branch(uop, rip, target);
+}
+
 void OutOfOrderMachine::dump_state(ostream& os) {
   os << " dump_state include event if -ringbuf enabled: ",endl;
   //  foreach (i, contextcount) {
@@ -487,6 +487,7 @@ namespace OutOfOrderModel {
     bool replay(int slot, const tag_t* operands, const tag_t* preready);
     bool switch_to_end(int slot, const tag_t* operands, const tag_t* preready);
     bool remove(int slot);
+    int annulrange(int threadid, int startidx, int endidx);
 
     ostream& print(ostream& os) const;
     void tally_broadcast_matches(tag_t sourceid, const bitvec<size>& mask, int operand) const;
@@ -1366,7 +1367,15 @@ namespace OutOfOrderModel {
   name[0](description "-all", rob_states, flags);
 #endif
 
-  static const int ISSUE_QUEUE_SIZE = 16;
+  //
+  // Entries per issue queue; other sizes are built with e.g.
+  // make EXTRA_CFLAGS=-DOOO_ISSUE_QUEUE_SIZE=32 (from 32 entries up, the
+  // tag searches use AVX2 or AVX-512 when the host has them)
+  //
+#ifndef OOO_ISSUE_QUEUE_SIZE
+#define OOO_ISSUE_QUEUE_SIZE 16
+#endif
+  static const int ISSUE_QUEUE_SIZE = OOO_ISSUE_QUEUE_SIZE;
 
   // How many bytes of x86 code to fetch into decode buffer at once
   static const int ICACHE_FETCH_GRANULARITY = 16;
@@ -1392,6 +1401,13 @@ namespace OutOfOrderModel {
     // following rob_xxx_list lists at any given time; the ROB's
     // current_state_list points back to the list it belongs to.
     //
+    // These are deliberately intrusive lists rather than per-state
+    // bitmaps over the ROB slots: the lists walked every cycle (frontend,
+    // issued, completed, ready to writeback) only hold a handful of
+    // entries. A bitmap variant scanning from the ROB head took 1.125x
+    // the CPU time of the lists (tests/bench/bench.sh, CORE=ooo,
+    // loop-200k.txt, median of 9) and was removed.
+    //
     StateList rob_free_list;                             // Free ROB entyry
     StateList rob_frontend_list;                         // Frontend in progress (artificial delay)
     StateList rob_ready_to_dispatch_list;                // Ready to dispatch
@@ -1469,7 +1485,9 @@ namespace OutOfOrderModel {
     int dispatch();
     void frontend();
     void rename();
+    bool rename_stalled();
     bool fetch();
+    void warm_branch(const TransOp& uop, Waddr rip, Waddr target);
     void tlbwalk();
 
     bool handle_barrier();
@@ -1492,7 +1510,7 @@ namespace OutOfOrderModel {
     void print_lsq(ostream& os);
     void print_rename_tables(ostream& os);
 
-    void reset();
+    void reset(bool keep_warm_state = false);
     void init();
   };
 
@@ -1516,6 +1534,7 @@ namespace OutOfOrderModel {
     int commitcount;
     int writecount;
     int dispatchcount;
+    int commitrc[MAX_THREADS_PER_CORE];
 
     byte round_robin_tid;
 
@@ -1593,7 +1612,7 @@ namespace OutOfOrderModel {
     // Initialize structures independent of the core parameters
     //
     void init_generic();
-    void reset();
+    void reset(bool keep_warm_state = false);
 
     //
     // Initialize all structures for the first time
@@ -1638,6 +1657,8 @@ namespace OutOfOrderModel {
 
     // Pipeline Stages
     bool runcycle();
+    int idle_cycles();
+    void skip_idle_cycles(int n);
     void flush_pipeline_all();
     bool fetch();
     void rename();
@@ -1671,6 +1692,10 @@ namespace OutOfOrderModel {
     virtual void update_stats(PTLsimStats& stats);
     virtual void flush_tlb(Context& ctx);
     virtual void flush_tlb_virt(Context& ctx, Waddr virtaddr);
+    virtual void warm_reset();
+    virtual void warm_fetch(const RIPVirtPhys& rvp, int bytes);
+    virtual void warm_access(Waddr virtaddr, Waddr physaddr);
+    virtual void warm_branch(const TransOp& uop, Waddr rip, Waddr target);
     void flush_all_pipelines();
   };
 
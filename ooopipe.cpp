@@ -377,6 +377,30 @@ void OutOfOrderCore::set_unaligned_hint(const RIPVirtPhysBase& rvp, bool value)
   unaligned_predictor[slot] = value;
 }
 
+static inline int branch_predictor_type(const TransOp& uop) {
+  return
+    (isclass(uop.opcode, OPCLASS_COND_BRANCH) << log2(BRANCH_HINT_COND)) |
+    (isclass(uop.opcode, OPCLASS_INDIR_BRANCH) << log2(BRANCH_HINT_INDIRECT)) |
+    (bit(uop.extshift, log2(BRANCH_HINT_PUSH_RAS)) << log2(BRANCH_HINT_CALL)) |
+    (bit(uop.extshift, log2(BRANCH_HINT_POP_RAS)) << log2(BRANCH_HINT_RET));
+}
+
+//
+// Functional warming: train the predictor on a branch resolved by the
+// seq core, as if it had been fetched and committed here
+//
+void ThreadContext::warm_branch(const TransOp& uop, Waddr rip, Waddr target) {
+  PredictorUpdate predinfo;
+  predinfo.uuid = fetch_uuid;
+  predinfo.ctxid = 0;
+
+  int type = branch_predictor_type(uop);
+  W64 ripafter = rip + uop.bytes;
+  branchpred.predict(predinfo, type, ripafter, uop.riptaken);
+  if unlikely (type & (BRANCH_HINT_CALL|BRANCH_HINT_RET)) branchpred.updateras(predinfo, ripafter);
+  branchpred.update(predinfo, ripafter, target);
+}
+
 bool ThreadContext::fetch() {
   OutOfOrderCore& core = getcore();
   EventLog& eventlog = core.eventlog;
@@ -556,11 +580,7 @@ bool ThreadContext::fetch() {
 
     if (isbranch(transop.opcode)) {
       transop.predinfo.uuid = transop.uuid;
-      transop.predinfo.bptype =
-        (isclass(transop.opcode, OPCLASS_COND_BRANCH) << log2(BRANCH_HINT_COND)) |
-        (isclass(transop.opcode, OPCLASS_INDIR_BRANCH) << log2(BRANCH_HINT_INDIRECT)) |
-        (bit(transop.extshift, log2(BRANCH_HINT_PUSH_RAS)) << log2(BRANCH_HINT_CALL)) |
-        (bit(transop.extshift, log2(BRANCH_HINT_POP_RAS)) << log2(BRANCH_HINT_RET));
+      transop.predinfo.bptype = branch_predictor_type(transop);
 
       // SMP/SMT: Fill in with target thread ID (if the predictor supports this):
       transop.predinfo.ctxid = 0;
@@ -917,6 +937,29 @@ void ThreadContext::rename() {
   per_context_ooocore_stats_update(threadid, frontend.width[prepcount]++);
 }
 
+//
+// Check if rename() is stalled and cannot rename anything in this
+// cycle, for OutOfOrderCore::idle_cycles(). This has to match the
+// stall conditions in rename() above.
+//
+bool ThreadContext::rename_stalled() {
+  if (fetchq.empty() | (!ROB.remaining())) return true;
+
+  FetchBufferEntry& fetchbuf = *fetchq.peek();
+
+  W32 acceptable_phys_reg_files = phys_reg_files_writable_by_uop(fetchbuf);
+  bool physregs_full = true;
+  foreach (i, PHYS_REG_FILE_COUNT) {
+    if (bit(acceptable_phys_reg_files, i) && core.physregfiles[i].remaining()) physregs_full = false;
+  }
+  if (physregs_full) return true;
+
+  bool ld = isload(fetchbuf.opcode);
+  bool st = isstore(fetchbuf.opcode);
+
+  return ((ld && (loads_in_flight >= LDQ_SIZE)) || (st && (stores_in_flight >= STQ_SIZE)) || ((ld|st) && (!LSQ.remaining())));
+}
+
 void ThreadContext::frontend() {
   time_this_scope(ctfrontend);
 
@@ -2010,6 +2053,7 @@ int ReorderBufferEntry::commit() {
 
     thread.branchpred.update(uop.predinfo, end_of_branch_x86_insn, ctx.commitarf[REG_rip]);
     per_context_ooocore_stats_update(threadid, branchpred.updates++);
+    afl_trace_branch(ctx.commitarf[REG_rip]);
   }
 
   if likely (uop.eom) {
@@ -492,7 +492,6 @@ ostream& RIPVirtPhysBase::print(ostream& os) const {
 
 void BasicBlock::reset() {
   setzero(*((BasicBlockBase*)this));
-  hashlink.reset();
   mfnlo_loc.reset();
   mfnhi_loc.reset();
   type = BB_TYPE_COND;
@@ -526,8 +525,10 @@ BasicBlock* BasicBlock::clone() {
   memcpy(bb, this, sizeof(BasicBlockBase));
 
   bb->synthops = null;
-  // hashlink, mfnlo_loc, mfnhi_loc are always updated after cloning
-  bb->hashlink.reset();
+  bb->chain[0] = null;
+  bb->chain[1] = null;
+  bb->chaingen = 0;
+  // mfnlo_loc, mfnhi_loc are always updated after cloning
   bb->use(0);
 
   foreach (i, count) bb->transops[i] = this->transops[i];
@@ -1387,7 +1387,6 @@ typedef shortptr<BasicBlock> BasicBlockPtr;
 #endif
 
 struct BasicBlockChunkList: public ChunkList<BasicBlockPtr, BB_PTRS_PER_CHUNK> {
-  selflistlink hashlink;
   W64 mfn;
   int refcount;
 
@@ -1462,7 +1461,6 @@ static const char* branch_type_names[8] = {
 
 struct BasicBlockBase {
   RIPVirtPhys rip;
-  selflistlink hashlink;
   BasicBlockChunkList::Locator mfnlo_loc;
   BasicBlockChunkList::Locator mfnhi_loc;
   W64 rip_taken;
@@ -1483,6 +1481,13 @@ struct BasicBlockBase {
   W32 confidence;
   W64 lastused;
   W64 lasttarget;
+  // CLOCK replacement ring of the BB cache (see BasicBlockCache::reclaim())
+  BasicBlock* clocknext;
+  BasicBlock* clockprev;
+  W32 referenced;
+  // Successors linked by the seq core (taken, not taken), valid while chaingen is bbcache.generation
+  BasicBlock* chain[2];
+  W64 chaingen;
 
   void acquire() {
     refcount++;
@@ -1502,7 +1507,8 @@ struct BasicBlock: public BasicBlockBase {
   void reset(const RIPVirtPhys& rip);
   BasicBlock* clone();
   void free();
-  void use(W64 counter) { lastused = counter; };
+  size_t memsize() const { return sizeof(BasicBlockBase) + (count * sizeof(TransOp)); }
+  void use(W64 counter) { lastused = counter; referenced = 1; };
 };
 
 ostream& operator <<(ostream& os, const BasicBlock& bb);
@@ -31,6 +31,8 @@ W64 total_uops_executed = 0;
 W64 total_uops_committed = 0;
 W64 total_user_insns_committed = 0;
 W64 total_basic_blocks_committed = 0;
+byte* afl_area = null;
+W32 afl_prev_loc = 0;
 #endif
 
 void PTLsimConfig::reset() {
@@ -111,15 +113,35 @@ void PTLsimConfig::reset() {
   validation_start_cycle = 0;
 
   perfect_cache = 0;
+  no_idle_skip = 0;
 
   dumpcode_filename = "test.dat";
   dump_at_end = 0;
   overshoot_and_dump = 0;
   bbcache_dump_filename.reset();
+  bbstore_filename.reset();
+  bbcache_budget = 64*1024*1024;
+  host_simd = HOST_SIMD_AVX512;
 
 #ifndef PTLSIM_HYPERVISOR
   sequential_mode_insns = 0;
+  sequential_mode_rip = INVALIDRIP;
+  sequential_mode_marker = infinity;
+  warmup_insns = 0;
+  sample_period = 0;
+  sample_size = 1000;
+  sample_warmup = 2000;
+  sample_random = 0;
+  sample_error = 0;
   exit_after_fullsim = 0;
+  server = 0;
+  forkserver = 0;
+  result_format = "text";
+  batch.reset();
+  jobs = 0;
+  batch_output.reset();
+  batch_timeout = 0;
+  result_cache.reset();
 #endif
 }
 
@@ -144,7 +166,7 @@ void ConfigurationParser<PTLsimConfig>::setup() {
   add(core_name,                    "core",                 "Run using specified core (-core <corename>)");
 
   section("General Logging Control");
-  add(quiet,                        "quiet",                "Do not print PTLsim system information banner");
+  add(quiet,                        "quiet",                "Do not print PTLsim system information banner, nor progress and exceptions on the console");
   add(log_filename,                 "logfile",              "Log filename (use /dev/fd/1 for stdout, /dev/fd/2 for stderr)");
   add(loglevel,                     "loglevel",             "Log level (0 to 99)");
   add(start_log_at_iteration,       "startlog",             "Start logging after iteration <startlog>");
@@ -217,16 +239,36 @@ void ConfigurationParser<PTLsimConfig>::setup() {
 
   section("Out of Order Core (ooocore)");
   add(perfect_cache,                "perfect-cache",        "Perfect cache performance: all loads and stores hit in L1");
+  add(no_idle_skip,                 "no-idle-skip",         "Clock every cycle, instead of skipping over idle cycles spent waiting on cache misses");
 
   section("Miscellaneous");
   add(dumpcode_filename,            "dumpcode",             "Save page of user code at final rip to file <dumpcode>");
   add(dump_at_end,                  "dump-at-end",          "Set breakpoint and dump core before first instruction executed on return to native mode");
   add(overshoot_and_dump,           "overshoot-and-dump",   "Set breakpoint and dump core after first instruction executed on return to native mode");
   add(bbcache_dump_filename,        "bbdump",               "Basic block cache dump filename");
+  add(bbstore_filename,             "bbstore",              "Persistent basic block store: reuse translations saved in this file, and save new ones at exit");
+  add(bbcache_budget,               "bbcache-budget",       "Evict basic blocks once the BB cache holds more than this many bytes (0 for no limit)");
+  add(host_simd,                    "host-simd",            "Widest host SIMD extension for associative searches (0 = SSE2, 1 = AVX2, 2 = AVX-512), if the host supports it");
 #ifndef PTLSIM_HYPERVISOR
   // Userspace only
   add(sequential_mode_insns,        "seq",                  "Run in sequential mode for <seq> instructions before switching to out of order");
+  add(sequential_mode_rip,          "seq-until-rip",        "Run in sequential mode until rip <seq-until-rip> is reached, then switch to out of order");
+  add(sequential_mode_marker,       "seq-until-marker",     "Run in sequential mode until a PTLCALL_MARKER call with marker <seq-until-marker>, then switch to out of order");
+  add(warmup_insns,                 "warmup",               "After sequential mode, warm up caches and predictors for <warmup> instructions before collecting statistics");
+  add(sample_period,                "sample",               "Statistical sampling: measure one detailed window every <sample> instructions, with functional warming in between (0 = off)");
+  add(sample_size,                  "sample-size",          "Instructions measured per sampling window");
+  add(sample_warmup,                "sample-warmup",        "Detailed warmup instructions before each sampling window");
+  add(sample_random,                "sample-random",        "Place each sampling window at a random offset within its period, using seed <sample-random> (0 = at the end)");
+  add(sample_error,                 "sample-error",         "Shorten the sampling period until the CPI confidence interval is within +/- <sample-error> percent, using pilot runs");
   add(exit_after_fullsim,           "exitend",              "Kill the thread after full simulation completes rather than going native");
+  add(server,                       "server",               "Batch server mode: read test cases from stdin and write framed results to stdout");
+  add(forkserver,                   "forkserver",           "Fork server mode (AFL protocol): fork one child per test case read from stdin");
+  add(result_format,                "result",               "End state output format: text, json (one line per case) or binary (RaspsimResultHeader records), on stdout");
+  add(batch,                        "batch",                "Batch mode: simulate all test cases of a corpus (directory, pack file, or - for server syntax on stdin) in parallel");
+  add(jobs,                         "jobs",                 "Batch mode: number of worker processes, each pinned to one CPU (0: one per available CPU)");
+  add(batch_output,                 "batchout",             "Batch mode: write the results (in case order) to this file instead of stdout");
+  add(batch_timeout,                "batchtimeout",         "Batch mode: kill a worker whose case runs for more than this many seconds (wall clock) and report the case as failed (0: no limit)");
+  add(result_cache,                 "resultcache",          "Reuse the end state of identical earlier runs from this directory (created if needed), and store new ones there");
 #endif
 };
 
@@ -404,10 +446,19 @@ bool handle_config_change(PTLsimConfig& config, int argc, char** argv) {
     current_bbcache_dump_filename = config.bbcache_dump_filename;
   }
 
+  if (config.bbstore_filename.set() && (config.bbstore_filename != bbstore.filename)) {
+    // Save what was translated for the old store first:
+    if (bbstore.enabled()) bbstore.save();
+    bbstore.open(config.bbstore_filename);
+  }
+
   if (config.log_trigger_virt_addr_start && (!config.log_trigger_virt_addr_end)) {
     config.log_trigger_virt_addr_end = config.log_trigger_virt_addr_start;
   }
 
+  // Same results on any host; this only picks the search code:
+  host_simd = min((int)config.host_simd, detect_host_simd());
+
   ptl_mm_set_logging(config.mm_logfile.set() ? (char*)(config.mm_logfile) : null, config.mm_log_buffer_size, config.enable_inline_mm_logging);
   ptl_mm_set_validate(config.enable_mm_validate);
 
@@ -416,10 +467,16 @@ bool handle_config_change(PTLsimConfig& config, int argc, char** argv) {
   config.log_backwards_from_trigger_rip = signext64(config.log_backwards_from_trigger_rip, 48);
 #ifndef PTLSIM_HYPERVISOR
   config.start_at_rip = signext64(config.start_at_rip, 48);
+  config.sequential_mode_rip = signext64(config.sequential_mode_rip, 48);
 #endif
   config.stop_at_rip = signext64(config.stop_at_rip, 48);
 #endif
 
+#ifndef PTLSIM_HYPERVISOR
+  // Batch mode only prints failures on the console (workers included):
+  if (config.batch.set()) config.quiet = 1;
+#endif
+
   if (first_time) {
     if (!config.quiet) {
 #ifndef PTLSIM_HYPERVISOR
@@ -461,6 +518,10 @@ void PTLsimMachine::update_stats(PTLsimStats& stats) { return; }
 void PTLsimMachine::dump_state(ostream& os) { return; }
 void PTLsimMachine::flush_tlb(Context& ctx) { return; }
 void PTLsimMachine::flush_tlb_virt(Context& ctx, Waddr virtaddr) { return; }
+void PTLsimMachine::warm_reset() { return; }
+void PTLsimMachine::warm_fetch(const RIPVirtPhys& rvp, int bytes) { return; }
+void PTLsimMachine::warm_access(Waddr virtaddr, Waddr physaddr) { return; }
+void PTLsimMachine::warm_branch(const TransOp& uop, Waddr rip, Waddr target) { return; }
 
 void PTLsimMachine::addmachine(const char* name, PTLsimMachine* machine) {
   if unlikely (!machinetable) {
@@ -540,28 +601,416 @@ void update_progress() {
   }
 }
 
-bool simulate(const char* machinename) {
+static PTLsimMachine* init_machine(const char* machinename) {
   PTLsimMachine* machine = PTLsimMachine::getmachine(machinename);
 
   if (!machine) {
     logfile << "Cannot find core named '", machinename, "'", endl;
     cerr << "Cannot find core named '", machinename, "'", endl;
-    return 0;
+    return null;
   }
 
   if (!machine->initialized) {
     logfile << "Initializing core '", machinename, "'", endl;
     if (!machine->init(config)) {
       logfile << "Cannot initialize core model; check its configuration!", endl;
-      return 0;
+      return null;
     }
     machine->initialized = 1;
   }
 
+  return machine;
+}
+
+static void run_machine(PTLsimMachine* machine) {
+  current_machine = machine;
+  machine->run(config);
+  machine->update_stats(stats);
+  current_machine = null;
+}
+
+//
+// Start all counters and statistics from zero (the translation
+// cache survives, so its occupancy counts are kept).
+//
+void reset_sim_counters() {
+  sim_cycle = 0;
+  unhalted_cycle_count = 0;
+  iterations = 0;
+  total_uops_executed = 0;
+  total_uops_committed = 0;
+  total_user_insns_committed = 0;
+  total_basic_blocks_committed = 0;
+
+  W64 bbcache_count = stats.decoder.bbcache.count;
+  W64 pagecache_count = stats.decoder.pagecache.count;
+  setzero(stats);
+  stats.decoder.bbcache.count = bbcache_count;
+  stats.decoder.pagecache.count = pagecache_count;
+}
+
+PTLsimMachine* warming_machine = null;
+W64 sample_mark_at_insn = infinity;
+W64 sample_mark_cycle = 0;
+W64 sample_mark_insns = 0;
+
+#ifndef PTLSIM_HYPERVISOR
+bool sequential_mode = 0;
+bool sequential_mode_marker_hit = 0;
+
+bool read_fully(int fd, void* buf, W64 length) {
+  W8* p = (W8*)buf;
+  while (length) {
+    int n = sys_read(fd, p, length);
+    if (n <= 0) return false;
+    p += n;
+    length -= n;
+  }
+  return true;
+}
+
+bool write_fully(int fd, const void* buf, W64 length) {
+  const W8* p = (const W8*)buf;
+  while (length) {
+    int n = sys_write(fd, p, length);
+    if (n <= 0) return false;
+    p += n;
+    length -= n;
+  }
+  return true;
+}
+
+//
+// Fast-forward with the seq core to the region of interest (-seq,
+// -seq-until-rip, -seq-until-marker), then run <machine> for -warmup
+// instructions to train its caches and predictors. The counters and
+// statistics restart from zero after each phase, so only the region
+// itself is measured, and the -stopxxx limits apply to each phase.
+// Returns false if the program ends (or a limit is hit) before the
+// region starts.
+//
+static bool run_up_to_region(PTLsimMachine* machine) {
+  bool fast_forward = (config.sequential_mode_insns || (config.sequential_mode_rip != INVALIDRIP) || (config.sequential_mode_marker != infinity));
+
+  if (fast_forward) {
+    PTLsimMachine* seq = init_machine("seq");
+    if (!seq) return false;
+
+    W64 stop_at_user_insns = config.stop_at_user_insns;
+    W64 stop_at_rip = config.stop_at_rip;
+    if (config.sequential_mode_insns) config.stop_at_user_insns = min(config.stop_at_user_insns, config.sequential_mode_insns);
+    if (config.sequential_mode_rip != INVALIDRIP) config.stop_at_rip = config.sequential_mode_rip;
+
+    logfile << "Fast-forwarding in sequential mode from rip ", (void*)(Waddr)contextof(0).commitarf[REG_rip], endl, flush;
+
+    sequential_mode = 1;
+    sequential_mode_marker_hit = 0;
+    run_machine(seq);
+    sequential_mode = 0;
+
+    config.stop_at_user_insns = stop_at_user_insns;
+    config.stop_at_rip = stop_at_rip;
+
+    Waddr rip = contextof(0).commitarf[REG_rip];
+    bool reached = (!requested_switch_to_native) &&
+      ((config.sequential_mode_insns && (total_user_insns_committed >= config.sequential_mode_insns)) ||
+       (rip == config.sequential_mode_rip) || sequential_mode_marker_hit);
+    sequential_mode_marker_hit = 0;
+
+    logfile << "Sequential mode ", ((reached) ? "reached" : "ended before"), " the region of interest after ",
+      total_user_insns_committed, " instructions, at rip ", (void*)rip, endl, flush;
+    if (!reached) return false;
+
+    reset_sim_counters();
+  }
+
+  if (config.warmup_insns) {
+    W64 stop_at_user_insns = config.stop_at_user_insns;
+    config.stop_at_user_insns = config.warmup_insns;
+
+    logfile << "Warming up for ", config.warmup_insns, " instructions", endl, flush;
+    run_machine(machine);
+
+    config.stop_at_user_insns = stop_at_user_insns;
+    if (requested_switch_to_native || (total_user_insns_committed < config.warmup_insns)) return false;
+
+    reset_sim_counters();
+    machine->warm = 1;
+  }
+
+  return true;
+}
+
+//
+// Statistical sampling (-sample), in the style of SMARTS: the run is
+// cut into periods of -sample instructions. Each period runs on the seq
+// core, which keeps the detailed core's caches, TLBs and branch predictor
+// warm, up to a window of -sample-warmup plus -sample-size instructions
+// run on the detailed core. Only the last -sample-size instructions of
+// each window are measured, and the mean CPI of the windows estimates the
+// CPI of the whole run, with a 95% confidence interval.
+//
+// With -sample-error, pilot runs in a child process (so the real run
+// still starts from the same state) first shorten the period until the
+// interval is expected to be narrow enough. If the last pilot already
+// used the final period, its results are taken over instead of running
+// it again.
+//
+// The detailed core starts cold, unless -warmup ran it first: then it
+// keeps the caches and predictor state built up by the warmup.
+//
+static const double SAMPLING_Z = 1.96; // 95% confidence
+static const int SAMPLING_MIN_SAMPLES = 8;
+static const int SAMPLING_MAX_PILOTS = 4;
+// Aim a little below the requested error, so one pilot is usually enough:
+static const double SAMPLING_MARGIN = 1.2;
+
+struct SamplingEstimate {
+  W64 samples;
+  W64 insns;
+  W64 measured_insns;
+  W64 measured_cycles;
+  double sum;
+  double sumsq;
+
+  void reset() { setzero(*this); }
+
+  void add(W64 cycles, W64 insns) {
+    double cpi = double(cycles) / double(insns);
+    samples++;
+    measured_insns += insns;
+    measured_cycles += cycles;
+    sum += cpi;
+    sumsq += cpi * cpi;
+  }
+
+  bool valid() const { return (samples >= 2); }
+  double cpi() const { return (samples) ? sum / samples : 0; }
+
+  double stddev() const {
+    double mean = cpi();
+    return math::sqrt(max((sumsq - samples * mean * mean) / (samples - 1), 0.0));
+  }
+
+  double halfwidth() const { return SAMPLING_Z * stddev() / math::sqrt(double(samples)); }
+  double error() const { return halfwidth() / cpi(); }
+};
+
+//
+// Run <machine> until <insns> instructions have committed. Returns false
+// if the program ends or the -stopinsns limit is reached first.
+//
+static bool run_until(PTLsimMachine* machine, W64 insns, W64 stop_at_user_insns) {
+  config.stop_at_user_insns = min(insns, stop_at_user_insns);
+  run_machine(machine);
+  return (!requested_switch_to_native) && (total_user_insns_committed >= insns);
+}
+
+static bool run_sampled(PTLsimMachine* machine, W64 period, SamplingEstimate& est) {
+  PTLsimMachine* seq = init_machine("seq");
+  if (!seq) return false;
+
+  W64 unit = config.sample_warmup + config.sample_size;
+  W64 stop_at_user_insns = config.stop_at_user_insns;
+  RandomNumberGenerator random(config.sample_random);
+
+  est.reset();
+  machine->warm_reset();
+  machine->warm = 1;
+
+  W64 start = total_user_insns_committed;
+
+  for (;;) {
+    W64 offset = (config.sample_random) ? (random.random64() % (period - unit + 1)) : (period - unit);
+    W64 window = start + offset;
+    start += period;
+
+    warming_machine = machine;
+    if ((window > total_user_insns_committed) && (!run_until(seq, window, stop_at_user_insns))) break;
+    warming_machine = null;
+
+    sample_mark_at_insn = total_user_insns_committed + config.sample_warmup;
+    bool complete = run_until(machine, sample_mark_at_insn + config.sample_size, stop_at_user_insns);
+    bool marked = (sample_mark_at_insn == infinity);
+    sample_mark_at_insn = infinity;
+
+    // A window cut short by the end of the program is left out:
+    if (!(complete & marked)) break;
+
+    W64 cycles = sim_cycle - sample_mark_cycle;
+    W64 insns = total_user_insns_committed - sample_mark_insns;
+    logfile << "Sampling window ", est.samples, " at instruction ", sample_mark_insns, ": ", cycles, " cycles for ", insns, " instructions", endl;
+    est.add(cycles, insns);
+  }
+
+  warming_machine = null;
+  config.stop_at_user_insns = stop_at_user_insns;
+  est.insns = total_user_insns_committed;
+  return true;
+}
+
+//
+// What a pilot run reports back: its estimate, the counters and the
+// statistics it ended with, and where the program stopped.
+//
+struct SamplingPilot {
+  SamplingEstimate est;
+  W64 period;
+  W64 sim_cycle;
+  W64 unhalted_cycle_count;
+  W64 iterations;
+  W64 total_uops_executed;
+  W64 total_uops_committed;
+  W64 total_user_insns_committed;
+  W64 total_basic_blocks_committed;
+  Waddr rip;
+};
+
+static bool run_sampling_pilot(PTLsimMachine* machine, W64 period, SamplingPilot& pilot, PTLsimStats& pilotstats) {
+  int fds[2];
+  if (sys_pipe(fds) < 0) return false;
+
+  logfile << flush;
+  cerr << flush;
+  cout << flush;
+
+  pid_t pid = sys_fork();
+
+  if (!pid) {
+    sys_close(fds[0]);
+    config.quiet = 1;
+    if (!run_sampled(machine, period, pilot.est)) pilot.est.reset();
+    pilot.period = period;
+    pilot.sim_cycle = sim_cycle;
+    pilot.unhalted_cycle_count = unhalted_cycle_count;
+    pilot.iterations = iterations;
+    pilot.total_uops_executed = total_uops_executed;
+    pilot.total_uops_committed = total_uops_committed;
+    pilot.total_user_insns_committed = total_user_insns_committed;
+    pilot.total_basic_blocks_committed = total_basic_blocks_committed;
+    pilot.rip = contextof(0).commitarf[REG_rip];
+    if (write_fully(fds[1], &pilot, sizeof(pilot))) write_fully(fds[1], &stats, sizeof(stats));
+    logfile << flush;
+    sys_exit(0);
+  }
+
+  sys_close(fds[1]);
+  bool ok = (pid > 0) && read_fully(fds[0], &pilot, sizeof(pilot)) && read_fully(fds[0], &pilotstats, sizeof(pilotstats));
+  sys_close(fds[0]);
+  if (pid > 0) sys_wait4(pid, null, 0, null);
+
+  return ok && pilot.est.samples;
+}
+
+//
+// The last pilot ran with the final period, so instead of simulating
+// it again, only replay the program on the seq core (without warming)
+// to reach the pilot's end state, then take over its statistics.
+//
+static bool adopt_sampling_pilot(const SamplingPilot& pilot, const PTLsimStats& pilotstats) {
+  PTLsimMachine* seq = init_machine("seq");
+  if (!seq) return false;
+
+  logfile << "Sampling pilot used the final period; replaying on the seq core to reach its end state", endl, flush;
+  run_machine(seq);
+
+  Waddr rip = contextof(0).commitarf[REG_rip];
+  if ((total_user_insns_committed != pilot.total_user_insns_committed) || (rip != pilot.rip)) {
+    logfile << "Warning: the replay stopped at instruction ", total_user_insns_committed, ", rip ", (void*)rip,
+      " but the pilot at instruction ", pilot.total_user_insns_committed, ", rip ", (void*)pilot.rip, endl, flush;
+  }
+
+  stats = pilotstats;
+  sim_cycle = pilot.sim_cycle;
+  unhalted_cycle_count = pilot.unhalted_cycle_count;
+  iterations = pilot.iterations;
+  total_uops_executed = pilot.total_uops_executed;
+  total_uops_committed = pilot.total_uops_committed;
+  total_user_insns_committed = pilot.total_user_insns_committed;
+  total_basic_blocks_committed = pilot.total_basic_blocks_committed;
+  return true;
+}
+
+static void run_sampling(PTLsimMachine* machine) {
+  W64 unit = config.sample_warmup + config.sample_size;
+  W64 period = max(config.sample_period, unit);
+  SamplingEstimate est;
+  SamplingPilot pilot;
+  PTLsimStats* pilotstats = null;
+  bool have_pilot = 0;
+
+  if (config.sample_error) {
+    double target = config.sample_error / 100.0;
+    pilotstats = new PTLsimStats();
+
+    foreach (pass, SAMPLING_MAX_PILOTS) {
+      have_pilot = run_sampling_pilot(machine, period, pilot, *pilotstats);
+      if (!have_pilot) break;
+      est = pilot.est;
+
+      logfile << "Sampling pilot with period ", period, ": ", est.samples, " windows, CPI ", floatstring(est.cpi(), 0, 4);
+      if (est.valid()) logfile << " +/- ", floatstring(100.0 * est.error(), 0, 2), "%";
+      logfile << endl, flush;
+
+      if (est.valid() && (est.error() <= target)) break;
+
+      W64 needed = SAMPLING_MIN_SAMPLES;
+      if (est.valid()) {
+        double n = SAMPLING_Z * est.stddev() / (target * est.cpi());
+        needed = max(needed, W64(math::ceil(SAMPLING_MARGIN * n * n)));
+      }
+
+      W64 shorter = max(est.insns / needed, unit);
+      if (shorter >= period) break;
+      period = shorter;
+    }
+  }
+
+  // The replay runs the seq core only, so it would reach a -stopcycle limit at another point:
+  bool adopted = have_pilot && (pilot.period == period) && (config.stop_at_cycle == infinity) && adopt_sampling_pilot(pilot, *pilotstats);
+  if (pilotstats) delete pilotstats;
+
+  if (adopted) {
+    est = pilot.est;
+  } else {
+    if (!run_sampled(machine, period, est)) return;
+  }
+
+  stats.sampling.samples = est.samples;
+  stats.sampling.period = period;
+  stats.sampling.measured_insns = est.measured_insns;
+  stats.sampling.measured_cycles = est.measured_cycles;
+
+  stringbuf sb;
+  if (est.samples) {
+    stats.sampling.cpi = est.cpi();
+    sb << "Sampled ", est.samples, " windows of ", config.sample_size, " instructions every ", period, " instructions: CPI ", floatstring(est.cpi(), 0, 4);
+    if (est.valid()) {
+      stats.sampling.cpi_halfwidth = est.halfwidth();
+      sb << " +/- ", floatstring(est.halfwidth(), 0, 4), " (", floatstring(100.0 * est.error(), 0, 2), "% at 95% confidence)";
+    }
+    sb << endl;
+
+    // The cycle count becomes the estimate for the whole run:
+    sim_cycle = W64(est.cpi() * est.insns + 0.5);
+    stats.summary.cycles = sim_cycle;
+  } else {
+    sb << "Sampling: the program ended before the first window of period ", period, endl;
+  }
+
+  logfile << sb, flush;
+  if (!config.quiet) cerr << sb, flush;
+}
+#endif
+
+bool simulate(const char* machinename) {
+  PTLsimMachine* machine = init_machine(machinename);
+  if (!machine) return 0;
+
   logfile << "Switching to simulation core '", machinename, "'...", endl, flush;
-  cerr <<  "Switching to simulation core '", machinename, "'...", endl, flush;
+  if (!config.quiet) cerr <<  "Switching to simulation core '", machinename, "'...", endl, flush;
   logfile << "Stopping after ", config.stop_at_user_insns, " commits", endl, flush;
-  cerr << "Stopping after ", config.stop_at_user_insns, " commits", endl, flush;
+  if (!config.quiet) cerr << "Stopping after ", config.stop_at_user_insns, " commits", endl, flush;
 
   // Update stats every half second:
   ticks_per_update = seconds_to_ticks(0.2);
@@ -571,11 +1020,15 @@ bool simulate(const char* machinename) {
   last_printed_status_at_cycle = 0;
 
   W64 tsc_at_start = rdtsc();
-  current_machine = machine;
-  machine->run(config);
+#ifndef PTLSIM_HYPERVISOR
+  if (run_up_to_region(machine)) {
+    if (config.sample_period) run_sampling(machine); else run_machine(machine);
+  }
+  machine->warm = 0;
+#else
+  run_machine(machine);
+#endif
   W64 tsc_at_end = rdtsc();
-  machine->update_stats(stats);
-  current_machine = null;
 
   W64 seconds = W64(ticks_to_seconds(tsc_at_end - tsc_at_start));
 
@@ -584,7 +1037,7 @@ bool simulate(const char* machinename) {
     seconds, " seconds of sim time (", W64(double(sim_cycle) / double(seconds)), " Hz sim rate)", endl;
 
   logfile << sb, flush;
-  cerr << sb, flush;
+  if (!config.quiet) cerr << sb, flush;
 
   if (config.dumpcode_filename.set()) {
     byte insnbuf[256];
@@ -32,13 +32,20 @@ struct PTLsimStats;
 
 struct PTLsimMachine {
   bool initialized;
-  PTLsimMachine() { initialized = 0; }
+  // Keep caches and predictors from the previous run() (see -warmup):
+  bool warm;
+  PTLsimMachine() { initialized = 0; warm = 0; }
   virtual bool init(PTLsimConfig& config);
   virtual int run(PTLsimConfig& config);  
   virtual void update_stats(PTLsimStats& stats);
   virtual void dump_state(ostream& os);
   virtual void flush_tlb(Context& ctx);
   virtual void flush_tlb_virt(Context& ctx, Waddr virtaddr);
+  // Functional warming (see -sample): the seq core reports what it executes
+  virtual void warm_reset();
+  virtual void warm_fetch(const RIPVirtPhys& rvp, int bytes);
+  virtual void warm_access(Waddr virtaddr, Waddr physaddr);
+  virtual void warm_branch(const TransOp& uop, Waddr rip, Waddr target);
   static void addmachine(const char* name, PTLsimMachine* machine);
   static PTLsimMachine* getmachine(const char* name);
   static PTLsimMachine* getcurrent();
@@ -87,6 +94,20 @@ void backup_and_reopen_logfile();
 void shutdown_subsystems();
 
 bool simulate(const char* machinename);
+void reset_sim_counters();
+#ifndef PTLSIM_HYPERVISOR
+// Fast-forwarding before the region of interest; set by PTLCALL_MARKER with -seq-until-marker:
+extern bool sequential_mode;
+extern bool sequential_mode_marker_hit;
+// Pipe I/O that retries short reads and writes (pilot runs, batch workers):
+bool read_fully(int fd, void* buf, W64 length);
+bool write_fully(int fd, const void* buf, W64 length);
+#endif
+// Statistical sampling: the machine to warm, and where the measured part of a window begins:
+extern PTLsimMachine* warming_machine;
+extern W64 sample_mark_at_insn;
+extern W64 sample_mark_cycle;
+extern W64 sample_mark_insns;
 int inject_events();
 bool check_for_async_sim_break();
 void update_progress();
@@ -118,6 +139,27 @@ extern W64 total_uops_committed;
 extern W64 total_user_insns_committed;
 extern W64 total_basic_blocks_committed;
 
+// Hashes of the objects the simulation model and the decoder were linked
+// from (see the Makefile):
+extern const W64 model_build_hash;
+extern const W64 decoder_build_hash;
+
+//
+// AFL edge coverage: both cores record every committed branch in the
+// fuzzer's shared bitmap, hashing the target rip as AFL's QEMU mode does.
+// The bitmap is only attached in fork server mode (see __AFL_SHM_ID).
+//
+static const int AFL_MAP_SIZE = 65536;
+extern byte* afl_area;
+extern W32 afl_prev_loc;
+
+static inline void afl_trace_branch(Waddr target) {
+  if likely (!afl_area) return;
+  W32 cur = ((target >> 4) ^ (target << 8)) & (AFL_MAP_SIZE - 1);
+  afl_area[cur ^ afl_prev_loc]++;
+  afl_prev_loc = cur >> 1;
+}
+
 #define INVALIDRIP 0xffffffffffffffffULL
 
 // 
@@ -209,17 +251,37 @@ struct PTLsimConfig {
 
   // Out of order core features
   bool perfect_cache;
+  bool no_idle_skip;
 
   // Other info
   stringbuf dumpcode_filename;
   bool dump_at_end;
   bool overshoot_and_dump;
   stringbuf bbcache_dump_filename;
+  stringbuf bbstore_filename;
+  W64 bbcache_budget;
+  W64 host_simd;
 
 #ifndef PTLSIM_HYPERVISOR
   // Simulation Mode
   W64 sequential_mode_insns;
+  W64 sequential_mode_rip;
+  W64 sequential_mode_marker;
+  W64 warmup_insns;
+  W64 sample_period;
+  W64 sample_size;
+  W64 sample_warmup;
+  W64 sample_random;
+  W64 sample_error;
   bool exit_after_fullsim;
+  bool server;
+  bool forkserver;
+  stringbuf result_format;
+  stringbuf batch;
+  W64 jobs;
+  stringbuf batch_output;
+  W64 batch_timeout;
+  stringbuf result_cache;
 #endif
   void reset();
 };
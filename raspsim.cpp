@@ -12,6 +12,8 @@
 #include <elf.h>
 #include <asm/ldt.h>
 #include <asm/ptrace.h>
+#include <poll.h>
+#include <dirent.h>
 
 #ifdef __x86_64__
 #include <asm/prctl.h>
@@ -22,7 +24,10 @@
 #include <ptlhwdef.h>
 #include <config.h>
 #include <stats.h>
+#include <raspsim.h>
+#include <ptlcalls.h>
 
+// The context of the simulated CPU, which the cores are bound to:
 Context ctx alignto(4096) insection(".ctx");
 struct PTLsimConfig;
 
@@ -39,80 +44,215 @@ extern ConfigurationParser<PTLsimConfig> configparser;
 // Each chunk covers 2 GB of virtual address space:
 #define SPAT_TOPLEVEL_CHUNK_BITS 17
 #define SPAT_PAGES_PER_CHUNK_BITS 19
-#define SPAT_TOPLEVEL_CHUNKS (1 << SPAT_TOPLEVEL_CHUNK_BITS) // 262144
-#define SPAT_PAGES_PER_CHUNK (1 << SPAT_PAGES_PER_CHUNK_BITS) // 524288
-#define SPAT_BYTES_PER_CHUNK (SPAT_PAGES_PER_CHUNK / 8)    // 65536
 #define ADDRESS_SPACE_BITS (48)
-#define ADDRESS_SPACE_SIZE (1LL << ADDRESS_SPACE_BITS)
 
 #else
 
 // Each chunk covers 2 GB of virtual address space:
+#define SPAT_TOPLEVEL_CHUNK_BITS 1
+#define SPAT_PAGES_PER_CHUNK_BITS 19
 #define ADDRESS_SPACE_BITS (32)
-#define ADDRESS_SPACE_SIZE (1LL << ADDRESS_SPACE_BITS)
-#define SPAT_BYTES ((ADDRESS_SPACE_SIZE / PAGE_SIZE) / 8)
 
 #endif
 
+#define SPAT_TOPLEVEL_CHUNKS (1 << SPAT_TOPLEVEL_CHUNK_BITS) // 131072
+#define SPAT_PAGES_PER_CHUNK (1 << SPAT_PAGES_PER_CHUNK_BITS) // 524288
+#define ADDRESS_SPACE_SIZE (1LL << ADDRESS_SPACE_BITS)
+
 class AddressSpace {
 public:
   AddressSpace();
   ~AddressSpace();
   void reset();
+  void release();
+  void swap(AddressSpace& other);
 public:
-  Hashtable<Waddr, W8*> mapped_mem;
+  OpenHashtable<Waddr, W8*> mapped_mem;
 
   void map(Waddr start, Waddr length, int prot) {
     start = floor(start, PAGE_SIZE);
     length = ceil(length, PAGE_SIZE);
     Waddr num_pages = length / PAGE_SIZE;
-    foreach (i, num_pages) {
-      W8* old_val;
-      if (mapped_mem.remove(start + i * PAGE_SIZE, old_val))
-        delete[] old_val;
-      mapped_mem.add(start + i * PAGE_SIZE, new W8[PAGE_SIZE]());
+    release_range(start, start + length);
+    W8* data = alloc_pages(length);
+    if (num_pages < EXTENT_MIN_PAGES) {
+      foreach (i, num_pages) mapped_mem.add(start + i * PAGE_SIZE, data + i * PAGE_SIZE);
+    } else {
+      add_extent(start, start + length, data);
     }
     setattr((byte*)start, length, prot);
+    update_pageattrs(pageid(start), pageid(start + length - 1), 0, PAGE_ATTR_ZERO);
   }
   void unmap(Waddr start, Waddr length) {
     start = floor(start, PAGE_SIZE);
     length = ceil(length, PAGE_SIZE);
-    Waddr num_pages = length / PAGE_SIZE;
-    foreach (i, num_pages) {
-      W8* old_val;
-      if (mapped_mem.remove(start + i * PAGE_SIZE, old_val))
-        delete[] old_val;
-    }
+    release_range(start, start + length);
     setattr((byte*)start, length, PROT_NONE);
   }
 
+  //
+  // Guest pages live in large host mappings: anonymous arenas, backed by
+  // 2 MB huge pages where possible, and private file mappings which are
+  // directly aliased (e.g. read-only segments of a binary test case).
+  // Large ranges get an arena of their own; small ones are carved from
+  // the current pool arena, so consecutively mapped pages stay adjacent
+  // on the host. Each mapping is unmapped once no guest page refers to
+  // it any more.
+  //
+  struct HostMapping {
+    W8* base;
+    Waddr size;
+    Waddr refs;
+  };
+
+  dynarray<HostMapping> host_mappings;
+  int last_host_mapping;
+
+  W8* pool_next;
+  W8* pool_end;
+
+  //
+  // Large ranges are not entered page by page into mapped_mem: each is
+  // kept as an extent of guest pages backed by consecutive host pages of
+  // one arena, so any of its pages translates with a binary search of
+  // the sorted extent list and one subtraction.
+  //
+  struct Extent {
+    Waddr start;
+    Waddr end;
+    W8* base;
+  };
+
+  static const int EXTENT_MIN_PAGES = 128;
+
+  dynarray<Extent> extents;
+
+  int find_extent(Waddr addr) const;
+  void add_extent(Waddr start, Waddr end, W8* base);
+
+  W8* lookup_page(Waddr addr) {
+    W8** res = mapped_mem.get(addr);
+    if likely (res) return *res;
+    int i = find_extent(addr);
+    return (i >= 0) ? extents[i].base + (addr - extents[i].start) : null;
+  }
+
+  W8* detach_page(Waddr addr);
+  void mapped_pages(dynarray<Waddr>& pages);
+
+  HostMapping* host_mapping_of(W8* data);
+  W8* map_arena(Waddr size);
+  W8* alloc_pages(Waddr length);
+  W8* map_file(int fd, Waddr size);
+  void alias(Waddr start, W8* data, Waddr length, int prot);
+  void free_page_data(W8* data);
+  void free_extent_data(W8* data, Waddr num_pages);
+  void release_page(Waddr addr);
+  void release_range(Waddr start, Waddr end);
+  void invalidate_translations(Waddr start, Waddr end);
+
+  //
+  // Software TLB: a direct mapped cache of {page, prot, host page} that
+  // fuses the shadow page attribute check with the mapped_mem lookup, so
+  // a guest access normally costs one compare. Entries are dropped by
+  // setattr() and whenever the host page behind a guest page changes.
+  //
+  struct TLBEntry {
+    Waddr tag;
+    int prot;
+    W8* data;
+  };
+
+  static const int TLB_SIZE_BITS = 8;
+  static const int TLB_SIZE = (1 << TLB_SIZE_BITS);
+  // Never matches a page address:
+  static const Waddr TLB_INVALID_TAG = 1;
+
+  TLBEntry tlb[TLB_SIZE];
+
+  TLBEntry& tlb_slot(Waddr addr) { return tlb[lowbits(addr >> 12, TLB_SIZE_BITS)]; }
+
+  const TLBEntry& translate(Waddr addr) {
+    TLBEntry& e = tlb_slot(addr);
+    if likely (e.tag == floor(addr, PAGE_SIZE)) return e;
+    return tlb_fill(e, floor(addr, PAGE_SIZE));
+  }
+
+  TLBEntry& tlb_fill(TLBEntry& e, Waddr page);
+  void tlb_flush_page(Waddr addr) { tlb_slot(addr).tag = TLB_INVALID_TAG; }
+  void tlb_flush(Waddr start, Waddr length);
+  void tlb_flush_all();
+
+  //
+  // Mapped pages are demand-zero (PAGE_ATTR_ZERO) until first written:
+  // until then loads are served from one shared read-only zero page, and
+  // the host page behind them (zero filled, and usually not yet touched
+  // on the host either) is left alone. Stores go through store_page(),
+  // which materializes the page on the first one.
+  //
+  W8* zero_page;
+
+  W8* materialize(Waddr page);
+
+  W8* store_page(Waddr addr) {
+    W8* data = translate(addr).data;
+    if unlikely (data == zero_page) return materialize(floor(addr, PAGE_SIZE));
+    return data;
+  }
+
   void* page_virt_to_mapped(Waddr addr) {
-    W8** res = mapped_mem.get(floor(addr, PAGE_SIZE));
+    if unlikely (pageattr(addr) & PAGE_ATTR_ZERO) materialize(floor(addr, PAGE_SIZE));
+    W8* res = lookup_page(floor(addr, PAGE_SIZE));
     if (!res) return res;
     // logfile << "ASP: Map ", (void*) addr, " to ", res, endl, flush;
-    return (W8*)*res + lowbits(addr, 12);
+    return res + lowbits(addr, 12);
   }
 
   //
-  // Shadow page attribute table
+  // Read-only variant: demand-zero pages read as the shared zero page
+  // instead of being materialized (result dumps, code page checks).
   //
-#ifdef __x86_64__
-  typedef byte SPATChunk[SPAT_BYTES_PER_CHUNK];
-  typedef SPATChunk** spat_t;
-#else
-  typedef byte* spat_t;
-#endif
-  spat_t readmap;
-  spat_t writemap;
-  spat_t execmap;
-  spat_t dirtymap;
-
-  spat_t allocmap();
-  void freemap(spat_t top);
+  const void* page_virt_to_mapped_readonly(Waddr addr) {
+    if unlikely (pageattr(addr) & PAGE_ATTR_ZERO) return zero_page + lowbits(addr, 12);
+    W8* res = lookup_page(floor(addr, PAGE_SIZE));
+    if (!res) return res;
+    return res + lowbits(addr, 12);
+  }
 
-  byte& pageid_to_map_byte(spat_t top, Waddr pageid);
-  void make_accessible(void* address, Waddr size, spat_t top);
-  void make_inaccessible(void* address, Waddr size, spat_t top);
+  //
+  // Shadow page attribute table: one attribute byte per page, in chunks
+  // allocated on first use. The protection bits are the PROT_xxx bits,
+  // so getattr() is a single load and setattr() updates whole runs of
+  // pages eight at a time.
+  //
+  enum {
+    PAGE_ATTR_PROT    = PROT_READ|PROT_WRITE|PROT_EXEC,
+    // Written since its translations were made (self modifying code):
+    PAGE_ATTR_DIRTY   = (1 << 3),
+    // Written, mapped or unmapped since the last snapshot or restore:
+    PAGE_ATTR_RESTORE = (1 << 4),
+    // Mapped but never written (see store_page()):
+    PAGE_ATTR_ZERO    = (1 << 5),
+  };
+
+  typedef byte PageAttrChunk[SPAT_PAGES_PER_CHUNK];
+
+  PageAttrChunk** attrmap;
+  // Populated chunks, so reset() only touches those:
+  dynarray<Waddr> attr_chunks;
+  // Pages with PAGE_ATTR_RESTORE set:
+  dynarray<Waddr> restore_pages;
+
+  // Ranges mapped, aliased or unmapped since the last snapshot or restore
+  // (recorded as a whole, so large ranges cost nothing per page):
+  struct RestoreRange {
+    Waddr start;
+    Waddr end;
+  };
+
+  dynarray<RestoreRange> restore_ranges;
+
+  void add_restore_range(Waddr start, Waddr end);
 
   Waddr pageid(void* address) const {
 #ifdef __x86_64__
@@ -124,89 +264,167 @@ public:
 
   Waddr pageid(Waddr address) const { return pageid((void*)address); }
 
-  void make_page_accessible(void* address, spat_t top) {
-    setbit(pageid_to_map_byte(top, pageid(address)), lowbits(pageid(address), 3));
+  byte pageattr(Waddr addr) const {
+    Waddr page = pageid(addr);
+    PageAttrChunk* chunk = attrmap[page >> SPAT_PAGES_PER_CHUNK_BITS];
+    if unlikely (!chunk) return 0;
+    return (*chunk)[lowbits(page, SPAT_PAGES_PER_CHUNK_BITS)];
   }
 
-  void make_page_inaccessible(void* address, spat_t top) {
-    clearbit(pageid_to_map_byte(top, pageid(address)), lowbits(pageid(address), 3));
+  PageAttrChunk& attr_chunk(Waddr chunkid);
+
+  byte& pageattr_ref(Waddr pageid) {
+    return attr_chunk(pageid >> SPAT_PAGES_PER_CHUNK_BITS)[lowbits(pageid, SPAT_PAGES_PER_CHUNK_BITS)];
+  }
+
+  void set_pageattr(Waddr mfn, byte attrs) {
+    byte& attr = pageattr_ref(pageid(mfn << 12));
+    if unlikely ((attrs & PAGE_ATTR_RESTORE) & (~attr)) {
+      // dynarray only grows by its granularity: double it instead, for large ranges
+      if unlikely (restore_pages.length == restore_pages.capacity()) restore_pages.reserve(restore_pages.length * 2);
+      restore_pages.push(pageid(mfn << 12));
+    }
+    attr |= attrs;
   }
 
-  void allow_read(void* address, Waddr size) { make_accessible(address, size, readmap); }
-  void disallow_read(void* address, Waddr size) { make_inaccessible(address, size, readmap); }
-  void allow_write(void* address, Waddr size) { make_accessible(address, size, writemap); }
-  void disallow_write(void* address, Waddr size) { make_inaccessible(address, size, writemap); }
-  void allow_exec(void* address, Waddr size) { make_accessible(address, size, execmap); }
-  void disallow_exec(void* address, Waddr size) { make_inaccessible(address, size, execmap); }
+  void clear_pageattr(Waddr mfn, byte attrs) {
+    pageattr_ref(pageid(mfn << 12)) &= ~attrs;
+  }
+
+  void update_pageattrs(Waddr firstpage, Waddr lastpage, byte clearmask, byte setmask);
 
 public:
   //
   // Memory management passthroughs
   //
   void setattr(void* start, Waddr length, int prot);
-  int getattr(void* start);
-
-  bool fastcheck(Waddr addr, spat_t top) const {
-#ifdef __x86_64__
-    // Is it outside of userspace address range?
-    // Check disabled to allow access to VDSO in kernel space.
-    // if unlikely (addr >> 48) return 0;
+  int getattr(void* start) { return pageattr((Waddr)start) & PAGE_ATTR_PROT; }
 
-    W64 chunkid = pageid(addr) >> log2(SPAT_PAGES_PER_CHUNK);
+  bool check(void* p, int prot) const {
+    return ((prot & (~pageattr((Waddr)p)) & PAGE_ATTR_PROT) == 0);
+  }
 
-    if unlikely (!top[chunkid])
-      return false;
+  bool isdirty(Waddr mfn) { return ((pageattr(mfn << 12) & PAGE_ATTR_DIRTY) != 0); }
+  void setdirty(Waddr mfn) { set_pageattr(mfn, PAGE_ATTR_DIRTY|PAGE_ATTR_RESTORE); }
+  void cleardirty(Waddr mfn) { clear_pageattr(mfn, PAGE_ATTR_DIRTY); }
 
-    AddressSpace::SPATChunk& chunk = *top[chunkid];
-    Waddr byteid = bits(pageid(addr), 3, log2(SPAT_BYTES_PER_CHUNK));
-    return bit(chunk[byteid], lowbits(pageid(addr), 3));
-#else // 32-bit
-    return bit(top[pageid(addr) >> 3], lowbits(pageid(addr), 3));
-#endif
-  }
+  //
+  // Snapshot and restore of the guest memory image: snapshot() keeps a
+  // pristine copy of every mapped page; every page written afterwards is
+  // marked PAGE_ATTR_RESTORE (unlike the dirty bit, which is cleared when
+  // translations are invalidated) and listed in restore_pages, and every
+  // range mapped or unmapped is listed in restore_ranges, so restore()
+  // only copies back the pages touched since.
+  //
+  struct SnapshotPage {
+    W8* data;
+    int prot;
+  };
 
-  bool fastcheck(void* addr, spat_t top) const {
-    return fastcheck((Waddr)addr, top);
-  }
+  OpenHashtable<Waddr, SnapshotPage> snapshot_pages;
 
-  bool check(void* p, int prot) const {
-    if unlikely ((prot & PROT_READ) && (!fastcheck(p, readmap)))
-      return false;
+  // Runs of pages still demand-zero when the snapshot was taken, by address:
+  struct SnapshotZeroRange {
+    Waddr start;
+    Waddr end;
+    int prot;
+  };
 
-    if unlikely ((prot & PROT_WRITE) && (!fastcheck(p, writemap)))
-      return false;
+  dynarray<SnapshotZeroRange> snapshot_zero_ranges;
 
-    if unlikely ((prot & PROT_EXEC) && (!fastcheck(p, execmap)))
-      return false;
+  const SnapshotZeroRange* snapshot_zero_range(Waddr addr) const;
 
-    return true;
-  }
+  void setrestore(Waddr mfn) { set_pageattr(mfn, PAGE_ATTR_RESTORE); }
+  bool in_snapshot(Waddr addr) { return (snapshot_pages.get(floor(addr, PAGE_SIZE)) || snapshot_zero_range(addr)); }
 
-  bool isdirty(Waddr mfn) { return fastcheck(mfn << 12, dirtymap); }
-  void setdirty(Waddr mfn) { make_page_accessible((void*)(mfn << 12), dirtymap); }
-  void cleardirty(Waddr mfn) { make_page_inaccessible((void*)(mfn << 12), dirtymap); }
+  void snapshot();
+  int restore(dynarray<Waddr>& new_pages, dynarray<RestoreRange>& new_ranges);
+  void discard_snapshot();
+  bool restore_page(Waddr addr);
+  int restore_range(Waddr start, Waddr end, dynarray<RestoreRange>& new_ranges);
+  int restore_zero_range(Waddr start, Waddr end, int prot);
+  void clear_restore_pages();
 
   void resync_with_process_maps();
 };
 
+//
+// The guest address space of the current simulation instance:
+//
 AddressSpace asp;
 
+//
+// Simulation instance: the registers, address space and translations
+// of one guest, and what is kept of them across test cases. The current
+// instance (sim) lives in the globals the simulator works on (ctx, asp
+// and bbcache); the others are set aside in the saved_xxx members, and
+// activate() exchanges the two. The core models and the statistics are
+// shared by all instances: they are reset for each run, and only the
+// current instance is ever simulated, so instances cannot run
+// concurrently (see ApiCall). The embedding API (raspsim.h) hands out
+// instances; the command line modes use a single one.
+//
+struct raspsim {
+  // The registers, memory and translations while the instance is not
+  // current (otherwise what another instance or none had set aside):
+  Context saved_ctx;
+  AddressSpace saved_asp;
+  BasicBlockCache saved_bbcache;
+
+  // Base image and the code pages retired since (see retire_guest_pages()):
+  Context* base_ctx;
+  Hashtable<Waddr, W8*> code_pages;
+
+  // Last guest exception (reported per test case in server mode):
+  int guest_exception;
+  W32 guest_exception_code;
+  Waddr guest_exception_addr;
+
+  // Counters of the last run, kept when other instances run:
+  raspsim_stats_t last_run;
+
+  raspsim();
+  ~raspsim();
+};
+
+static raspsim* sim = null;
+
+raspsim::raspsim() {
+  base_ctx = null;
+  guest_exception = -1;
+  guest_exception_code = 0;
+  guest_exception_addr = 0;
+  setzero(last_run);
+}
+
+// Its memory and translations are released first (see raspsim_destroy()):
+raspsim::~raspsim() {
+  delete base_ctx;
+}
+
 // Userspace PTLsim only supports one VCPU:
 int current_vcpuid() { return 0; }
 
-bool asp_check_exec(void* addr) { return asp.fastcheck(addr, asp.execmap); }
+bool asp_check_exec(void* addr) { return ((asp.translate((Waddr)addr).prot & PROT_EXEC) != 0); }
 
 bool smc_isdirty(Waddr mfn) { return asp.isdirty(mfn); }
 void smc_setdirty(Waddr mfn) { asp.setdirty(mfn); }
 void smc_cleardirty(Waddr mfn) { asp.cleardirty(mfn); }
 
-bool check_for_async_sim_break() { return false; }
+bool check_for_async_sim_break() {
+  // Budgets (-stopcycle, -stopinsns or raspsim_run()), or the end of sequential mode:
+  return ((sim_cycle >= config.stop_at_cycle) | (total_user_insns_committed >= config.stop_at_user_insns) | sequential_mode_marker_hit);
+}
 
 int inject_events() { return 0; }
 void print_sysinfo(ostream& os) {}
 
 // This is where we end up after issuing opcode 0x0f37 (undocumented x86 PTL call opcode)
 void assist_ptlcall(Context& ctx) {
+  // Only markers (callid in rdi, marker in rsi) do anything, and only to end sequential mode:
+  if unlikely (sequential_mode && (ctx.commitarf[REG_rdi] == PTLCALL_MARKER) && (ctx.commitarf[REG_rsi] == config.sequential_mode_marker)) {
+    sequential_mode_marker_hit = 1;
+  }
   ctx.commitarf[REG_rip] = ctx.commitarf[REG_nextrip];
 }
 
@@ -218,7 +436,8 @@ W64 loadphys(Waddr addr) {
   if (addr & 0x0000800000000000) {
     ptr = (W64*)(addr & 0x7fffffffffff);
   } else {
-    ptr = (W64*)asp.page_virt_to_mapped(floor(signext64(addr, 48), 8));
+    Waddr virtaddr = floor(signext64(addr, 48), 8);
+    ptr = (W64*)(asp.translate(virtaddr).data + lowbits(virtaddr, 12));
   }
   W64& data = *ptr;
   // logfile << "VMEM: Loadphys ", (void*)addr, " (8) ", data, endl, flush;
@@ -231,7 +450,8 @@ W64 storemask(Waddr addr, W64 data, byte bytemask) {
   if (addr & 0x0000800000000000) {
     ptr = (W64*)(addr & 0x7fffffffffff);
   } else {
-    ptr = (W64*)asp.page_virt_to_mapped(floor(signext64(addr, 48), 8));
+    Waddr virtaddr = floor(signext64(addr, 48), 8);
+    ptr = (W64*)(asp.store_page(virtaddr) + lowbits(virtaddr, 12));
   }
   W64& mem = *ptr;
   mem = mux64(expand_8bit_to_64bit_lut[bytemask], mem, data);
@@ -241,17 +461,15 @@ W64 storemask(Waddr addr, W64 data, byte bytemask) {
 int Context::copy_from_user(void* target, Waddr addr, int bytes, PageFaultErrorCode& pfec, Waddr& faultaddr, bool forexec, Level1PTE& ptelo, Level1PTE& ptehi) {
   // logfile << "VMEM: Read from user ", (void*)addr, " (", bytes, ")", endl, flush;
 
-  bool readable;
-  bool executable;
-
   int n = 0;
   pfec = 0;
 
   ptelo = 0;
   ptehi = 0;
 
-  readable = asp.fastcheck((byte*)addr, asp.readmap);
-  if likely (forexec) executable = asp.fastcheck((byte*)addr, asp.execmap);
+  const AddressSpace::TLBEntry& lo = asp.translate(addr);
+  bool readable = ((lo.prot & PROT_READ) != 0);
+  bool executable = ((lo.prot & PROT_EXEC) != 0);
   if unlikely ((!readable) | (forexec & !executable)) {
     faultaddr = addr;
     pfec.p = readable;
@@ -262,17 +480,17 @@ int Context::copy_from_user(void* target, Waddr addr, int bytes, PageFaultErrorC
 
   n = min((Waddr)(4096 - lowbits(addr, 12)), (Waddr)bytes);
 
-  void* mapped_addr = asp.page_virt_to_mapped(addr);
-  assert(mapped_addr);
-  // logfile << "VMEM: Read ", mapped_addr, " = ", *(W8*)mapped_addr, endl, flush;
-  memcpy(target, mapped_addr, n);
+  assert(lo.data);
+  // logfile << "VMEM: Read ", lo.data + lowbits(addr, 12), endl, flush;
+  memcpy(target, lo.data + lowbits(addr, 12), n);
 
   // All the bytes were on the first page
   if likely (n == bytes) return n;
 
   // Go on to second page, if present
-  readable = asp.fastcheck((byte*)(addr + n), asp.readmap);
-  if likely (forexec) executable = asp.fastcheck((byte*)(addr + n), asp.execmap);
+  const AddressSpace::TLBEntry& hi = asp.translate(addr + n);
+  readable = ((hi.prot & PROT_READ) != 0);
+  executable = ((hi.prot & PROT_EXEC) != 0);
   if unlikely ((!readable) | (forexec & !executable)) {
     faultaddr = addr + n;
     pfec.p = readable;
@@ -281,7 +499,7 @@ int Context::copy_from_user(void* target, Waddr addr, int bytes, PageFaultErrorC
     return n;
   }
 
-  memcpy((byte*)target + n, asp.page_virt_to_mapped(addr + n), bytes - n);
+  memcpy((byte*)target + n, hi.data, bytes - n);
   return bytes;
 }
 
@@ -289,15 +507,15 @@ int Context::copy_to_user(Waddr target, void* source, int bytes, PageFaultErrorC
   // logfile << "VMEM: Write to user ", (void*)target, " (", bytes, ")", endl, flush;
 
   pfec = 0;
-  bool writable = asp.fastcheck((byte*)target, asp.writemap);
-  if unlikely (!writable) {
+  const AddressSpace::TLBEntry& lo = asp.translate(target);
+  if unlikely (!(lo.prot & PROT_WRITE)) {
     faultaddr = target;
-    pfec.p = asp.fastcheck((byte*)target, asp.readmap);
+    pfec.p = ((lo.prot & PROT_READ) != 0);
     pfec.rw = 1;
     return 0;
   }
 
-  byte* targetlo = (byte*)asp.page_virt_to_mapped(target);
+  byte* targetlo = asp.store_page(target) + lowbits(target, 12);
   int nlo = min((Waddr)(4096 - lowbits(target, 12)), (Waddr)bytes);
 
   smc_setdirty(target >> 12);
@@ -309,16 +527,16 @@ int Context::copy_to_user(Waddr target, void* source, int bytes, PageFaultErrorC
   }
 
   // Go on to second page, if present
-  writable = asp.fastcheck((byte*)(target + nlo), asp.writemap);
-  if unlikely (!writable) {
+  const AddressSpace::TLBEntry& hi = asp.translate(target + nlo);
+  if unlikely (!(hi.prot & PROT_WRITE)) {
     faultaddr = target + nlo;
-    pfec.p = asp.fastcheck((byte*)(target + nlo), asp.readmap);
+    pfec.p = ((hi.prot & PROT_READ) != 0);
     pfec.rw = 1;
     pfec.us = 1;
     return nlo;
   }
 
-  memcpy(asp.page_virt_to_mapped(target + nlo), (byte*)source + nlo, bytes - nlo);
+  memcpy(asp.store_page(target + nlo), (byte*)source + nlo, bytes - nlo);
   memcpy(targetlo, source, nlo);
 
   smc_setdirty((target + nlo) >> 12);
@@ -342,11 +560,11 @@ Waddr Context::check_and_translate(Waddr virtaddr, int sizeshift, bool store, bo
     return virtaddr | 0x0000800000000000;
   }
 
-  AddressSpace::spat_t top = (store) ? asp.writemap : asp.readmap;
+  int prot = asp.translate(virtaddr).prot;
 
-  if unlikely (!asp.fastcheck(virtaddr, top)) {
+  if unlikely (!(prot & ((store) ? PROT_WRITE : PROT_READ))) {
     exception = (store) ? EXCEPTION_PageFaultOnWrite : EXCEPTION_PageFaultOnRead;
-    pfec.p = asp.fastcheck(virtaddr, asp.readmap);
+    pfec.p = ((prot & PROT_READ) != 0);
     pfec.rw = store;
     pfec.us = 1;
     return 0;
@@ -409,6 +627,9 @@ extern "C" void assert_fail(const char *__assertion, const char *__file, unsigne
     logfile.close();
   }
 
+  // A fuzzer only records a crash if the child dies from a signal:
+  if (config.forkserver) sys_kill(sys_getpid(), SIGABRT);
+
   sys_exit(1); // Well, we don't want core dumps.
 
   // Crash and make a core dump:
@@ -417,408 +638,3085 @@ extern "C" void assert_fail(const char *__assertion, const char *__file, unsigne
 }
 
 //
-// Shadow page accessibility table format (x86-64 only):
+// Shadow page attribute table format (x86-64):
 // Top level:  1048576 bytes: 131072 64-bit pointers to chunks
 //
-// Leaf level: 65536 bytes per chunk: 524288 bits, one per 4 KB page
+// Leaf level: 524288 bytes per chunk: one attribute byte per 4 KB page
 // Total: 131072 chunks x 524288 pages per chunk x 4 KB per page = 48 bits virtual address space
 // Total: 17 bits       + 19 bits                + 12 bits       = 48 bits virtual address space
 //
-// In 32-bit version, SPAT is a flat 131072-byte bit vector.
+// In the 32-bit version, the top level only has two chunks.
 //
 
-byte& AddressSpace::pageid_to_map_byte(spat_t top, Waddr pageid) {
-#ifdef __x86_64__
-  W64 chunkid = pageid >> log2(SPAT_PAGES_PER_CHUNK);
-
-  if (!top[chunkid]) {
-    top[chunkid] = (SPATChunk*)ptl_mm_alloc_private_pages(SPAT_BYTES_PER_CHUNK);
+AddressSpace::PageAttrChunk& AddressSpace::attr_chunk(Waddr chunkid) {
+  if unlikely (!attrmap[chunkid]) {
+    attrmap[chunkid] = (PageAttrChunk*)ptl_mm_alloc_private_pages(sizeof(PageAttrChunk));
+    attr_chunks.push(chunkid);
   }
-  SPATChunk& chunk = *top[chunkid];
-  W64 byteid = bits(pageid, 3, log2(SPAT_BYTES_PER_CHUNK));
-  assert(byteid <= SPAT_BYTES_PER_CHUNK);
-  return chunk[byteid];
-#else
-  return top[pageid >> 3];
-#endif
+  return *attrmap[chunkid];
 }
 
-void AddressSpace::make_accessible(void* p, Waddr size, spat_t top) {
-  Waddr address = lowbits((Waddr)p, ADDRESS_SPACE_BITS);
-  Waddr firstpage = (Waddr)address >> log2(PAGE_SIZE);
-  Waddr lastpage = ((Waddr)address + size - 1) >> log2(PAGE_SIZE);
-  if (logable(1)) {
-    logfile << "SPT: Making byte range ", (void*)(firstpage << log2(PAGE_SIZE)), " to ",
-      (void*)(lastpage << log2(PAGE_SIZE)), " (size ", size, ") accessible for ",
-    ((top == readmap) ? "read" : (top == writemap) ? "write" : (top == execmap) ? "exec" : "UNKNOWN"),
-      endl, flush;
+//
+// Replace the clearmask bits of each page's attributes by setmask,
+// eight pages per store where possible.
+//
+void AddressSpace::update_pageattrs(Waddr firstpage, Waddr lastpage, byte clearmask, byte setmask) {
+  W64 keep = ~(clearmask * 0x0101010101010101ULL);
+  W64 set = setmask * 0x0101010101010101ULL;
+
+  Waddr page = firstpage;
+  while (page <= lastpage) {
+    Waddr chunkid = page >> SPAT_PAGES_PER_CHUNK_BITS;
+    Waddr chunkend = min(lastpage, ((chunkid + 1) << SPAT_PAGES_PER_CHUNK_BITS) - 1);
+
+    // Clearing attributes of pages which never had any:
+    if ((!attrmap[chunkid]) && (!setmask)) {
+      page = chunkend + 1;
+      continue;
+    }
+
+    PageAttrChunk& chunk = attr_chunk(chunkid);
+    byte* p = chunk + lowbits(page, SPAT_PAGES_PER_CHUNK_BITS);
+    byte* end = chunk + lowbits(chunkend, SPAT_PAGES_PER_CHUNK_BITS) + 1;
+
+    while ((p < end) && lowbits((Waddr)p, 3)) { *p = (*p & keep) | set; p++; }
+    while ((p + 8) <= end) { *(W64*)p = (*(W64*)p & keep) | set; p += 8; }
+    while (p < end) { *p = (*p & keep) | set; p++; }
+
+    page = chunkend + 1;
   }
-  assert(ceil((W64)address + size, PAGE_SIZE) <= ADDRESS_SPACE_SIZE);
-  for (W64 i = firstpage; i <= lastpage; i++) { setbit(pageid_to_map_byte(top, i), lowbits(i, 3)); }
 }
 
-void AddressSpace::make_inaccessible(void* p, Waddr size, spat_t top) {
-  Waddr address = lowbits((Waddr)p, ADDRESS_SPACE_BITS);
-  Waddr firstpage = (Waddr)address >> log2(PAGE_SIZE);
-  Waddr lastpage = ((Waddr)address + size - 1) >> log2(PAGE_SIZE);
-  if (logable(1)) {
-    logfile << "SPT: Making byte range ", (void*)(firstpage << log2(PAGE_SIZE)), " to ",
-      (void*)(lastpage << log2(PAGE_SIZE)), " (size ", size, ") inaccessible for ",
-    ((top == readmap) ? "read" : (top == writemap) ? "write" : (top == execmap) ? "exec" : "UNKNOWN"),
-      endl, flush;
-  }
-  assert(ceil((W64)address + size, PAGE_SIZE) <= ADDRESS_SPACE_SIZE);
-  for (Waddr i = firstpage; i <= lastpage; i++) { clearbit(pageid_to_map_byte(top, i), lowbits(i, 3)); }
+AddressSpace::AddressSpace() {
+  last_host_mapping = 0;
+  pool_next = null;
+  pool_end = null;
+  zero_page = null;
+  attrmap = null;
 }
 
-AddressSpace::AddressSpace() { }
+//
+// Exchange the whole guest address space with another one, e.g. one set
+// aside while another simulation instance is current. Nothing points
+// into an AddressSpace itself, so this only swaps the members.
+//
+void AddressSpace::swap(AddressSpace& other) {
+  mapped_mem.swap(other.mapped_mem);
+  host_mappings.swap(other.host_mappings);
+  ::swap(last_host_mapping, other.last_host_mapping);
+  ::swap(pool_next, other.pool_next);
+  ::swap(pool_end, other.pool_end);
+  extents.swap(other.extents);
+  foreach (i, TLB_SIZE) ::swap(tlb[i], other.tlb[i]);
+  ::swap(zero_page, other.zero_page);
+  ::swap(attrmap, other.attrmap);
+  attr_chunks.swap(other.attr_chunks);
+  restore_pages.swap(other.restore_pages);
+  restore_ranges.swap(other.restore_ranges);
+  snapshot_pages.swap(other.snapshot_pages);
+  snapshot_zero_ranges.swap(other.snapshot_zero_ranges);
+}
 
-AddressSpace::~AddressSpace() { }
+// Arenas are allocated in multiples of one huge page:
+#define ARENA_SIZE (2*1024*1024)
 
-AddressSpace::spat_t AddressSpace::allocmap() {
-#ifdef __x86_64__
-  return (spat_t)ptl_mm_alloc_private_pages(SPAT_TOPLEVEL_CHUNKS * sizeof(SPATChunk*));
-#else
-  return (spat_t)ptl_mm_alloc_private_pages(SPAT_BYTES);
-#endif
-}
-void AddressSpace::freemap(AddressSpace::spat_t top) {
-#ifdef __x86_64__
-  if (top) {
-    foreach (i, SPAT_TOPLEVEL_CHUNKS) {
-      if (top[i]) ptl_mm_free_private_pages(top[i], SPAT_BYTES_PER_CHUNK);
-    }
-    ptl_mm_free_private_pages(top, SPAT_TOPLEVEL_CHUNKS * sizeof(SPATChunk*));
-  }
-#else
-  if (top) {
-    ptl_mm_free_private_pages(top, SPAT_BYTES);
+AddressSpace::HostMapping* AddressSpace::host_mapping_of(W8* data) {
+  // Pages are mostly freed in runs from the same mapping:
+  if likely (last_host_mapping < host_mappings.length) {
+    HostMapping& hm = host_mappings[last_host_mapping];
+    if likely (inrange(data, hm.base, hm.base + hm.size - 1)) return &hm;
   }
-#endif
-}
 
-void AddressSpace::reset() {
-  freemap(readmap);
-  freemap(writemap);
-  freemap(execmap);
-  freemap(dirtymap);
+  foreach (i, host_mappings.length) {
+    HostMapping& hm = host_mappings[i];
+    if (!inrange(data, hm.base, hm.base + hm.size - 1)) continue;
+    last_host_mapping = i;
+    return &hm;
+  }
 
-  readmap  = allocmap();
-  writemap = allocmap();
-  execmap  = allocmap();
-  dirtymap = allocmap();
+  return null;
 }
 
-void AddressSpace::setattr(void* start, Waddr length, int prot) {
-  //
-  // Check first if it's been assigned a non-stdin (> 0) filehandle,
-  // since this may get called from ptlsim_preinit_entry before streams
-  // have been set up.
-  //
-  if (logfile.filehandle() > 0) {
-    logfile << "setattr: region ", start, " to ", (void*)((char*)start + length), " (", length >> 10, " KB) has user-visible attributes ",
-      ((prot & PROT_READ) ? 'r' : '-'), ((prot & PROT_WRITE) ? 'w' : '-'), ((prot & PROT_EXEC) ? 'x' : '-'), endl;
+//
+// Map an anonymous zero filled arena. Explicit huge pages are used if
+// the system has enough of them reserved; otherwise the arena is marked
+// for transparent huge pages.
+//
+W8* AddressSpace::map_arena(Waddr size) {
+  size = ceil(size, ARENA_SIZE);
+  W8* base = (W8*)sys_mmap(null, size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0);
+  if (mmap_invalid(base)) {
+    base = (W8*)sys_mmap(null, size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+    assert(!mmap_invalid(base));
+    sys_madvise(base, size, MADV_HUGEPAGE);
   }
 
-  if (prot & PROT_READ)
-    allow_read(start, length);
-  else disallow_read(start, length);
-
-  if (prot & PROT_WRITE)
-    allow_write(start, length);
-  else disallow_write(start, length);
-
-  if (prot & PROT_EXEC)
-    allow_exec(start, length);
-  else disallow_exec(start, length);
+  HostMapping& hm = host_mappings.push();
+  hm.base = base;
+  hm.size = size;
+  // The caller's reference, dropped with free_page_data(base):
+  hm.refs = 1;
+  return base;
 }
 
-int AddressSpace::getattr(void* addr) {
-  Waddr address = lowbits((Waddr)addr, ADDRESS_SPACE_BITS);
+//
+// Allocate zero filled host memory for length bytes of guest pages,
+// with one reference per page.
+//
+W8* AddressSpace::alloc_pages(Waddr length) {
+  Waddr num_pages = length / PAGE_SIZE;
 
-  Waddr page = pageid(address);
+  if (num_pages >= EXTENT_MIN_PAGES) {
+    W8* base = map_arena(length);
+    host_mapping_of(base)->refs = num_pages;
+    return base;
+  }
 
-  int prot =
-    (bit(pageid_to_map_byte(readmap, page), lowbits(page, 3)) ? PROT_READ : 0) |
-    (bit(pageid_to_map_byte(writemap, page), lowbits(page, 3)) ? PROT_WRITE : 0) |
-    (bit(pageid_to_map_byte(execmap, page), lowbits(page, 3)) ? PROT_EXEC : 0);
+  if ((!pool_next) || ((pool_next + length) > pool_end)) {
+    // Drop the pool's own reference to the old arena:
+    if (pool_next) free_page_data(pool_end - ARENA_SIZE);
+    pool_next = map_arena(ARENA_SIZE);
+    pool_end = pool_next + ARENA_SIZE;
+  }
 
-  return prot;
+  W8* data = pool_next;
+  pool_next += length;
+  host_mapping_of(data)->refs += num_pages;
+  return data;
 }
 
-// In userspace PTLsim, virtual == physical:
-// FIXME(AE): software virtual memory
-RIPVirtPhys& RIPVirtPhys::update(Context& ctx, int bytes) {
-  use64 = ctx.use64;
-  kernel = 0;
-  df = ((ctx.internal_eflags & FLAG_DF) != 0);
-  padlo = 0;
-  padhi = 0;
-  mfnlo = rip >> 12;
-  mfnhi = (rip + (bytes-1)) >> 12;
-  return *this;
+//
+// Map a whole file privately (copy on write), so its pages can be aliased
+// by guest pages. Returns null on failure.
+//
+W8* AddressSpace::map_file(int fd, Waddr size) {
+  W8* base = (W8*)sys_mmap(null, ceil(size, PAGE_SIZE), PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_NORESERVE, fd, 0);
+  if unlikely (mmap_invalid(base)) return null;
+
+  HostMapping& hm = host_mappings.push();
+  hm.base = base;
+  hm.size = ceil(size, PAGE_SIZE);
+  // The caller's reference, dropped with free_page_data(base):
+  hm.refs = 1;
+  return base;
 }
 
-// Saved and restored by asm code:
-FXSAVEStruct x87state;
-W16 saved_cs;
-W16 saved_ss;
-W16 saved_ds;
-W16 saved_es;
-W16 saved_fs;
-W16 saved_gs;
-
-void Context::propagate_x86_exception(byte exception, W32 errorcode, Waddr virtaddr) {
-  Waddr rip = ctx.commitarf[REG_selfrip];
+void AddressSpace::alias(Waddr start, W8* data, Waddr length, int prot) {
+  assert(!lowbits(start, 12));
+  assert(!lowbits((Waddr)data, 12));
 
-  logfile << "Exception ", exception, " (", x86_exception_names[exception], ") code=", errorcode, " addr=", (void*)virtaddr, " @ rip ", (void*)(Waddr)commitarf[REG_rip], " (", total_user_insns_committed, " commits, ", sim_cycle, " cycles)", endl, flush;
-  cerr << "Exception ", exception, " (", x86_exception_names[exception], ") code=", errorcode, " addr=", (void*)virtaddr, " @ rip ", (void*)(Waddr)commitarf[REG_rip], " (", total_user_insns_committed, " commits, ", sim_cycle, " cycles)", endl, flush;
+  Waddr num_pages = ceil(length, PAGE_SIZE) / PAGE_SIZE;
+  HostMapping* hm = host_mapping_of(data);
+  if (hm) hm->refs += num_pages;
 
-  // PF
-  if (exception == 14) {
-    // PF Flags
-    W8 p    = errorcode & 0x00000001;
-    W8 wr   = errorcode & 0x00000002;
-    W8 us   = errorcode & 0x00000004;
-    W8 rsvd = errorcode & 0x00000008;
-    W8 id   = errorcode & 0x00000010;
-    W8 pk   = errorcode & 0x00000020;
+  release_range(start, start + num_pages * PAGE_SIZE);
+  if (num_pages < EXTENT_MIN_PAGES) {
+    foreach (i, num_pages) mapped_mem.add(start + i * PAGE_SIZE, data + i * PAGE_SIZE);
+  } else {
+    add_extent(start, start + num_pages * PAGE_SIZE, data);
+  }
+  setattr((void*)start, length, prot);
+}
 
-    logfile << "PageFault error code: 0x", hexstring(errorcode, 32), ", Flags: ", (pk ? "PK " : ""), (id ? "I " : "D "), (rsvd ? "RSVD " : ""), (us ? "U " : "S "), (wr ? "W " : "R "), (p ? "P" : ""), endl, flush;
-    cerr    << "PageFault error code: 0x", hexstring(errorcode, 32), ", Flags: ", (pk ? "PK " : ""), (id ? "I " : "D "), (rsvd ? "RSVD " : ""), (us ? "U " : "S "), (wr ? "W " : "R "), (p ? "P" : ""), endl, flush;
+void AddressSpace::free_page_data(W8* data) {
+  HostMapping* hm = host_mapping_of(data);
+  if (!hm) {
+    delete[] data;
+    return;
   }
 
-  if (config.dumpcode_filename.set()) {
-    byte insnbuf[1024];
-    PageFaultErrorCode insn_pfec;
-    Waddr insn_faultaddr;
-    int valid_byte_count = copy_from_user(insnbuf, rip, sizeof(insnbuf), insn_pfec, insn_faultaddr);
+  if (--hm->refs) return;
 
-    logfile << "Writing ", valid_byte_count, " bytes from rip ", (void*)rip, " to ", ((char*)config.dumpcode_filename), "...", endl, flush;
-    odstream("dumpcode.dat").write(insnbuf, sizeof(insnbuf));
-  }
+  sys_munmap(hm->base, hm->size);
+  *hm = host_mappings[host_mappings.length-1];
+  host_mappings.pop();
+}
 
-  logfile << "Aborting...", endl, flush;
-  cerr << "Aborting...", endl, flush;
-  assert(false);
+//
+// Drop the references of num_pages consecutive host pages of one mapping
+// (the pages behind part of an extent)
+//
+void AddressSpace::free_extent_data(W8* data, Waddr num_pages) {
+  HostMapping* hm = host_mapping_of(data);
+  assert(hm);
+  assert(hm->refs >= num_pages);
+
+  hm->refs -= num_pages;
+  if (hm->refs) return;
+
+  sys_munmap(hm->base, hm->size);
+  *hm = host_mappings[host_mappings.length-1];
+  host_mappings.pop();
 }
 
-#ifdef __x86_64__
+int AddressSpace::find_extent(Waddr addr) const {
+  int lo = 0;
+  int hi = extents.length - 1;
+  while (lo <= hi) {
+    int mid = (lo + hi) / 2;
+    const Extent& ext = extents.data[mid];
+    if (addr < ext.start) hi = mid - 1;
+    else if (addr >= ext.end) lo = mid + 1;
+    else return mid;
+  }
+  return -1;
+}
 
-const char* syscall_names_64bit[] = {
-  "read", "write", "open", "close", "stat", "fstat", "lstat", "poll", "lseek", "mmap", "mprotect", "munmap", "brk", "rt_sigaction", "rt_sigprocmask", "rt_sigreturn", "ioctl", "pread64", "pwrite64", "readv", "writev", "access", "pipe", "select", "sched_yield", "mremap", "msync", "mincore", "madvise", "shmget", "shmat", "shmctl", "dup", "dup2", "pause", "nanosleep", "getitimer", "alarm", "setitimer", "getpid", "sendfile", "socket", "connect", "accept", "sendto", "recvfrom", "sendmsg", "recvmsg", "shutdown", "bind", "listen", "getsockname", "getpeername", "socketpair", "setsockopt", "getsockopt", "clone", "fork", "vfork", "execve", "exit", "wait4", "kill", "uname", "semget", "semop", "semctl", "shmdt", "msgget", "msgsnd", "msgrcv", "msgctl", "fcntl", "flock", "fsync", "fdatasync", "truncate", "ftruncate", "getdents", "getcwd", "chdir", "fchdir", "rename", "mkdir", "rmdir", "creat", "link", "unlink", "symlink", "readlink", "chmod", "fchmod", "chown", "fchown", "lchown", "umask", "gettimeofday", "getrlimit", "getrusage", "sysinfo", "times", "ptrace", "getuid", "syslog", "getgid", "setuid", "setgid", "geteuid", "getegid", "setpgid", "getppid", "getpgrp", "setsid", "setreuid", "setregid", "getgroups", "setgroups", "setresuid", "getresuid", "setresgid", "getresgid", "getpgid", "setfsuid", "setfsgid", "getsid", "capget", "capset", "rt_sigpending", "rt_sigtimedwait", "rt_sigqueueinfo", "rt_sigsuspend", "sigaltstack", "utime", "mknod", "uselib", "personality", "ustat", "statfs", "fstatfs", "sysfs", "getpriority", "setpriority", "sched_setparam", "sched_getparam", "sched_setscheduler", "sched_getscheduler", "sched_get_priority_max", "sched_get_priority_min", "sched_rr_get_interval", "mlock", "munlock", "mlockall", "munlockall", "vhangup", "modify_ldt", "pivot_root", "_sysctl", "prctl", "arch_prctl", "adjtimex", "setrlimit", "chroot", "sync", "acct", "settimeofday", "mount", "umount2", "swapon", "swapoff", "reboot", "sethostname", "setdomainname", "iopl", "ioperm", "create_module", "init_module", "delete_module", "get_kernel_syms", "query_module", "quotactl", "nfsservctl", "getpmsg", "putpmsg", "afs_syscall", "tuxcall", "security", "gettid", "readahead", "setxattr", "lsetxattr", "fsetxattr", "getxattr", "lgetxattr", "fgetxattr", "listxattr", "llistxattr", "flistxattr", "removexattr", "lremovexattr", "fremovexattr", "tkill", "time", "futex", "sched_setaffinity", "sched_getaffinity", "set_thread_area", "io_setup", "io_destroy", "io_getevents", "io_submit", "io_cancel", "get_thread_area", "lookup_dcookie", "epoll_create", "epoll_ctl_old", "epoll_wait_old", "remap_file_pages", "getdents64", "set_tid_address", "restart_syscall", "semtimedop", "fadvise64", "timer_create", "timer_settime", "timer_gettime", "timer_getoverrun", "timer_delete", "clock_settime", "clock_gettime", "clock_getres", "clock_nanosleep", "exit_group", "epoll_wait", "epoll_ctl", "tgkill", "utimes", "vserver", "vserver", "mbind", "set_mempolicy", "get_mempolicy", "mq_open", "mq_unlink", "mq_timedsend", "mq_timedreceive", "mq_notify", "mq_getsetattr", "kexec_load", "waitid"};
+void AddressSpace::add_extent(Waddr start, Waddr end, W8* base) {
+  int i = extents.length;
+  extents.push();
+  while ((i > 0) && (extents[i-1].start > start)) {
+    extents[i] = extents[i-1];
+    i--;
+  }
+  Extent& ext = extents[i];
+  ext.start = start;
+  ext.end = end;
+  ext.base = base;
+}
 
 //
-// SYSCALL instruction from x86-64 mode
+// Take one guest page out of the address space, without dropping the
+// reference to its host page, which is returned (or null if unmapped).
 //
+W8* AddressSpace::detach_page(Waddr addr) {
+  W8* data;
+  if (mapped_mem.remove(addr, data)) {
+    clear_pageattr(addr >> 12, PAGE_ATTR_ZERO);
+    tlb_flush_page(addr);
+    return data;
+  }
 
-void handle_syscall_64bit() {
-  bool DEBUG = 1; //analyze_in_detail();
-  //
-  // Handle an x86-64 syscall:
-  // (This is called from the assist_syscall ucode assist)
-  //
+  int i = find_extent(addr);
+  if likely (i < 0) return null;
 
-  int syscallid = ctx.commitarf[REG_rax];
-  W64 arg1 = ctx.commitarf[REG_rdi];
-  W64 arg2 = ctx.commitarf[REG_rsi];
-  W64 arg3 = ctx.commitarf[REG_rdx];
-  W64 arg4 = ctx.commitarf[REG_r10];
-  W64 arg5 = ctx.commitarf[REG_r8];
-  W64 arg6 = ctx.commitarf[REG_r9];
+  clear_pageattr(addr >> 12, PAGE_ATTR_ZERO);
 
-  if (DEBUG)
-    logfile << "handle_syscall -> (#", syscallid, " ", ((syscallid < lengthof(syscall_names_64bit)) ? syscall_names_64bit[syscallid] : "???"),
-      ") from ", (void*)ctx.commitarf[REG_rcx], " args ", " (", (void*)arg1, ", ", (void*)arg2, ", ", (void*)arg3, ", ", (void*)arg4, ", ",
-      (void*)arg5, ", ", (void*)arg6, ") at iteration ", iterations, endl, flush;
+  Extent& ext = extents[i];
+  data = ext.base + (addr - ext.start);
 
-  ctx.commitarf[REG_rax] = -ENOSYS;
-  ctx.commitarf[REG_rip] = ctx.commitarf[REG_rcx];
+  if (addr == ext.start) {
+    ext.start += PAGE_SIZE;
+    ext.base += PAGE_SIZE;
+  } else if ((addr + PAGE_SIZE) == ext.end) {
+    ext.end -= PAGE_SIZE;
+  } else {
+    Waddr end = ext.end;
+    ext.end = addr;
+    add_extent(addr + PAGE_SIZE, end, data + PAGE_SIZE);
+  }
 
-  if (DEBUG) logfile << "handle_syscall: result ", ctx.commitarf[REG_rax], " (", (void*)ctx.commitarf[REG_rax], "); returning to ", (void*)ctx.commitarf[REG_rip], endl, flush;
+  if (extents[i].start == extents[i].end) {
+    foreach (j, extents.length - i - 1) extents[i + j] = extents[i + j + 1];
+    extents.pop();
+  }
+
+  tlb_flush_page(addr);
+  return data;
 }
 
-#endif // __x86_64__
+//
+// Collect the addresses of all mapped guest pages
+//
+void AddressSpace::mapped_pages(dynarray<Waddr>& pages) {
+  Waddr count = mapped_mem.count;
+  foreach (i, extents.length) count += (extents[i].end - extents[i].start) / PAGE_SIZE;
+  pages.reserve(pages.length + count);
 
-void handle_syscall_32bit(int semantics) {
-  bool DEBUG = 1; //analyze_in_detail();
-  //
-  // Handle a 32-bit syscall:
-  // (This is called from the assist_syscall ucode assist)
-  //
-  if (semantics == SYSCALL_SEMANTICS_INT80) {
-    // Our exit operation.
-    requested_switch_to_native = 1;
-  } else {
-    // But don't clobber RAX when we want out guest to quit.
-    ctx.commitarf[REG_rax] = -ENOSYS;
-  }
+  OpenHashtable<Waddr, W8*>::Iterator iter(mapped_mem);
+  KeyValuePair<Waddr, W8*>* kvp;
+  while (kvp = iter.next()) pages.push(kvp->key);
 
-  ctx.commitarf[REG_rip] = ctx.commitarf[REG_nextrip];
+  foreach (i, extents.length) {
+    for (Waddr addr = extents[i].start; addr < extents[i].end; addr += PAGE_SIZE) pages.push(addr);
+  }
 }
 
 //
-// Get the processor core frequency in cycles/second:
+// Drop one guest page, and any translations made from it.
 //
-static W64 core_freq_hz = 0;
+void AddressSpace::release_page(Waddr addr) {
+  W8* data = detach_page(addr);
+  if (data) {
+    free_page_data(data);
+    bbcache.invalidate_page(addr >> 12, INVALIDATE_REASON_DMA);
+  }
+  setrestore(addr >> 12);
+}
 
-W64 get_core_freq_hz() {
-  if likely (core_freq_hz) return core_freq_hz;
+//
+// Drop all guest pages in [start, end), and any translations made from
+// them. This costs as much as the pages actually mapped there, not the
+// size of the range: the range is cut out of the extents overlapping it,
+// and compared against mapped_mem by walking its entries if it has fewer
+// of them than the range has pages.
+//
+void AddressSpace::release_range(Waddr start, Waddr end) {
+  if (start >= end) return;
 
-  W64 hz = 0;
+  add_restore_range(start, end);
+  invalidate_translations(start, end);
 
-  istream cpufreqis("/sys/devices/system/cpu/cpu0/cpufreq/cpuinfo_max_freq");
-  if (cpufreqis) {
-    char s[256];
-    cpufreqis >> readline(s, sizeof(s));
+  Waddr num_pages = (end - start) / PAGE_SIZE;
+  if (num_pages <= mapped_mem.count) {
+    for (Waddr addr = start; addr < end; addr += PAGE_SIZE) {
+      W8* data;
+      if (mapped_mem.remove(addr, data)) free_page_data(data);
+    }
+  } else if (mapped_mem.count) {
+    dynarray<Waddr> pages(1);
+    OpenHashtable<Waddr, W8*>::Iterator iter(mapped_mem);
+    KeyValuePair<Waddr, W8*>* kvp;
+    while (kvp = iter.next()) {
+      if (inrange(kvp->key, start, end - 1)) pages.push(kvp->key);
+    }
+    foreach (i, pages.length) {
+      W8* data;
+      mapped_mem.remove(pages[i], data);
+      free_page_data(data);
+    }
+  }
 
-    int khz;
-    int n = sscanf(s, "%d", &khz);
+  int i = 0;
+  while (i < extents.length) {
+    Extent& ext = extents[i];
+    if ((ext.end <= start) || (ext.start >= end)) {
+      i++;
+      continue;
+    }
 
-    if (n == 1) {
-      hz = (W64)khz * 1000;
-      core_freq_hz = hz;
-      return hz;
+    Waddr lo = max(ext.start, start);
+    Waddr hi = min(ext.end, end);
+    free_extent_data(ext.base + (lo - ext.start), (hi - lo) / PAGE_SIZE);
+
+    if ((lo > ext.start) && (hi < ext.end)) {
+      Waddr oldend = ext.end;
+      W8* tail = ext.base + (hi - ext.start);
+      ext.end = lo;
+      // (ext is invalid from here on)
+      add_extent(hi, oldend, tail);
+      i += 2;
+    } else if (lo > ext.start) {
+      ext.end = lo;
+      i++;
+    } else if (hi < ext.end) {
+      ext.base += (hi - ext.start);
+      ext.start = hi;
+      i++;
+    } else {
+      foreach (j, extents.length - i - 1) extents[i + j] = extents[i + j + 1];
+      extents.pop();
     }
   }
 
-  istream is("/proc/cpuinfo");
+  update_pageattrs(pageid(start), pageid(end - 1), PAGE_ATTR_ZERO|PAGE_ATTR_DIRTY, 0);
+  tlb_flush(start, end - start);
+}
+
+//
+// Drop the translations made from the mapped pages in [start, end): page
+// by page for short ranges, otherwise by walking the code pages.
+//
+void AddressSpace::invalidate_translations(Waddr start, Waddr end) {
+  Waddr firstmfn = start >> 12;
+  Waddr endmfn = end >> 12;
+  dynarray<Waddr> mfns(1);
+
+  if ((endmfn - firstmfn) <= bbcache.pages.count) {
+    for (Waddr mfn = firstmfn; mfn < endmfn; mfn++) {
+      if (bbcache.pages.get(mfn)) mfns.push(mfn);
+    }
+  } else {
+    BasicBlockPageCache::Iterator iter(bbcache.pages);
+    BasicBlockChunkList* pagelist;
+    while (pagelist = iter.next()) {
+      if (inrange((Waddr)pagelist->mfn, firstmfn, endmfn - 1)) mfns.push(pagelist->mfn);
+    }
+  }
+
+  // Detached pages (see retire_guest_pages()) keep their translations:
+  foreach (i, mfns.length) {
+    if (lookup_page(mfns[i] << 12)) bbcache.invalidate_page(mfns[i], INVALIDATE_REASON_DMA);
+  }
+}
+
+AddressSpace::~AddressSpace() {
+  release();
+}
+
+//
+// Unmap everything and free all host memory, leaving the address space
+// as constructed. Releasing pages drops their translations, so this is
+// only done while the address space is the current one (asp).
+//
+void AddressSpace::release() {
+  // Never reset(), so nothing was mapped:
+  if (!attrmap) return;
+
+  discard_snapshot();
+  dynarray<Waddr> pages(1);
+  mapped_pages(pages);
+  foreach (i, pages.length) release_page(pages[i]);
+  // Drop the pool's own reference to its arena:
+  if (pool_next) free_page_data(pool_end - ARENA_SIZE);
+  pool_next = null;
+  pool_end = null;
+
+  reset();
+  ptl_mm_free_private_pages(attrmap, SPAT_TOPLEVEL_CHUNKS * sizeof(PageAttrChunk*));
+  sys_munmap(zero_page, PAGE_SIZE);
+  attrmap = null;
+  zero_page = null;
+}
+
+void AddressSpace::reset() {
+  discard_snapshot();
+
+  if (!attrmap) attrmap = (PageAttrChunk**)ptl_mm_alloc_private_pages(SPAT_TOPLEVEL_CHUNKS * sizeof(PageAttrChunk*));
+  // Read-only, so a host side store that misses store_page() faults:
+  if (!zero_page) zero_page = (W8*)sys_mmap(null, PAGE_SIZE, PROT_READ, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+
+  foreach (i, attr_chunks.length) {
+    ptl_mm_free_private_pages(attrmap[attr_chunks[i]], sizeof(PageAttrChunk));
+    attrmap[attr_chunks[i]] = null;
+  }
+  attr_chunks.clear();
+  restore_pages.clear();
+  restore_ranges.clear();
+
+  tlb_flush_all();
+}
+
+AddressSpace::TLBEntry& AddressSpace::tlb_fill(TLBEntry& e, Waddr page) {
+  byte attr = pageattr(page);
+  e.tag = page;
+  e.data = (attr & PAGE_ATTR_ZERO) ? zero_page : lookup_page(page);
+  e.prot = attr & PAGE_ATTR_PROT;
+  return e;
+}
+
+//
+// Give a demand-zero page its own (zero filled) host page
+//
+W8* AddressSpace::materialize(Waddr page) {
+  clear_pageattr(page >> 12, PAGE_ATTR_ZERO);
+  tlb_flush_page(page);
+  return lookup_page(page);
+}
+
+void AddressSpace::tlb_flush(Waddr start, Waddr length) {
+  Waddr pages = ceil(lowbits(start, 12) + length, PAGE_SIZE) >> 12;
+  if (pages >= TLB_SIZE) {
+    tlb_flush_all();
+    return;
+  }
+  foreach (i, pages) tlb_flush_page(start + (i * PAGE_SIZE));
+}
+
+void AddressSpace::tlb_flush_all() {
+  foreach (i, TLB_SIZE) tlb[i].tag = TLB_INVALID_TAG;
+}
+
+void AddressSpace::discard_snapshot() {
+  OpenHashtable<Waddr, SnapshotPage>::Iterator iter(snapshot_pages);
+  KeyValuePair<Waddr, SnapshotPage>* kvp;
+  while (kvp = iter.next()) delete[] kvp->value.data;
+
+  snapshot_pages.clear();
+  snapshot_zero_ranges.clear();
+}
+
+void AddressSpace::clear_restore_pages() {
+  foreach (i, restore_pages.length) pageattr_ref(restore_pages[i]) &= ~PAGE_ATTR_RESTORE;
+  restore_pages.clear();
+  restore_ranges.clear();
+}
+
+void AddressSpace::add_restore_range(Waddr start, Waddr end) {
+  int n = restore_ranges.length;
+  if (n && (restore_ranges[n-1].start <= end) && (start <= restore_ranges[n-1].end)) {
+    restore_ranges[n-1].start = min(restore_ranges[n-1].start, start);
+    restore_ranges[n-1].end = max(restore_ranges[n-1].end, end);
+    return;
+  }
+  RestoreRange& r = restore_ranges.push();
+  r.start = start;
+  r.end = end;
+}
+
+void AddressSpace::snapshot() {
+  discard_snapshot();
+
+  dynarray<Waddr> pages(1);
+  mapped_pages(pages);
+  sort(pages.data, pages.length, DefaultComparator<Waddr>());
+
+  foreach (i, pages.length) {
+    byte attr = pageattr(pages[i]);
+
+    if (attr & PAGE_ATTR_ZERO) {
+      int prot = attr & PAGE_ATTR_PROT;
+      int n = snapshot_zero_ranges.length;
+      if (n && (snapshot_zero_ranges[n-1].end == pages[i]) && (snapshot_zero_ranges[n-1].prot == prot)) {
+        snapshot_zero_ranges[n-1].end += PAGE_SIZE;
+      } else {
+        SnapshotZeroRange& zr = snapshot_zero_ranges.push();
+        zr.start = pages[i];
+        zr.end = pages[i] + PAGE_SIZE;
+        zr.prot = prot;
+      }
+      continue;
+    }
+
+    SnapshotPage sp;
+    sp.data = new W8[PAGE_SIZE];
+    sp.prot = getattr((void*)pages[i]);
+    memcpy(sp.data, lookup_page(pages[i]), PAGE_SIZE);
+    snapshot_pages.add(pages[i], sp);
+  }
+
+  // Everything written before now is part of the pristine image:
+  clear_restore_pages();
+}
+
+// Binary search of the snapshot's demand-zero ranges for addr:
+const AddressSpace::SnapshotZeroRange* AddressSpace::snapshot_zero_range(Waddr addr) const {
+  int lo = 0;
+  int hi = snapshot_zero_ranges.length - 1;
+  while (lo <= hi) {
+    int mid = (lo + hi) / 2;
+    const SnapshotZeroRange& zr = snapshot_zero_ranges.data[mid];
+    if (addr < zr.start) hi = mid - 1;
+    else if (addr >= zr.end) lo = mid + 1;
+    else return &zr;
+  }
+  return null;
+}
+
+//
+// Copy back one page from the snapshot, restoring its attributes and
+// dropping any translations made from modified contents.
+//
+bool AddressSpace::restore_page(Waddr addr) {
+  const W8* data;
+  int prot;
+
+  SnapshotPage* sp = snapshot_pages.get(addr);
+  if (sp) {
+    data = sp->data;
+    prot = sp->prot;
+  } else {
+    const SnapshotZeroRange* zr = snapshot_zero_range(addr);
+    // Mapped after the snapshot was taken:
+    if (!zr) return false;
+    data = zero_page;
+    prot = zr->prot;
+  }
+
+  W8* mapped = lookup_page(addr);
+  if (!mapped) {
+    mapped = alloc_pages(PAGE_SIZE);
+    mapped_mem.add(addr, mapped);
+    tlb_flush_page(addr);
+  }
+
+  // Demand-zero pages are zero filled on the host too:
+  bool changed = (getattr((void*)addr) != prot);
+  if (memcmp(mapped, data, PAGE_SIZE)) {
+    memcpy(mapped, data, PAGE_SIZE);
+    changed = true;
+  }
+
+  bool zero = (data == zero_page);
+  if (((pageattr(addr) & PAGE_ATTR_ZERO) != 0) != zero) {
+    if (zero) set_pageattr(addr >> 12, PAGE_ATTR_ZERO); else clear_pageattr(addr >> 12, PAGE_ATTR_ZERO);
+    tlb_flush_page(addr);
+  }
+
+  if (changed) {
+    setattr((void*)addr, PAGE_SIZE, prot);
+    bbcache.invalidate_page(addr >> 12, INVALIDATE_REASON_DMA);
+  } else {
+    cleardirty(addr >> 12);
+  }
+
+  return changed;
+}
+
+//
+// Map the demand-zero run [start, end) of the snapshot again where it was
+// written, unmapped or changed protection since. Returns the number of
+// pages mapped again.
+//
+int AddressSpace::restore_zero_range(Waddr start, Waddr end, int prot) {
+  int n = 0;
+  Waddr addr = start;
+
+  while (addr < end) {
+    byte attr = pageattr(addr);
+    if ((attr & PAGE_ATTR_ZERO) && ((attr & PAGE_ATTR_PROT) == prot)) {
+      addr += PAGE_SIZE;
+      continue;
+    }
+
+    Waddr runstart = addr;
+    do {
+      addr += PAGE_SIZE;
+      attr = pageattr(addr);
+    } while ((addr < end) && (!((attr & PAGE_ATTR_ZERO) && ((attr & PAGE_ATTR_PROT) == prot))));
+
+    map(runstart, addr - runstart, prot);
+    n += (addr - runstart) / PAGE_SIZE;
+  }
+
+  return n;
+}
+
+//
+// Restore the snapshot within the range [start, end), which was mapped or
+// unmapped since: the snapshot's pages in it are copied back and its
+// demand-zero runs mapped again, while the parts the snapshot does not
+// cover are added to new_ranges. Returns the number of pages restored.
+//
+int AddressSpace::restore_range(Waddr start, Waddr end, dynarray<RestoreRange>& new_ranges) {
+  int n = 0;
+
+  // The snapshot's pages in the range, in address order:
+  dynarray<Waddr> pages(1);
+  if (((end - start) / PAGE_SIZE) <= snapshot_pages.count) {
+    for (Waddr addr = start; addr < end; addr += PAGE_SIZE) {
+      if (snapshot_pages.get(addr)) pages.push(addr);
+    }
+  } else {
+    OpenHashtable<Waddr, SnapshotPage>::Iterator iter(snapshot_pages);
+    KeyValuePair<Waddr, SnapshotPage>* kvp;
+    while (kvp = iter.next()) {
+      if (inrange(kvp->key, start, end - 1)) pages.push(kvp->key);
+    }
+    sort(pages.data, pages.length, DefaultComparator<Waddr>());
+  }
+
+  foreach (i, pages.length) n += restore_page(pages[i]);
+
+  // First demand-zero run ending after start:
+  int z = 0;
+  int hi = snapshot_zero_ranges.length;
+  while (z < hi) {
+    int mid = (z + hi) / 2;
+    if (snapshot_zero_ranges[mid].end <= start) z = mid + 1; else hi = mid;
+  }
+
+  int p = 0;
+  Waddr addr = start;
+  while (addr < end) {
+    if ((p < pages.length) && (pages[p] == addr)) {
+      p++;
+      addr += PAGE_SIZE;
+      continue;
+    }
+
+    if ((z < snapshot_zero_ranges.length) && (snapshot_zero_ranges[z].start <= addr)) {
+      const SnapshotZeroRange& zr = snapshot_zero_ranges[z];
+      Waddr zend = min(zr.end, end);
+      n += restore_zero_range(addr, zend, zr.prot);
+      if (zend == zr.end) z++;
+      addr = zend;
+      continue;
+    }
+
+    Waddr gapend = end;
+    if (p < pages.length) gapend = min(gapend, pages[p]);
+    if (z < snapshot_zero_ranges.length) gapend = min(gapend, snapshot_zero_ranges[z].start);
+
+    int m = new_ranges.length;
+    if (m && (new_ranges[m-1].end == addr)) {
+      new_ranges[m-1].end = gapend;
+    } else {
+      RestoreRange& r = new_ranges.push();
+      r.start = addr;
+      r.end = gapend;
+    }
+    addr = gapend;
+  }
+
+  return n;
+}
+
+//
+// Restore all pages and ranges marked since the last snapshot or restore.
+// Returns the number of pages whose contents or attributes were restored;
+// the marked pages which are not part of the snapshot (i.e. mapped since)
+// are added to new_pages, and the parts of marked ranges not covered by
+// the snapshot to new_ranges.
+//
+int AddressSpace::restore(dynarray<Waddr>& new_pages, dynarray<RestoreRange>& new_ranges) {
+  int n = 0;
+
+  // Mapping demand-zero runs again marks more ranges, dropped below:
+  dynarray<RestoreRange> ranges(1);
+  ranges.swap(restore_ranges);
+  foreach (i, ranges.length) n += restore_range(ranges[i].start, ranges[i].end, new_ranges);
+  restore_ranges.clear();
+
+  while (restore_pages.length) {
+    Waddr page = restore_pages.pop();
+    pageattr_ref(page) &= ~PAGE_ATTR_RESTORE;
+#ifdef __x86_64__
+    Waddr addr = signext64(page << log2(PAGE_SIZE), ADDRESS_SPACE_BITS);
+#else
+    Waddr addr = page << log2(PAGE_SIZE);
+#endif
+    if (!in_snapshot(addr)) {
+      new_pages.push(addr);
+      continue;
+    }
+    n += restore_page(addr);
+  }
+
+  return n;
+}
+
+void AddressSpace::setattr(void* start, Waddr length, int prot) {
+  //
+  // Check first if it's been assigned a non-stdin (> 0) filehandle,
+  // since this may get called from ptlsim_preinit_entry before streams
+  // have been set up.
+  //
+  if (logfile.filehandle() > 0) {
+    logfile << "setattr: region ", start, " to ", (void*)((char*)start + length), " (", length >> 10, " KB) has user-visible attributes ",
+      ((prot & PROT_READ) ? 'r' : '-'), ((prot & PROT_WRITE) ? 'w' : '-'), ((prot & PROT_EXEC) ? 'x' : '-'), endl;
+  }
+
+  Waddr address = lowbits((Waddr)start, ADDRESS_SPACE_BITS);
+  assert(ceil((W64)address + length, PAGE_SIZE) <= ADDRESS_SPACE_SIZE);
+  if (length) update_pageattrs(pageid(address), pageid(address + length - 1), PAGE_ATTR_PROT, prot & PAGE_ATTR_PROT);
+
+  tlb_flush((Waddr)start, length);
+}
+
+// In userspace PTLsim, virtual == physical:
+// FIXME(AE): software virtual memory
+RIPVirtPhys& RIPVirtPhys::update(Context& ctx, int bytes) {
+  use64 = ctx.use64;
+  kernel = 0;
+  df = ((ctx.internal_eflags & FLAG_DF) != 0);
+  padlo = 0;
+  padhi = 0;
+  mfnlo = rip >> 12;
+  mfnhi = (rip + (bytes-1)) >> 12;
+  return *this;
+}
+
+// Saved and restored by asm code:
+FXSAVEStruct x87state;
+W16 saved_cs;
+W16 saved_ss;
+W16 saved_ds;
+W16 saved_es;
+W16 saved_fs;
+W16 saved_gs;
+
+// End state output format (-result):
+enum { RESULT_FORMAT_TEXT, RESULT_FORMAT_JSON, RESULT_FORMAT_BINARY };
+
+static int result_format = RESULT_FORMAT_TEXT;
+
+// Exceptions end the run instead of aborting (server, structured results, embedded):
+static bool stop_on_exception = false;
+
+void Context::propagate_x86_exception(byte exception, W32 errorcode, Waddr virtaddr) {
+  Waddr rip = commitarf[REG_selfrip];
+
+  logfile << "Exception ", exception, " (", x86_exception_names[exception], ") code=", errorcode, " addr=", (void*)virtaddr, " @ rip ", (void*)(Waddr)commitarf[REG_rip], " (", total_user_insns_committed, " commits, ", sim_cycle, " cycles)", endl, flush;
+  if (!config.quiet) cerr << "Exception ", exception, " (", x86_exception_names[exception], ") code=", errorcode, " addr=", (void*)virtaddr, " @ rip ", (void*)(Waddr)commitarf[REG_rip], " (", total_user_insns_committed, " commits, ", sim_cycle, " cycles)", endl, flush;
+
+  // PF
+  if (exception == 14) {
+    // PF Flags
+    W8 p    = errorcode & 0x00000001;
+    W8 wr   = errorcode & 0x00000002;
+    W8 us   = errorcode & 0x00000004;
+    W8 rsvd = errorcode & 0x00000008;
+    W8 id   = errorcode & 0x00000010;
+    W8 pk   = errorcode & 0x00000020;
+
+    logfile << "PageFault error code: 0x", hexstring(errorcode, 32), ", Flags: ", (pk ? "PK " : ""), (id ? "I " : "D "), (rsvd ? "RSVD " : ""), (us ? "U " : "S "), (wr ? "W " : "R "), (p ? "P" : ""), endl, flush;
+    if (!config.quiet) cerr << "PageFault error code: 0x", hexstring(errorcode, 32), ", Flags: ", (pk ? "PK " : ""), (id ? "I " : "D "), (rsvd ? "RSVD " : ""), (us ? "U " : "S "), (wr ? "W " : "R "), (p ? "P" : ""), endl, flush;
+  }
+
+  if (stop_on_exception) {
+    // Only stop this test case (or run, to report it): the core returns at the next exception or barrier check
+    sim->guest_exception = exception;
+    sim->guest_exception_code = errorcode;
+    sim->guest_exception_addr = virtaddr;
+    requested_switch_to_native = 1;
+    return;
+  }
+
+  if (config.dumpcode_filename.set()) {
+    byte insnbuf[1024];
+    PageFaultErrorCode insn_pfec;
+    Waddr insn_faultaddr;
+    int valid_byte_count = copy_from_user(insnbuf, rip, sizeof(insnbuf), insn_pfec, insn_faultaddr);
+
+    logfile << "Writing ", valid_byte_count, " bytes from rip ", (void*)rip, " to ", ((char*)config.dumpcode_filename), "...", endl, flush;
+    odstream("dumpcode.dat").write(insnbuf, sizeof(insnbuf));
+  }
+
+  logfile << "Aborting...", endl, flush;
+  cerr << "Aborting...", endl, flush;
+  assert(false);
+}
+
+#ifdef __x86_64__
+
+const char* syscall_names_64bit[] = {
+  "read", "write", "open", "close", "stat", "fstat", "lstat", "poll", "lseek", "mmap", "mprotect", "munmap", "brk", "rt_sigaction", "rt_sigprocmask", "rt_sigreturn", "ioctl", "pread64", "pwrite64", "readv", "writev", "access", "pipe", "select", "sched_yield", "mremap", "msync", "mincore", "madvise", "shmget", "shmat", "shmctl", "dup", "dup2", "pause", "nanosleep", "getitimer", "alarm", "setitimer", "getpid", "sendfile", "socket", "connect", "accept", "sendto", "recvfrom", "sendmsg", "recvmsg", "shutdown", "bind", "listen", "getsockname", "getpeername", "socketpair", "setsockopt", "getsockopt", "clone", "fork", "vfork", "execve", "exit", "wait4", "kill", "uname", "semget", "semop", "semctl", "shmdt", "msgget", "msgsnd", "msgrcv", "msgctl", "fcntl", "flock", "fsync", "fdatasync", "truncate", "ftruncate", "getdents", "getcwd", "chdir", "fchdir", "rename", "mkdir", "rmdir", "creat", "link", "unlink", "symlink", "readlink", "chmod", "fchmod", "chown", "fchown", "lchown", "umask", "gettimeofday", "getrlimit", "getrusage", "sysinfo", "times", "ptrace", "getuid", "syslog", "getgid", "setuid", "setgid", "geteuid", "getegid", "setpgid", "getppid", "getpgrp", "setsid", "setreuid", "setregid", "getgroups", "setgroups", "setresuid", "getresuid", "setresgid", "getresgid", "getpgid", "setfsuid", "setfsgid", "getsid", "capget", "capset", "rt_sigpending", "rt_sigtimedwait", "rt_sigqueueinfo", "rt_sigsuspend", "sigaltstack", "utime", "mknod", "uselib", "personality", "ustat", "statfs", "fstatfs", "sysfs", "getpriority", "setpriority", "sched_setparam", "sched_getparam", "sched_setscheduler", "sched_getscheduler", "sched_get_priority_max", "sched_get_priority_min", "sched_rr_get_interval", "mlock", "munlock", "mlockall", "munlockall", "vhangup", "modify_ldt", "pivot_root", "_sysctl", "prctl", "arch_prctl", "adjtimex", "setrlimit", "chroot", "sync", "acct", "settimeofday", "mount", "umount2", "swapon", "swapoff", "reboot", "sethostname", "setdomainname", "iopl", "ioperm", "create_module", "init_module", "delete_module", "get_kernel_syms", "query_module", "quotactl", "nfsservctl", "getpmsg", "putpmsg", "afs_syscall", "tuxcall", "security", "gettid", "readahead", "setxattr", "lsetxattr", "fsetxattr", "getxattr", "lgetxattr", "fgetxattr", "listxattr", "llistxattr", "flistxattr", "removexattr", "lremovexattr", "fremovexattr", "tkill", "time", "futex", "sched_setaffinity", "sched_getaffinity", "set_thread_area", "io_setup", "io_destroy", "io_getevents", "io_submit", "io_cancel", "get_thread_area", "lookup_dcookie", "epoll_create", "epoll_ctl_old", "epoll_wait_old", "remap_file_pages", "getdents64", "set_tid_address", "restart_syscall", "semtimedop", "fadvise64", "timer_create", "timer_settime", "timer_gettime", "timer_getoverrun", "timer_delete", "clock_settime", "clock_gettime", "clock_getres", "clock_nanosleep", "exit_group", "epoll_wait", "epoll_ctl", "tgkill", "utimes", "vserver", "vserver", "mbind", "set_mempolicy", "get_mempolicy", "mq_open", "mq_unlink", "mq_timedsend", "mq_timedreceive", "mq_notify", "mq_getsetattr", "kexec_load", "waitid"};
+
+//
+// SYSCALL instruction from x86-64 mode
+//
+
+void handle_syscall_64bit() {
+  bool DEBUG = 1; //analyze_in_detail();
+  //
+  // Handle an x86-64 syscall:
+  // (This is called from the assist_syscall ucode assist)
+  //
+
+  int syscallid = ctx.commitarf[REG_rax];
+  W64 arg1 = ctx.commitarf[REG_rdi];
+  W64 arg2 = ctx.commitarf[REG_rsi];
+  W64 arg3 = ctx.commitarf[REG_rdx];
+  W64 arg4 = ctx.commitarf[REG_r10];
+  W64 arg5 = ctx.commitarf[REG_r8];
+  W64 arg6 = ctx.commitarf[REG_r9];
+
+  if (DEBUG)
+    logfile << "handle_syscall -> (#", syscallid, " ", ((syscallid < lengthof(syscall_names_64bit)) ? syscall_names_64bit[syscallid] : "???"),
+      ") from ", (void*)ctx.commitarf[REG_rcx], " args ", " (", (void*)arg1, ", ", (void*)arg2, ", ", (void*)arg3, ", ", (void*)arg4, ", ",
+      (void*)arg5, ", ", (void*)arg6, ") at iteration ", iterations, endl, flush;
+
+  ctx.commitarf[REG_rax] = -ENOSYS;
+  ctx.commitarf[REG_rip] = ctx.commitarf[REG_rcx];
+
+  if (DEBUG) logfile << "handle_syscall: result ", ctx.commitarf[REG_rax], " (", (void*)ctx.commitarf[REG_rax], "); returning to ", (void*)ctx.commitarf[REG_rip], endl, flush;
+}
+
+#endif // __x86_64__
+
+void handle_syscall_32bit(int semantics) {
+  bool DEBUG = 1; //analyze_in_detail();
+  //
+  // Handle a 32-bit syscall:
+  // (This is called from the assist_syscall ucode assist)
+  //
+  if (semantics == SYSCALL_SEMANTICS_INT80) {
+    // Our exit operation.
+    requested_switch_to_native = 1;
+  } else {
+    // But don't clobber RAX when we want out guest to quit.
+    ctx.commitarf[REG_rax] = -ENOSYS;
+  }
+
+  ctx.commitarf[REG_rip] = ctx.commitarf[REG_nextrip];
+}
+
+//
+// Get the processor core frequency in cycles/second:
+//
+static W64 core_freq_hz = 0;
+
+W64 get_core_freq_hz() {
+  if likely (core_freq_hz) return core_freq_hz;
+
+  W64 hz = 0;
+
+  istream cpufreqis("/sys/devices/system/cpu/cpu0/cpufreq/cpuinfo_max_freq");
+  if (cpufreqis) {
+    char s[256];
+    cpufreqis >> readline(s, sizeof(s));
+
+    int khz;
+    int n = sscanf(s, "%d", &khz);
+
+    if (n == 1) {
+      hz = (W64)khz * 1000;
+      core_freq_hz = hz;
+      return hz;
+    }
+  }
+
+  istream is("/proc/cpuinfo");
+
+  if (!is) {
+    cerr << "get_core_freq_hz(): warning: cannot open /proc/cpuinfo. Is this a Linux machine?", endl;
+    core_freq_hz = hz;
+    return hz;
+  }
+
+  while (is) {
+    char s[256];
+    is >> readline(s, sizeof(s));
+
+    int mhz;
+    int n = sscanf(s, "cpu MHz : %d", &mhz);
+    if (n == 1) {
+      hz = (W64)mhz * 1000000;
+      core_freq_hz = hz;
+      return hz;
+    }
+  }
+
+  // Can't read either of these procfiles: abort
+  assert(false);
+  return 0;
+}
+
+//
+// Main simulation driver function
+//
+void switch_to_sim() {
+  static const bool DEBUG = 0;
+}
+
+//
+// Binary test case format, loaded with B<file>. All fields are little
+// endian; offsets are relative to the start of the file.
+//
+#define RASPSIM_CASE_MAGIC 0x4553414350534152ULL // "RASPCASE"
+#define RASPSIM_CASE_VERSION 1
+
+enum {
+  RASPSIM_CASE_NO_X87 = (1 << 0),
+  RASPSIM_CASE_NO_SSE = (1 << 1),
+};
+
+struct RaspsimCaseHeader {
+  W64 magic;
+  W32 version;
+  W32 flags;                 // RASPSIM_CASE_xxx
+  W64 regmask;               // bit n set: initialize register n (numbered as in arch_reg_names)
+  W64 regs[ARCHREG_COUNT];
+  W32 segment_count;
+  W32 dump_count;
+  W64 segment_offset;        // RaspsimCaseSegment[segment_count]
+  W64 dump_offset;           // W64[dump_count]: addresses of pages to dump
+} packedstruct;
+
+struct RaspsimCaseSegment {
+  W64 addr;                  // page aligned
+  W64 length;                // in bytes; the last page is zero filled
+  W32 prot;                  // PROT_READ, PROT_READ|PROT_WRITE or PROT_READ|PROT_EXEC
+  W32 reserved;
+  W64 offset;                // payload of <length> bytes, or 0 for zero filled memory
+} packedstruct;
+
+//
+// Test case pack, loaded with B<file> <index>: many binary test cases in
+// one file. Each case is stored as a whole, with offsets relative to its
+// own start, which should be page aligned so read-only pages can alias.
+//
+#define RASPSIM_PACK_MAGIC 0x4b43415050534152ULL // "RASPPACK"
+#define RASPSIM_PACK_VERSION 1
+
+struct RaspsimPackHeader {
+  W64 magic;
+  W32 version;
+  W32 count;                 // followed by RaspsimPackEntry[count]
+} packedstruct;
+
+struct RaspsimPackEntry {
+  W64 offset;
+  W64 size;
+} packedstruct;
+
+//
+// Whether <size> bytes at <offset> lie within a file of <filesize> bytes,
+// without overflowing on untrusted offsets (binary test cases and ELF files).
+//
+static inline bool range_in_file(W64 offset, W64 size, W64 filesize) {
+  return (offset <= filesize) && (size <= filesize - offset);
+}
+
+//
+// Load a binary test case, or case <index> of a pack (if >= 0). The file
+// is mapped privately; payloads are copied into guest pages, except that
+// whole pages of read-only segments with a page aligned payload directly
+// alias the file mapping.
+//
+static bool load_binary_case(const char* filename, W64s index, dynarray<Waddr>* dump_pages) {
+  istream is(filename);
+  if (!is) {
+    cerr << "Error: cannot open binary test case '", filename, "'", endl;
+    return true;
+  }
+
+  W64 filesize = is.size();
+  if (filesize < ((index >= 0) ? sizeof(RaspsimPackHeader) : sizeof(RaspsimCaseHeader))) {
+    cerr << "Error: binary test case '", filename, "' is truncated", endl;
+    return true;
+  }
+
+  W8* base = asp.map_file(is.filehandle(), filesize);
+  if (!base) {
+    cerr << "Error: cannot map binary test case '", filename, "'", endl;
+    return true;
+  }
+
+  bool err = false;
+  W8* image = base;
+
+  if (index >= 0) {
+    const RaspsimPackHeader& pack = *(const RaspsimPackHeader*)base;
+    const RaspsimPackEntry* entries = (const RaspsimPackEntry*)(base + sizeof(RaspsimPackHeader));
+
+    if ((pack.magic != RASPSIM_PACK_MAGIC) || (pack.version != RASPSIM_PACK_VERSION)) {
+      cerr << "Error: '", filename, "' is not a test case pack of version ", RASPSIM_PACK_VERSION, endl;
+      err = true;
+    } else if ((index >= pack.count) || (!range_in_file(sizeof(RaspsimPackHeader), (W64)pack.count * sizeof(RaspsimPackEntry), filesize)) ||
+               (entries[index].size < sizeof(RaspsimCaseHeader)) || (!range_in_file(entries[index].offset, entries[index].size, filesize))) {
+      cerr << "Error: test case pack '", filename, "' has no valid case ", index, endl;
+      err = true;
+    } else {
+      image = base + entries[index].offset;
+      filesize = entries[index].size;
+    }
+  }
+
+  const RaspsimCaseHeader& hdr = *(const RaspsimCaseHeader*)image;
+
+  if ((!err) && ((hdr.magic != RASPSIM_CASE_MAGIC) || (hdr.version != RASPSIM_CASE_VERSION))) {
+    cerr << "Error: '", filename, "' is not a binary test case of version ", RASPSIM_CASE_VERSION, endl;
+    err = true;
+  } else if ((!err) && ((!range_in_file(hdr.segment_offset, (W64)hdr.segment_count * sizeof(RaspsimCaseSegment), filesize)) ||
+             (!range_in_file(hdr.dump_offset, (W64)hdr.dump_count * sizeof(W64), filesize)))) {
+    cerr << "Error: binary test case '", filename, "' has invalid table offsets", endl;
+    err = true;
+  }
+
+  if (!err) {
+    const RaspsimCaseSegment* segs = (const RaspsimCaseSegment*)(image + hdr.segment_offset);
+    foreach (i, hdr.segment_count) {
+      const RaspsimCaseSegment& seg = segs[i];
+      int prot = seg.prot;
+      if (lowbits(seg.addr, 12) || (!seg.length) || (!range_in_file(seg.addr, seg.length, ADDRESS_SPACE_SIZE)) ||
+          ((prot != PROT_READ) && (prot != (PROT_READ|PROT_WRITE)) && (prot != (PROT_READ|PROT_EXEC))) ||
+          (seg.offset && (!range_in_file(seg.offset, seg.length, filesize)))) {
+        cerr << "Error: binary test case '", filename, "' has invalid segment ", i, " at ", (void*)(Waddr)seg.addr, endl;
+        err = true;
+        break;
+      }
+
+      Waddr aliased = 0;
+      if (seg.offset && (!(prot & PROT_WRITE)) && (!lowbits((Waddr)(image + seg.offset), 12))) {
+        aliased = floor(seg.length, PAGE_SIZE);
+        if (aliased) asp.alias(seg.addr, image + seg.offset, aliased, prot);
+      }
+
+      if (seg.length > aliased) asp.map(seg.addr + aliased, seg.length - aliased, prot);
+
+      if (seg.offset) {
+        for (Waddr done = aliased; done < seg.length; done += PAGE_SIZE) {
+          memcpy(asp.page_virt_to_mapped(seg.addr + done), image + seg.offset + done, min((W64)PAGE_SIZE, seg.length - done));
+        }
+      }
+    }
+  }
+
+  if (!err) {
+    foreach (i, ARCHREG_COUNT) {
+      if (bit(hdr.regmask, i)) ctx.commitarf[i] = hdr.regs[i];
+    }
+    if (hdr.flags & RASPSIM_CASE_NO_X87) ctx.no_x87 = 1;
+    if (hdr.flags & RASPSIM_CASE_NO_SSE) ctx.no_sse = 1;
+
+    const W64* dumps = (const W64*)(image + hdr.dump_offset);
+    foreach (i, hdr.dump_count) dump_pages->push(floor(dumps[i], PAGE_SIZE));
+  }
+
+  // Drop our own reference: the file stays mapped only if pages alias it
+  asp.free_page_data(base);
+  return err;
+}
+
+//
+// ELF loader, used with E<file> [<entry symbol>]. Executables are mapped
+// at their link addresses; relocatable objects are laid out from
+// ELF_REL_LOAD_BASE on.
+//
+#define ELF_REL_LOAD_BASE 0x400000
+
+static const char* elf_symbol_name(const W8* base, const Elf64_Shdr& strsh, const Elf64_Sym& sym) {
+  return (sym.st_name < strsh.sh_size) ? (const char*)(base + strsh.sh_offset + sym.st_name) : "?";
+}
+
+//
+// Find a defined symbol in the symbol table. For relocatable objects,
+// secaddr is the load address of each section.
+//
+static bool elf_find_symbol(const W8* base, const Elf64_Ehdr& ehdr, const Waddr* secaddr, const char* name, W64& value) {
+  const Elf64_Shdr* shdrs = (const Elf64_Shdr*)(base + ehdr.e_shoff);
+  foreach (i, ehdr.e_shnum) {
+    const Elf64_Shdr& sh = shdrs[i];
+    if (sh.sh_type != SHT_SYMTAB) continue;
+    const Elf64_Shdr& strsh = shdrs[sh.sh_link];
+    const Elf64_Sym* syms = (const Elf64_Sym*)(base + sh.sh_offset);
+    foreach (j, sh.sh_size / sizeof(Elf64_Sym)) {
+      const Elf64_Sym& sym = syms[j];
+      if ((sym.st_shndx == SHN_UNDEF) || strcmp(elf_symbol_name(base, strsh, sym), name)) continue;
+      value = sym.st_value;
+      if (secaddr && (sym.st_shndx < ehdr.e_shnum)) value += secaddr[sym.st_shndx];
+      return true;
+    }
+  }
+  return false;
+}
+
+//
+// Map the PT_LOAD segments of an executable. Whole pages of non-writable
+// segments alias the file mapping; a page shared by two adjacent segments
+// is copied and gets the union of their protections.
+//
+static bool load_elf_segments(W8* base, W64 filesize, const Elf64_Ehdr& ehdr, const char* filename) {
+  const Elf64_Phdr* phdrs = (const Elf64_Phdr*)(base + ehdr.e_phoff);
+  bool havelast = false;
+  Waddr lastpage = 0;
+
+  foreach (i, ehdr.e_phnum) {
+    const Elf64_Phdr& ph = phdrs[i];
+    if ((ph.p_type != PT_LOAD) || (!ph.p_memsz)) continue;
+
+    if ((ph.p_filesz > ph.p_memsz) || (!range_in_file(ph.p_offset, ph.p_filesz, filesize)) ||
+        (ph.p_memsz > ((W64)-1 - ph.p_vaddr))) {
+      cerr << "Error: ELF file '", filename, "' has invalid segment ", i, endl;
+      return true;
+    }
+
+    int prot = PROT_READ;
+    if (ph.p_flags & PF_W) prot |= PROT_WRITE;
+    if (ph.p_flags & PF_X) prot |= PROT_EXEC;
+
+    Waddr start = floor(ph.p_vaddr, PAGE_SIZE);
+    Waddr end = ceil(ph.p_vaddr + ph.p_memsz, PAGE_SIZE);
+    Waddr skew = lowbits(ph.p_vaddr, 12);
+    Waddr aliased = 0;
+    if ((!(prot & PROT_WRITE)) && (skew == lowbits(ph.p_offset, 12))) aliased = floor(skew + ph.p_filesz, PAGE_SIZE);
+
+    for (Waddr page = start; page != end; page += PAGE_SIZE) {
+      Waddr rel = page - start;
+      bool shared = (havelast && (page == lastpage));
+
+      if ((!shared) && (rel + PAGE_SIZE <= aliased)) {
+        asp.alias(page, base + ph.p_offset - skew + rel, PAGE_SIZE, prot);
+        continue;
+      }
+
+      W8* old = null;
+      int pageprot = prot;
+      if (shared) {
+        old = new W8[PAGE_SIZE];
+        memcpy(old, asp.page_virt_to_mapped_readonly(page), PAGE_SIZE);
+        pageprot |= asp.getattr((void*)page);
+      }
+
+      asp.map(page, PAGE_SIZE, pageprot);
+      W8* mapped = (W8*)asp.page_virt_to_mapped(page);
+      if (old) {
+        memcpy(mapped, old, PAGE_SIZE);
+        delete[] old;
+      }
+
+      Waddr lo = max(rel, skew);
+      Waddr hi = min(rel + PAGE_SIZE, skew + ph.p_filesz);
+      if (lo < hi) memcpy(mapped + (lo - rel), base + ph.p_offset + (lo - skew), hi - lo);
+    }
+
+    havelast = true;
+    lastpage = end - PAGE_SIZE;
+  }
+
+  return false;
+}
+
+//
+// Apply the RELA relocations in rsh to a copy of the section loaded at target.
+//
+static bool elf_relocate(const W8* base, const Elf64_Ehdr& ehdr, const Waddr* secaddr, const Elf64_Shdr& rsh,
+                         Waddr target, W8* data, W64 size, const char* filename) {
+  const Elf64_Shdr* shdrs = (const Elf64_Shdr*)(base + ehdr.e_shoff);
+  const Elf64_Shdr& symsh = shdrs[rsh.sh_link];
+  const Elf64_Shdr& strsh = shdrs[symsh.sh_link];
+  const Elf64_Sym* syms = (const Elf64_Sym*)(base + symsh.sh_offset);
+  const Elf64_Rela* relas = (const Elf64_Rela*)(base + rsh.sh_offset);
+  W64 symcount = symsh.sh_size / sizeof(Elf64_Sym);
+
+  foreach (i, rsh.sh_size / sizeof(Elf64_Rela)) {
+    const Elf64_Rela& r = relas[i];
+    int type = ELF64_R_TYPE(r.r_info);
+    if (type == R_X86_64_NONE) continue;
+
+    W64 symidx = ELF64_R_SYM(r.r_info);
+    if (symidx >= symcount) {
+      cerr << "Error: ELF file '", filename, "' has invalid relocation ", i, endl;
+      return true;
+    }
+
+    const Elf64_Sym& sym = syms[symidx];
+    if (sym.st_shndx == SHN_UNDEF) {
+      cerr << "Error: undefined symbol '", elf_symbol_name(base, strsh, sym), "' in '", filename, "'", endl;
+      return true;
+    }
+
+    W64 value = sym.st_value + r.r_addend;
+    if (sym.st_shndx < ehdr.e_shnum) value += secaddr[sym.st_shndx];
+    W64 place = target + r.r_offset;
+
+    int bytes = 4;
+    bool fits = true;
+    switch (type) {
+    case R_X86_64_64:
+      bytes = 8; break;
+    case R_X86_64_PC64:
+      value -= place; bytes = 8; break;
+    case R_X86_64_PC32:
+    case R_X86_64_PLT32:
+      value -= place; fits = (value == (W64)signext64(value, 32)); break;
+    case R_X86_64_32:
+      fits = (value == (W64)(W32)value); break;
+    case R_X86_64_32S:
+      fits = (value == (W64)signext64(value, 32)); break;
+    default:
+      cerr << "Error: unsupported relocation type ", type, " in '", filename, "'", endl;
+      return true;
+    }
+
+    if ((size < bytes) || (r.r_offset > size - bytes)) {
+      cerr << "Error: ELF file '", filename, "' has invalid relocation ", i, endl;
+      return true;
+    }
+
+    if (!fits) {
+      cerr << "Error: relocation against '", elf_symbol_name(base, strsh, sym), "' out of range in '", filename, "'", endl;
+      return true;
+    }
+
+    memcpy(data + r.r_offset, &value, bytes);
+  }
+
+  return false;
+}
+
+//
+// Lay out the allocated sections of a relocatable object, each on its own
+// pages, and apply the relocations. Sections are patched, so unlike
+// executable segments they are always copied.
+//
+static bool load_elf_object(const W8* base, const Elf64_Ehdr& ehdr, Waddr* secaddr, const char* filename) {
+  const Elf64_Shdr* shdrs = (const Elf64_Shdr*)(base + ehdr.e_shoff);
+
+  Waddr next = ELF_REL_LOAD_BASE;
+  foreach (i, ehdr.e_shnum) {
+    const Elf64_Shdr& sh = shdrs[i];
+    if ((!(sh.sh_flags & SHF_ALLOC)) || (!sh.sh_size)) continue;
+    secaddr[i] = next;
+    next = ceil(next + sh.sh_size, PAGE_SIZE);
+  }
+
+  foreach (i, ehdr.e_shnum) {
+    const Elf64_Shdr& sh = shdrs[i];
+    if (!secaddr[i]) continue;
+
+    int prot = PROT_READ;
+    if (sh.sh_flags & SHF_WRITE) prot |= PROT_WRITE;
+    if (sh.sh_flags & SHF_EXECINSTR) prot |= PROT_EXEC;
+    asp.map(secaddr[i], sh.sh_size, prot);
+    if (sh.sh_type == SHT_NOBITS) continue;
+
+    W8* data = new W8[sh.sh_size];
+    memcpy(data, base + sh.sh_offset, sh.sh_size);
+
+    bool err = false;
+    foreach (j, ehdr.e_shnum) {
+      const Elf64_Shdr& rsh = shdrs[j];
+      if (rsh.sh_info != i) continue;
+      if (rsh.sh_type == SHT_REL) {
+        cerr << "Error: REL relocations are not supported in '", filename, "'", endl;
+        err = true;
+      } else if (rsh.sh_type == SHT_RELA) {
+        err = elf_relocate(base, ehdr, secaddr, rsh, secaddr[i], data, sh.sh_size, filename);
+      }
+      if (err) break;
+    }
+
+    for (Waddr done = 0; (!err) && (done < sh.sh_size); done += PAGE_SIZE) {
+      W8* mapped = (W8*)asp.page_virt_to_mapped(secaddr[i] + done);
+      assert(mapped);
+      memcpy(mapped, data + done, min((W64)PAGE_SIZE, sh.sh_size - done));
+    }
+
+    delete[] data;
+    if (err) return true;
+  }
+
+  return false;
+}
+
+static bool load_elf(const char* filename, const char* entry) {
+  istream is(filename);
+  if (!is) {
+    cerr << "Error: cannot open ELF file '", filename, "'", endl;
+    return true;
+  }
+
+  W64 filesize = is.size();
+  if (filesize < sizeof(Elf64_Ehdr)) {
+    cerr << "Error: ELF file '", filename, "' is truncated", endl;
+    return true;
+  }
+
+  W8* base = asp.map_file(is.filehandle(), filesize);
+  if (!base) {
+    cerr << "Error: cannot map ELF file '", filename, "'", endl;
+    return true;
+  }
+
+  bool err = false;
+  const Elf64_Ehdr& ehdr = *(const Elf64_Ehdr*)base;
+  const Elf64_Shdr* shdrs = (const Elf64_Shdr*)(base + ehdr.e_shoff);
+
+  if (memcmp(ehdr.e_ident, ELFMAG, SELFMAG) || (ehdr.e_ident[EI_CLASS] != ELFCLASS64) ||
+      (ehdr.e_ident[EI_DATA] != ELFDATA2LSB) || (ehdr.e_machine != EM_X86_64) ||
+      ((ehdr.e_type != ET_EXEC) && (ehdr.e_type != ET_DYN) && (ehdr.e_type != ET_REL))) {
+    cerr << "Error: '", filename, "' is not an x86-64 ELF executable or object", endl;
+    err = true;
+  } else if ((ehdr.e_phnum && (ehdr.e_phentsize != sizeof(Elf64_Phdr))) ||
+             (ehdr.e_shnum && (ehdr.e_shentsize != sizeof(Elf64_Shdr))) ||
+             (!range_in_file(ehdr.e_phoff, (W64)ehdr.e_phnum * sizeof(Elf64_Phdr), filesize)) ||
+             (!range_in_file(ehdr.e_shoff, (W64)ehdr.e_shnum * sizeof(Elf64_Shdr), filesize))) {
+    cerr << "Error: ELF file '", filename, "' has invalid header tables", endl;
+    err = true;
+  }
+
+  // Validate the sections once, so the helpers above can trust them:
+  foreach (i, (err) ? 0 : ehdr.e_shnum) {
+    const Elf64_Shdr& sh = shdrs[i];
+    bool ok = (sh.sh_type == SHT_NOBITS) || range_in_file(sh.sh_offset, sh.sh_size, filesize);
+    if (ok && (sh.sh_type == SHT_STRTAB) && sh.sh_size) ok = (base[sh.sh_offset + sh.sh_size - 1] == 0);
+    if (ok && (sh.sh_type == SHT_SYMTAB)) ok = (sh.sh_link < ehdr.e_shnum) && (shdrs[sh.sh_link].sh_type == SHT_STRTAB);
+    if (ok && (sh.sh_type == SHT_RELA)) ok = (sh.sh_link < ehdr.e_shnum) && (shdrs[sh.sh_link].sh_type == SHT_SYMTAB);
+    if (!ok) {
+      cerr << "Error: ELF file '", filename, "' has invalid section ", i, endl;
+      err = true;
+      break;
+    }
+  }
+
+  Waddr* secaddr = null;
+  if ((!err) && (ehdr.e_type == ET_REL)) {
+    secaddr = new Waddr[ehdr.e_shnum + 1]();
+    err = load_elf_object(base, ehdr, secaddr, filename);
+    if ((!err) && (!entry)) entry = "_start";
+  } else if (!err) {
+    err = load_elf_segments(base, filesize, ehdr, filename);
+  }
+
+  if (!err) {
+    W64 rip = ehdr.e_entry;
+    if (entry && (!elf_find_symbol(base, ehdr, secaddr, entry, rip))) {
+      cerr << "Error: entry symbol '", entry, "' not found in '", filename, "'", endl;
+      err = true;
+    }
+    ctx.commitarf[REG_rip] = rip;
+  }
+
+  if (secaddr) delete[] secaddr;
+
+  // Drop our own reference: the file stays mapped only if pages alias it
+  asp.free_page_data(base);
+  return err;
+}
+
+bool handle_config_arg(char* line, dynarray<Waddr>* dump_pages) {
+  if (*line == '\0') return false;
+  dynarray<char*> toks;
+  toks.tokenize(line, " ");
+  if (toks.empty())
+    return false;
+
+  if (toks[0][0] == '#') {
+    return false;
+  }
+
+  if (toks[0][0] == 'M') { // allocate page M<addr> <prot>
+    if (toks.size() != 2) {
+      cerr << "Error: option ", line, " has wrong number of arguments", endl;
+      return true;
+    }
+    char* endp;
+    W64 addr = strtoull(toks[0] + 1, &endp, 16);
+    if (*endp != '\0' || lowbits(addr, 12)) {
+      cerr << "Error: invalid value ", toks[0], " ", endp, endl;
+      return true;
+    }
+    int prot = 0;
+    if (!strcmp(toks[1], "ro")) prot = PROT_READ;
+    else if (!strcmp(toks[1], "rw")) prot = PROT_READ | PROT_WRITE;
+    else if (!strcmp(toks[1], "rx")) prot = PROT_READ | PROT_EXEC;
+    else {
+      cerr << "Error: invalid mem prot ", toks[1], endl;
+      return true;
+    }
+    asp.map(addr, 0x1000, prot);
+  } else if (toks[0][0] == 'W') { // write to mem W<addr> <hexbytes>, may not cross page boundaries
+    if (toks.size() != 2) {
+      cerr << "Error: option ", line, " has wrong number of arguments", endl;
+      return true;
+    }
+    char* endp;
+    W64 addr = strtoull(toks[0] + 1, &endp, 16);
+    if (*endp != '\0') {
+      cerr << "Error: invalid value ", toks[0], endl;
+      return true;
+    }
+    W8* mapped = (W8*)asp.page_virt_to_mapped(addr);
+    if (!mapped) {
+      cerr << "Error: page not mapped ", (void*) addr, endl;
+      return true;
+    }
+    Waddr arglen = strlen(toks[1]);
+    if ((arglen & 1) || arglen/2 > 4096-lowbits(addr, 12)) {
+      cerr << "Error: arg has odd size or crosses page boundary", (void*) addr, endl;
+      return true;
+    }
+    unsigned n = min((Waddr)(4096 - lowbits(addr, 12)), arglen/2);
+    bool changed = false;
+    foreach (i, n) {
+      char hex_byte[3] = {toks[1][i*2],toks[1][i*2+1], 0};
+      W8 b = strtoul(hex_byte, NULL, 16);
+      changed |= (mapped[i] != b);
+      mapped[i] = b;
+    }
+    // In server mode, the page may still have translations from earlier cases:
+    if (changed) {
+      bbcache.invalidate_page(addr >> 12, INVALIDATE_REASON_DMA);
+      asp.setrestore(addr >> 12);
+    }
+  } else if (toks[0][0] == 'B') { // load binary test case B<file> [<index in pack>]
+    if ((toks.size() != 1) && (toks.size() != 2)) {
+      cerr << "Error: option ", line, " has wrong number of arguments", endl;
+      return true;
+    }
+    W64s index = -1;
+    if (toks.size() == 2) {
+      char* endp;
+      index = strtoull(toks[1], &endp, 0);
+      if ((*endp != '\0') || (index < 0)) {
+        cerr << "Error: invalid value ", toks[1], endl;
+        return true;
+      }
+    }
+    return load_binary_case(toks[0] + 1, index, dump_pages);
+  } else if (toks[0][0] == 'E') { // load ELF file E<file> [<entry symbol>]
+    if ((toks.size() != 1) && (toks.size() != 2)) {
+      cerr << "Error: option ", line, " has wrong number of arguments", endl;
+      return true;
+    }
+    return load_elf(toks[0] + 1, (toks.size() == 2) ? toks[1] : null);
+  } else if (toks[0][0] == 'S') { // map stack S<addr> <size>, rsp points to its top
+    if (toks.size() != 2) {
+      cerr << "Error: option ", line, " has wrong number of arguments", endl;
+      return true;
+    }
+    char* endp;
+    W64 addr = strtoull(toks[0] + 1, &endp, 16);
+    if (*endp != '\0' || lowbits(addr, 12)) {
+      cerr << "Error: invalid value ", toks[0], endl;
+      return true;
+    }
+    W64 size = strtoull(toks[1], &endp, 16);
+    if (*endp != '\0' || (!size) || lowbits(size, 12)) {
+      cerr << "Error: invalid value ", toks[1], endl;
+      return true;
+    }
+    asp.map(addr, size, PROT_READ | PROT_WRITE);
+    ctx.commitarf[REG_rsp] = addr + size;
+  } else if (toks[0][0] == 'D') { // dump page D<page>
+    if (toks.size() != 1) {
+      cerr << "Error: option ", line, " has wrong number of arguments", endl;
+      return true;
+    }
+    char* endp;
+    W64 addr = strtoull(toks[0] + 1, &endp, 16);
+    if (*endp != '\0') {
+      cerr << "Error: invalid value ", toks[0], endl;
+      return true;
+    }
+    dump_pages->push(floor(addr, PAGE_SIZE));
+  } else if (!strcmp(toks[0], "Fnox87")) {
+    ctx.no_x87 = 1;
+  } else if (!strcmp(toks[0], "Fnosse")) {
+    ctx.no_sse = 1;
+  } else {
+    if (toks.size() != 2) {
+      cerr << "Error: option ", line, " has wrong number of arguments", endl;
+      return true;
+    }
+    int reg = -1;
+    foreach (j, sizeof(arch_reg_names) / sizeof(arch_reg_names[0])) {
+      if (!strcmp(toks[0], arch_reg_names[j])) {
+        reg = j; break;
+      }
+    }
+    if (reg < 0) {
+      cerr << "Error: invalid register ", toks[0], endl;
+      return true;
+    }
+    char* endp;
+    W64 v = strtoull(toks[1], &endp, 0);
+    if (*endp != '\0') {
+      cerr << "Error: invalid value ", toks[1], endl;
+      return true;
+    }
+    ctx.commitarf[reg] = v;
+  }
+
+  return false;
+}
+
+//
+// Read a command list (as in @file) until the end of the stream
+//
+static bool handle_config_file(istream& is, dynarray<Waddr>* dump_pages) {
+  stringbuf line;
+  bool parse_err = false;
+
+  for (;;) {
+    line.reset();
+    is >> line;
+    if (!is) break;
+
+    char* p = strchr(line, '#');
+    if (p) *p = 0;
+    parse_err |= handle_config_arg(line, dump_pages);
+  }
+
+  return parse_err;
+}
+
+//
+// Set up the initial context for a test case
+//
+static void init_guest_context() {
+  setzero(ctx);
+  ctx.reset();
+  ctx.use32 = 1;
+  ctx.use64 = 1;
+  ctx.commitarf[REG_rsp] = 0;
+  ctx.commitarf[REG_rip] = 0x100000;
+  ctx.commitarf[REG_flags] = 0;
+  ctx.internal_eflags = 0;
+
+  ctx.seg[SEGID_CS].selector = 0x33;
+  ctx.seg[SEGID_SS].selector = 0x2b;
+  ctx.seg[SEGID_DS].selector = 0x00;
+  ctx.seg[SEGID_ES].selector = 0x00;
+  ctx.seg[SEGID_FS].selector = 0x00;
+  ctx.seg[SEGID_GS].selector = 0x00;
+  ctx.update_shadow_segment_descriptors();
+
+
+  // ctx.fxrstor(x87state);
+
+  ctx.vcpuid = 0;
+  ctx.running = 1;
+  ctx.commitarf[REG_ctx] = (Waddr)&ctx;
+  ctx.commitarf[REG_fpstack] = (Waddr)&ctx.fpstack;
+}
+
+static void print_end_state(ostream& os, const dynarray<Waddr>& dump_pages) {
+  os << "End state:", endl;
+  os << ctx, endl;
+  foreach (i, dump_pages.length) {
+    Waddr addr = dump_pages[i];
+    const byte* mapped = (const byte*)asp.page_virt_to_mapped_readonly(addr);
+    if (!mapped) {
+      os << "Error dumping memory: page not mapped ", (void*) addr, endl;
+    } else {
+      os << "Dump of memory at ", (void*) addr, ": ", endl;
+      os << bytestring(mapped, PAGE_SIZE), endl;
+    }
+  }
+  os << "Decoder stats:";
+  foreach(i, DECODE_TYPE_COUNT) {
+    os << " ", decode_type_names[i], "=", stats.decoder.x86_decode_type[i];
+  }
+  os << endl;
+  os << flush;
+}
+
+//
+// Structured end state (-result json or binary), written to stdout once
+// per run or test case instead of the text dump, so a harness does not
+// have to parse it back.
+//
+static bool parse_result_format(const char* name) {
+  if (!strcmp(name, "text")) result_format = RESULT_FORMAT_TEXT;
+  else if (!strcmp(name, "json")) result_format = RESULT_FORMAT_JSON;
+  else if (!strcmp(name, "binary")) result_format = RESULT_FORMAT_BINARY;
+  else {
+    cerr << "Error: unknown result format '", name, "' (valid: text, json, binary)", endl, flush;
+    return true;
+  }
+  return false;
+}
+
+//
+// Binary result record: the header, then dump_count RaspsimResultPage
+// entries, each followed by the PAGE_SIZE bytes of the page. All fields
+// are little endian.
+//
+#define RASPSIM_RESULT_MAGIC 0x544c535250534152ULL // "RASPRSLT"
+#define RASPSIM_RESULT_VERSION 1
+
+enum {
+  RASPSIM_RESULT_EXIT,
+  RASPSIM_RESULT_EXCEPTION,
+  RASPSIM_RESULT_ERROR,
+};
+
+struct RaspsimResultHeader {
+  W64 magic;
+  W32 version;
+  W32 result;                // RASPSIM_RESULT_xxx
+  W64 casenum;
+  W64 size;                  // of the whole record, including the pages
+  W32 exception;             // vector, for RASPSIM_RESULT_EXCEPTION
+  W32 exception_code;
+  W64 exception_addr;
+  W64 cycles;
+  W64 insns;
+  W64 regs[ARCHREG_COUNT];   // commitarf, numbered as in arch_reg_names
+  W64 decode_types[DECODE_TYPE_COUNT];
+  W32 dump_count;
+  W32 reserved;
+} packedstruct;
+
+struct RaspsimResultPage {
+  W64 addr;
+  W32 mapped;                // 0: page not mapped, contents are zero
+  W32 reserved;
+} packedstruct;
+
+static int run_result(bool parse_err) {
+  if (parse_err) return RASPSIM_RESULT_ERROR;
+  return (sim->guest_exception >= 0) ? RASPSIM_RESULT_EXCEPTION : RASPSIM_RESULT_EXIT;
+}
+
+static void write_binary_result(ostream& os, W64 casenum, int result, const dynarray<Waddr>& dump_pages) {
+  RaspsimResultHeader hdr;
+  setzero(hdr);
+  hdr.magic = RASPSIM_RESULT_MAGIC;
+  hdr.version = RASPSIM_RESULT_VERSION;
+  hdr.result = result;
+  hdr.casenum = casenum;
+  hdr.size = sizeof(RaspsimResultHeader) + dump_pages.length * (sizeof(RaspsimResultPage) + PAGE_SIZE);
+  if (result == RASPSIM_RESULT_EXCEPTION) {
+    hdr.exception = sim->guest_exception;
+    hdr.exception_code = sim->guest_exception_code;
+    hdr.exception_addr = sim->guest_exception_addr;
+  }
+  hdr.cycles = sim_cycle;
+  hdr.insns = total_user_insns_committed;
+  foreach (i, ARCHREG_COUNT) hdr.regs[i] = ctx.commitarf[i];
+  foreach (i, DECODE_TYPE_COUNT) hdr.decode_types[i] = stats.decoder.x86_decode_type[i];
+  hdr.dump_count = dump_pages.length;
+  os.write(&hdr, sizeof(hdr));
+
+  foreach (i, dump_pages.length) {
+    const W8* mapped = (const W8*)asp.page_virt_to_mapped_readonly(dump_pages[i]);
+    RaspsimResultPage page;
+    page.addr = dump_pages[i];
+    page.mapped = (mapped != null);
+    page.reserved = 0;
+    os.write(&page, sizeof(page));
+    os.write((mapped) ? mapped : asp.zero_page, PAGE_SIZE);
+  }
+}
+
+static void write_json_hex(ostream& os, const W8* data, int bytes) {
+  static const char digits[] = "0123456789abcdef";
+  char buf[2 * PAGE_SIZE];
+  assert(bytes <= PAGE_SIZE);
+  foreach (i, bytes) {
+    buf[2*i + 0] = digits[data[i] >> 4];
+    buf[2*i + 1] = digits[data[i] & 0xf];
+  }
+  os.write(buf, 2 * bytes);
+}
+
+//
+// One JSON object per line. 64-bit values are hex strings, since JSON
+// numbers are doubles in most parsers.
+//
+static void write_json_result(ostream& os, W64 casenum, int result, const dynarray<Waddr>& dump_pages) {
+  static const char* result_names[] = {"exit", "exception", "error"};
+
+  os << "{\"case\":", casenum, ",\"result\":\"", result_names[result], "\"";
+  if (result == RASPSIM_RESULT_EXCEPTION) {
+    os << ",\"exception\":{\"vector\":", sim->guest_exception, ",\"name\":\"", x86_exception_names[sim->guest_exception],
+      "\",\"code\":\"0x", hexstring(sim->guest_exception_code, 32), "\",\"addr\":\"0x", hexstring(sim->guest_exception_addr, 64), "\"}";
+  }
+  os << ",\"cycles\":", sim_cycle, ",\"instructions\":", total_user_insns_committed;
+
+  os << ",\"regs\":{";
+  foreach (i, ARCHREG_COUNT) {
+    os << ((i) ? "," : ""), "\"", arch_reg_names[i], "\":\"0x", hexstring(ctx.commitarf[i], 64), "\"";
+  }
+  os << "},\"decoder\":{";
+  foreach (i, DECODE_TYPE_COUNT) {
+    os << ((i) ? "," : ""), "\"", decode_type_names[i], "\":", stats.decoder.x86_decode_type[i];
+  }
+  os << "},\"dumps\":[";
+  foreach (i, dump_pages.length) {
+    const W8* mapped = (const W8*)asp.page_virt_to_mapped_readonly(dump_pages[i]);
+    os << ((i) ? "," : ""), "{\"addr\":\"0x", hexstring(dump_pages[i], 64), "\",\"data\":";
+    if (mapped) {
+      os << "\"";
+      write_json_hex(os, mapped, PAGE_SIZE);
+      os << "\"}";
+    } else {
+      os << "null}";
+    }
+  }
+  os << "]}", endl;
+}
+
+static void write_result(ostream& os, W64 casenum, int result, const dynarray<Waddr>& dump_pages) {
+  if (result_format == RESULT_FORMAT_BINARY) {
+    write_binary_result(os, casenum, result, dump_pages);
+  } else {
+    write_json_result(os, casenum, result, dump_pages);
+  }
+}
+
+//
+// Result cache (-resultcache <dir>): simulation is deterministic, so a
+// case whose inputs were seen before gets the stored end state instead
+// of being simulated again. The key hashes the model (model_build_hash,
+// which changes with every rebuilt simulator object), the options which
+// affect timing, the initial registers, the dumped page addresses and
+// every mapped page with its protection. Each entry is a file named by
+// the key in hex: a ResultCacheHeader, the end context and a
+// RaspsimResultPage for each dump, followed by the page if mapped.
+//
+#define RESULT_CACHE_MAGIC 0x4548434350534152ULL // "RASPCCHE"
+#define RESULT_CACHE_VERSION 1
+
+struct ResultCacheKey {
+  W64 lo;
+  W64 hi;
+};
+
+struct ResultCacheHeader {
+  W64 magic;
+  W32 version;
+  W32 context_size;          // sizeof(Context)
+  ResultCacheKey key;
+  W32 exception;             // vector, or 0xffffffff after int 0x80
+  W32 exception_code;
+  W64 exception_addr;
+  W64 cycles;
+  W64 insns;
+  W64 decode_types[DECODE_TYPE_COUNT];
+  W32 dump_count;
+  W32 reserved;
+} packedstruct;
+
+//
+// Two independent 64-bit multiply-rotate lanes, mixed at the end
+//
+struct ResultCacheHasher {
+  W64 a;
+  W64 b;
+  W64 words;
+
+  ResultCacheHasher(): a(0x9e3779b97f4a7c15ULL), b(0xc2b2ae3d27d4eb4fULL), words(0) { }
+
+  void add(W64 v) {
+    a = x86_rol<W64>((a ^ v) * 0x87c37b91114253d5ULL, 31) * 5 + 0x52dce729;
+    b = x86_rol<W64>((b + v) * 0x4cf5ad432745937fULL, 27) ^ (a >> 17);
+    words++;
+  }
+
+  void add(const void* data, W64 bytes) {
+    const W64* p = (const W64*)data;
+    foreach (i, bytes / 8) add(p[i]);
+    W64 tail = 0;
+    memcpy(&tail, p + (bytes / 8), lowbits(bytes, 3));
+    add(tail ^ bytes);
+  }
+
+  void add(const char* s) { add(s, strlen(s)); }
+
+  static W64 mix(W64 x) {
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return x;
+  }
+
+  ResultCacheKey finish() const {
+    ResultCacheKey key;
+    key.lo = mix(a ^ words);
+    key.hi = mix(b + key.lo);
+    return key;
+  }
+};
+
+static void result_cache_key(ResultCacheKey& key, const dynarray<Waddr>& dump_pages) {
+  ResultCacheHasher h;
+
+  h.add(model_build_hash);
+  h.add(sizeof(Context));
+  h.add(config.core_name);
+  h.add(config.stop_at_user_insns);
+  h.add(config.stop_at_cycle);
+  h.add(config.stop_at_iteration);
+  h.add(config.stop_at_rip);
+  h.add(config.stop_at_marker);
+  h.add(config.stop_at_marker_hits);
+  h.add(config.insns_in_last_basic_block);
+  h.add(config.stop_at_user_insns_relative);
+  h.add(config.flush_interval);
+  h.add(config.perfect_cache);
+  h.add(config.sequential_mode_insns);
+  h.add(config.sequential_mode_rip);
+  h.add(config.sequential_mode_marker);
+  h.add(config.warmup_insns);
+  h.add(config.sample_period);
+  h.add(config.sample_size);
+  h.add(config.sample_warmup);
+  h.add(config.sample_random);
+  h.add(config.sample_error);
+  h.add(stop_on_exception);
+
+  h.add(ctx.commitarf, sizeof(ctx.commitarf));
+  h.add(ctx.no_x87);
+  h.add(ctx.no_sse);
+
+  foreach (i, dump_pages.length) h.add(dump_pages[i]);
+  h.add(dump_pages.length);
+
+  dynarray<Waddr> pages;
+  asp.mapped_pages(pages);
+  sort(pages.data, pages.length, DefaultComparator<Waddr>());
+
+  foreach (i, pages.length) {
+    Waddr addr = pages[i];
+    // Demand-zero pages are read through the zero page, without materializing them:
+    const AddressSpace::TLBEntry& e = asp.translate(addr);
+    h.add(addr | e.prot);
+    if (e.data == asp.zero_page) {
+      h.add((W64)0);
+    } else {
+      h.add(e.data, PAGE_SIZE);
+    }
+  }
+
+  key = h.finish();
+}
+
+static void result_cache_filename(stringbuf& sb, const ResultCacheKey& key) {
+  sb << config.result_cache, "/", hexstring(key.hi, 64), hexstring(key.lo, 64);
+}
+
+//
+// Apply a stored end state for this key, if there is one
+//
+static bool result_cache_load(const ResultCacheKey& key, const dynarray<Waddr>& dump_pages) {
+  stringbuf filename;
+  result_cache_filename(filename, key);
+
+  istream is(filename);
+  if (!is) return false;
+
+  ResultCacheHeader hdr;
+  if ((is.read(&hdr, sizeof(hdr)) != sizeof(hdr)) || (hdr.magic != RESULT_CACHE_MAGIC) || (hdr.version != RESULT_CACHE_VERSION) ||
+      (hdr.context_size != sizeof(Context)) || (hdr.key.lo != key.lo) || (hdr.key.hi != key.hi) || (hdr.dump_count != dump_pages.length)) {
+    logfile << "Warning: ignoring invalid result cache entry ", filename, endl;
+    return false;
+  }
+
+  Context* endctx = new Context();
+  bool ok = (is.read(endctx, sizeof(Context)) == sizeof(Context));
+
+  W8* pages = new W8[dump_pages.length * PAGE_SIZE];
+  foreach (i, dump_pages.length) {
+    if (!ok) break;
+    RaspsimResultPage page;
+    ok = (is.read(&page, sizeof(page)) == sizeof(page)) && (page.addr == dump_pages[i]) &&
+      ((!page.mapped) || (is.read(pages + i * PAGE_SIZE, PAGE_SIZE) == PAGE_SIZE));
+    // The guest cannot map or unmap pages, so only the contents can differ:
+    ok &= (page.mapped == (asp.lookup_page(dump_pages[i]) != null));
+  }
+
+  if (ok) {
+    ctx = *endctx;
+    sim->guest_exception = (W32s)hdr.exception;
+    sim->guest_exception_code = hdr.exception_code;
+    sim->guest_exception_addr = hdr.exception_addr;
+    sim_cycle = hdr.cycles;
+    total_user_insns_committed = hdr.insns;
+    foreach (i, DECODE_TYPE_COUNT) stats.decoder.x86_decode_type[i] = hdr.decode_types[i];
+
+    foreach (i, dump_pages.length) {
+      Waddr addr = dump_pages[i];
+      if (!asp.lookup_page(addr)) continue;
+      const W8* data = pages + i * PAGE_SIZE;
+      if (!memcmp(asp.translate(addr).data, data, PAGE_SIZE)) continue;
+      memcpy(asp.store_page(addr), data, PAGE_SIZE);
+      bbcache.invalidate_page(addr >> 12, INVALIDATE_REASON_DMA);
+      asp.setrestore(addr >> 12);
+    }
+  } else {
+    logfile << "Warning: ignoring truncated result cache entry ", filename, endl;
+  }
+
+  delete[] pages;
+  delete endctx;
+  return ok;
+}
+
+//
+// Store the end state of the case just simulated. The entry is written
+// under a temporary name and renamed, so concurrent readers (e.g. batch
+// workers) never see it half written.
+//
+static void result_cache_store(const ResultCacheKey& key, const dynarray<Waddr>& dump_pages) {
+  stringbuf filename;
+  result_cache_filename(filename, key);
+  stringbuf tempname;
+  tempname << filename, ".", sys_getpid();
+
+  ostream os;
+  if (!os.open(tempname)) {
+    logfile << "Warning: cannot write result cache entry ", tempname, endl;
+    return;
+  }
+
+  ResultCacheHeader hdr;
+  setzero(hdr);
+  hdr.magic = RESULT_CACHE_MAGIC;
+  hdr.version = RESULT_CACHE_VERSION;
+  hdr.context_size = sizeof(Context);
+  hdr.key = key;
+  hdr.exception = sim->guest_exception;
+  hdr.exception_code = sim->guest_exception_code;
+  hdr.exception_addr = sim->guest_exception_addr;
+  hdr.cycles = sim_cycle;
+  hdr.insns = total_user_insns_committed;
+  foreach (i, DECODE_TYPE_COUNT) hdr.decode_types[i] = stats.decoder.x86_decode_type[i];
+  hdr.dump_count = dump_pages.length;
+  os.write(&hdr, sizeof(hdr));
+  os.write(&ctx, sizeof(Context));
+
+  foreach (i, dump_pages.length) {
+    const W8* mapped = (asp.lookup_page(dump_pages[i])) ? asp.translate(dump_pages[i]).data : null;
+    RaspsimResultPage page;
+    page.addr = dump_pages[i];
+    page.mapped = (mapped != null);
+    page.reserved = 0;
+    os.write(&page, sizeof(page));
+    if (mapped) os.write(mapped, PAGE_SIZE);
+  }
+
+  os.close();
+  if (sys_rename(tempname, filename)) sys_unlink(tempname);
+}
+
+//
+// Simulate the current state, or take its end state from the result cache
+//
+static void simulate_case(const dynarray<Waddr>& dump_pages) {
+  ResultCacheKey key;
+
+  if (config.result_cache.set()) {
+    result_cache_key(key, dump_pages);
+    if (result_cache_load(key, dump_pages)) {
+      logfile << "=== Result cache hit: ", hexstring(key.hi, 64), hexstring(key.lo, 64), " ===", endl, flush;
+      return;
+    }
+  }
+
+  //
+  // Swap the FP control registers to the user process version, so FP uopimpls
+  // can use the real rounding control bits.
+  //
+  x86_set_mxcsr(ctx.mxcsr | MXCSR_EXCEPTION_DISABLE_MASK);
+  simulate(config.core_name);
+
+  if (config.result_cache.set()) result_cache_store(key, dump_pages);
+}
+
+//
+// Server mode: test cases are read from stdin, each as a list of
+// commands (one per line, as in @file) terminated by a "run" line.
+// For each case, a framed result is written to stdout:
+//
+//   === Case <n> ===
+//   Result: exit | exception <vector> (<name>) code=<errorcode> addr=<addr> | error
+//   Stats: cycles=<cycles> instructions=<insns>
+//   End state: ... (as in single run mode)
+//   === End of case <n> ===
+//
+// Commands given on the command line set up a base image shared by
+// all cases. Between cases, the guest context and the base image pages
+// written by the last case are restored from a snapshot, all other
+// guest pages are unmapped, and the pipeline and statistics are reset.
+// Decoded basic blocks are kept and only invalidated if the page they
+// were decoded from changed.
+//
+
+//
+// Restore the base image snapshot, and unmap all guest pages of the
+// previous test case which are not part of it. Pages which still
+// have translated basic blocks are handed back in code_pages so the
+// next case can be checked against their contents.
+//
+static void retire_guest_pages(Hashtable<Waddr, W8*>& code_pages) {
+  // Every page and range mapped since the snapshot is marked for restore:
+  dynarray<Waddr> pages(1);
+  dynarray<AddressSpace::RestoreRange> ranges(1);
+  asp.restore(pages, ranges);
+
+  foreach (i, pages.length) {
+    Waddr addr = pages[i];
+    Waddr mfn = addr >> 12;
+
+    // Mapped and unmapped again:
+    if (!asp.lookup_page(addr)) continue;
+
+    bool keep = (bbcache.get_page_bb_count(mfn) > 0) && (asp.getattr((void*)addr) & PROT_EXEC) && (!asp.isdirty(mfn));
+
+    if (keep) {
+      code_pages.add(addr, asp.detach_page(addr));
+      asp.setattr((void*)addr, PAGE_SIZE, PROT_NONE);
+    } else {
+      asp.unmap(addr, PAGE_SIZE);
+    }
+  }
+
+  // Only executable pages can be kept; the rest goes in one unmap per range:
+  foreach (i, ranges.length) {
+    for (Waddr addr = ranges[i].start; addr < ranges[i].end; addr += PAGE_SIZE) {
+      Waddr mfn = addr >> 12;
+      if (!(asp.getattr((void*)addr) & PROT_EXEC)) continue;
+      if ((!asp.lookup_page(addr)) || (!bbcache.get_page_bb_count(mfn)) || asp.isdirty(mfn)) continue;
+      code_pages.add(addr, asp.detach_page(addr));
+      asp.setattr((void*)addr, PAGE_SIZE, PROT_NONE);
+    }
+    asp.unmap(ranges[i].start, ranges[i].end - ranges[i].start);
+  }
+
+  // None of the pages unmapped here are part of the snapshot:
+  asp.clear_restore_pages();
+}
+
+//
+// Invalidate translations from retired pages whose contents or
+// execute permission differ in the new test case.
+//
+static void revalidate_code_pages(Hashtable<Waddr, W8*>& code_pages) {
+  Hashtable<Waddr, W8*>::Iterator iter(code_pages);
+  KeyValuePair<Waddr, W8*>* kvp;
+
+  while (kvp = iter.next()) {
+    Waddr addr = kvp->key;
+    W8* olddata = kvp->value;
+    const W8* newdata = (const W8*)asp.page_virt_to_mapped_readonly(addr);
+
+    if ((!newdata) || (!(asp.getattr((void*)addr) & PROT_EXEC)) || memcmp(newdata, olddata, PAGE_SIZE)) {
+      bbcache.invalidate_page(addr >> 12, INVALIDATE_REASON_DMA);
+    }
+
+    asp.free_page_data(olddata);
+  }
+
+  code_pages.clear_and_free();
+}
+
+static void reset_sim_state() {
+  reset_sim_counters();
+
+  requested_switch_to_native = 0;
+  sim->guest_exception = -1;
+  sim->guest_exception_code = 0;
+  sim->guest_exception_addr = 0;
+}
+
+//
+// Simulate one test case whose commands were applied, write its result
+// and go back to the base image.
+//
+static void run_case(ostream& os, W64 casenum, bool parse_err, const dynarray<Waddr>& dump_pages) {
+  revalidate_code_pages(sim->code_pages);
+  reset_sim_state();
+
+  if (!parse_err) {
+    logfile << endl, "=== Switching to simulation mode at rip ", (void*)(Waddr)ctx.commitarf[REG_rip], " for case ", casenum, " ===", endl, endl, flush;
+
+    simulate_case(dump_pages);
+
+    stringbuf sb;
+    sb << "case", casenum;
+    capture_stats_snapshot(sb);
+  }
+
+  if (result_format != RESULT_FORMAT_TEXT) {
+    write_result(os, casenum, run_result(parse_err), dump_pages);
+  } else if (parse_err) {
+    os << "=== Case ", casenum, " ===", endl;
+    os << "Result: error", endl;
+    os << "=== End of case ", casenum, " ===", endl;
+  } else {
+    os << "=== Case ", casenum, " ===", endl;
+    if (sim->guest_exception >= 0) {
+      os << "Result: exception ", sim->guest_exception, " (", x86_exception_names[sim->guest_exception], ") code=0x", hexstring(sim->guest_exception_code, 32),
+        " addr=", (void*)sim->guest_exception_addr, endl;
+    } else {
+      os << "Result: exit", endl;
+    }
+    os << "Stats: cycles=", sim_cycle, " instructions=", total_user_insns_committed, endl;
+    print_end_state(os, dump_pages);
+    os << "=== End of case ", casenum, " ===", endl;
+  }
+  os << flush;
+
+  retire_guest_pages(sim->code_pages);
+  ctx = *sim->base_ctx;
+}
+
+//
+// Commands from the command line form the base image of every case
+//
+static void snapshot_base_image() {
+  sim->base_ctx = new Context();
+  *sim->base_ctx = ctx;
+  asp.snapshot();
+}
+
+static void run_server(const dynarray<Waddr>& base_dump_pages) {
+  stringbuf line;
+  dynarray<Waddr> dump_pages;
+  W64 casenum = 0;
+  bool parse_err = false;
+
+  snapshot_base_image();
+  foreach (i, base_dump_pages.length) dump_pages.push(base_dump_pages[i]);
+
+  for (;;) {
+    line.reset();
+    cin >> line;
+    if (!cin) break;
+
+    char* p = strchr(line, '#');
+    if (p) *p = 0;
+
+    if (strcmp(line, "run")) {
+      parse_err |= handle_config_arg(line, &dump_pages);
+      continue;
+    }
+
+    run_case(cout, casenum, parse_err, dump_pages);
+    casenum++;
+    parse_err = false;
+    dump_pages.resize(base_dump_pages.length);
+  }
+
+  revalidate_code_pages(sim->code_pages);
+  flush_stats();
+
+  cerr << endl, "=== Exiting after ", casenum, " test cases in server mode ===", endl, endl;
+}
+
+//
+// Batch mode (-batch <corpus>): simulate a whole corpus of test cases on
+// all CPUs. The corpus is a directory (every regular file is a case: a
+// binary test case, an ELF file or a command list), a test case pack, or
+// "-" for server mode syntax on stdin. The simulator state is not thread
+// safe, so each worker is a process forked from the fully initialized
+// parent (sharing its base image copy-on-write) and pinned to one CPU.
+//
+// The parent hands out one case at a time to whichever worker is idle,
+// so long cases do not hold up a static share of the corpus. A worker
+// appends its results to a private spill file and reports where they
+// are; the parent copies them to the output in case order. If a worker
+// dies or runs out of time (-batchtimeout) in a case, the case gets an
+// error result and the worker is replaced; a case the worker died
+// before reading is handed to its replacement instead.
+//
+struct BatchCaseMessage {
+  W64 casenum;
+  W32 length;                // followed by <length> bytes of commands
+  W32 reserved;
+};
+
+struct BatchDoneMessage {
+  W64 casenum;
+  W64 offset;                // result in the worker's spill file
+  W64 length;
+  W64 cycles;
+  W64 insns;
+};
+
+struct BatchWorker {
+  pid_t pid;
+  int cpu;
+  int cmdfd;                 // parent -> worker: BatchCaseMessage
+  int donefd;                // worker -> parent: BatchDoneMessage
+  int spillfd;               // parent's read only handle on the spill file
+  W64s casenum;              // case in progress, or -1 if idle
+  char* commands;            // of the case in progress
+  bool sent;                 // whether the worker got all of them
+  bool resent;               // to a replacement worker
+  W64 deadline;              // rdtsc() at which the case times out (0: never)
+};
+
+struct BatchResult {
+  int spillfd;
+  W64 offset;
+  W64 length;
+
+  BatchResult() { }
+  BatchResult(int spillfd, W64 offset, W64 length): spillfd(spillfd), offset(offset), length(length) { }
+};
+
+struct BatchNameComparator {
+  int operator ()(const char* a, const char* b) const { return strcmp(a, b); }
+};
+
+struct BatchCorpus {
+  dynarray<char*> files;     // directory corpus, sorted by name
+  stringbuf pack;            // pack corpus
+  W64 count;
+  W64 next;
+  bool stream;
+
+  BatchCorpus(): count(0), next(0), stream(false) { }
+
+  ~BatchCorpus() {
+    foreach (i, files.length) delete[] files[i];
+  }
+
+  bool open(const char* path);
+  bool next_case(stringbuf& commands);
+};
+
+bool BatchCorpus::open(const char* path) {
+  if (!strcmp(path, "-")) {
+    stream = true;
+    return true;
+  }
+
+  int fd = sys_open(path, O_RDONLY | O_DIRECTORY, 0);
+  if (fd >= 0) {
+    W8* buf = new W8[65536];
+
+    for (;;) {
+      int n = sys_getdents64(fd, buf, 65536);
+      if (n <= 0) break;
+
+      for (int pos = 0; pos < n; ) {
+        const struct dirent64* de = (const struct dirent64*)(buf + pos);
+        pos += de->d_reclen;
+        if ((de->d_name[0] == '.') || ((de->d_type != DT_REG) && (de->d_type != DT_UNKNOWN))) continue;
+
+        stringbuf sb;
+        sb << path, "/", de->d_name;
+        char* name = new char[sb.size() + 1];
+        strcpy(name, sb);
+        files.push(name);
+      }
+    }
+
+    delete[] buf;
+    sys_close(fd);
+
+    sort(files.data, files.length, BatchNameComparator());
+    count = files.length;
+    return true;
+  }
+
+  istream is(path);
+  RaspsimPackHeader hdr;
+  if ((!is) || (is.read(&hdr, sizeof(hdr)) != sizeof(hdr)) || (hdr.magic != RASPSIM_PACK_MAGIC) || (hdr.version != RASPSIM_PACK_VERSION)) {
+    cerr << "Error: batch corpus '", path, "' is neither a directory nor a test case pack of version ", RASPSIM_PACK_VERSION, endl;
+    return false;
+  }
+
+  pack << path;
+  count = hdr.count;
+  return true;
+}
+
+//
+// Get the commands of the next case; false at the end of the corpus
+//
+bool BatchCorpus::next_case(stringbuf& commands) {
+  commands.reset();
+
+  if (stream) {
+    stringbuf line;
+    for (;;) {
+      line.reset();
+      cin >> line;
+      if (!cin) return false;
+
+      char* p = strchr(line, '#');
+      if (p) *p = 0;
+      if (!strcmp(line, "run")) break;
+      commands << line, "\n";
+    }
+    next++;
+    return true;
+  }
+
+  if (next >= count) return false;
+
+  if (pack.set()) {
+    commands << "B", pack, " ", next, "\n";
+  } else {
+    // Binary test cases and ELF files are loaded directly, anything else is a command list:
+    const char* filename = files[next];
+    W64 magic = 0;
+    istream is(filename);
+    if (is) is.read(&magic, sizeof(magic));
+
+    char command = '@';
+    if (magic == RASPSIM_CASE_MAGIC) command = 'B';
+    else if (lowbits(magic, 32) == 0x464c457f) command = 'E'; // "\x7f" "ELF"
+    commands << command, filename, "\n";
+  }
+
+  next++;
+  return true;
+}
+
+//
+// Worker: apply the commands of each case on top of the base image,
+// simulate it and report where its result went, until the command pipe
+// is closed.
+//
+static void run_batch_worker(int cmdfd, int donefd, int spillfd, const dynarray<Waddr>& base_dump_pages) {
+  ostream os(spillfd);
+  dynarray<Waddr> dump_pages;
+  foreach (i, base_dump_pages.length) dump_pages.push(base_dump_pages[i]);
+
+  for (;;) {
+    BatchCaseMessage msg;
+    if (!read_fully(cmdfd, &msg, sizeof(msg))) break;
+
+    char* text = new char[msg.length + 1];
+    if (!read_fully(cmdfd, text, msg.length)) break;
+    text[msg.length] = 0;
+
+    bool parse_err = false;
+    char* line = text;
+    while (line && *line) {
+      char* eol = strchr(line, '\n');
+      if (eol) *eol++ = 0;
+
+      char* p = strchr(line, '#');
+      if (p) *p = 0;
+
+      if (line[0] == '@') {
+        istream is(line + 1);
+        if (!is) {
+          cerr << "Error: cannot open command list file '", line + 1, "'", endl;
+          parse_err = true;
+        } else {
+          parse_err |= handle_config_file(is, &dump_pages);
+        }
+      } else {
+        parse_err |= handle_config_arg(line, &dump_pages);
+      }
+      line = eol;
+    }
+    delete[] text;
+
+    BatchDoneMessage done;
+    done.casenum = msg.casenum;
+    done.offset = os.where();
+    run_case(os, msg.casenum, parse_err, dump_pages);
+    done.length = os.where() - done.offset;
+    done.cycles = sim_cycle;
+    done.insns = total_user_insns_committed;
+    if (!write_fully(donefd, &done, sizeof(done))) break;
+
+    dump_pages.resize(base_dump_pages.length);
+  }
+
+  shutdown_subsystems();
+  cerr << flush;
+  logfile << flush;
+  sys_exit(0);
+}
+
+//
+// Fork a worker on the given CPU. Its spill file is unlinked right away;
+// the parent keeps its own read only handle on it. The case in progress
+// (of a worker being replaced) is left alone.
+//
+static bool start_batch_worker(dynarray<BatchWorker>& workers, int index, int cpu, const dynarray<Waddr>& base_dump_pages) {
+  static int spillfiles = 0;
+
+  stringbuf spillname;
+  spillname << (config.batch_output.set() ? (char*)config.batch_output : "/tmp/raspsim-batch"), ".", sys_getpid(), ".", spillfiles++;
+
+  int spillfd = sys_open(spillname, O_RDWR | O_CREAT | O_TRUNC, 0600);
+  int readfd = (spillfd >= 0) ? sys_open(spillname, O_RDONLY, 0) : -1;
+  sys_unlink(spillname);
+
+  int cmdpipe[2];
+  int donepipe[2];
+  if ((readfd < 0) || sys_pipe(cmdpipe)) {
+    cerr << "Error: cannot set up batch worker spill file '", spillname, "' or pipes", endl;
+    return false;
+  }
+  if (sys_pipe(donepipe)) {
+    cerr << "Error: cannot set up batch worker pipes", endl;
+    return false;
+  }
+
+  // Do not let the worker inherit (and print again) any buffered output:
+  cerr << flush;
+  cout << flush;
+  logfile << flush;
+
+  pid_t pid = sys_fork();
+  if (pid < 0) {
+    cerr << "Error: cannot fork batch worker (rc ", pid, ")", endl;
+    return false;
+  }
+
+  if (!pid) {
+    sys_close(cmdpipe[1]);
+    sys_close(donepipe[0]);
+    sys_close(readfd);
+
+    // Otherwise other workers would not see the end of their command pipe:
+    foreach (i, workers.length) {
+      if (i == index) continue;
+      if (workers[i].cmdfd >= 0) sys_close(workers[i].cmdfd);
+      if (workers[i].donefd >= 0) sys_close(workers[i].donefd);
+      if (workers[i].spillfd >= 0) sys_close(workers[i].spillfd);
+    }
+
+    if (cpu >= 0) {
+      W64 mask[16];
+      setzero(mask);
+      mask[cpu / 64] = (1ULL << (cpu % 64));
+      sys_sched_setaffinity(0, sizeof(mask), mask);
+    }
+
+    run_batch_worker(cmdpipe[0], donepipe[1], spillfd, base_dump_pages);
+  }
+
+  sys_close(cmdpipe[0]);
+  sys_close(donepipe[1]);
+  sys_close(spillfd);
+
+  BatchWorker& w = workers[index];
+  w.pid = pid;
+  w.cpu = cpu;
+  w.cmdfd = cmdpipe[1];
+  w.donefd = donepipe[0];
+  w.spillfd = readfd;
+  return true;
+}
+
+//
+// Send the case in progress to its worker. A worker which died in the
+// meantime (EPIPE, as SIGPIPE is ignored) is noticed on its done pipe.
+//
+static void send_batch_case(BatchWorker& w) {
+  BatchCaseMessage msg;
+  msg.casenum = w.casenum;
+  msg.length = strlen(w.commands);
+  msg.reserved = 0;
+
+  w.sent = write_fully(w.cmdfd, &msg, sizeof(msg)) && write_fully(w.cmdfd, w.commands, msg.length);
+  w.deadline = (config.batch_timeout) ? rdtsc() + seconds_to_ticks(config.batch_timeout) : 0;
+}
+
+//
+// Give an idle worker its next case, or let it exit at the end of the corpus
+//
+static void dispatch_batch_case(BatchWorker& w, BatchCorpus& corpus, W64& casenum) {
+  stringbuf commands;
+
+  if ((w.cmdfd < 0) || (!corpus.next_case(commands))) {
+    if (w.cmdfd >= 0) sys_close(w.cmdfd);
+    w.cmdfd = -1;
+    return;
+  }
+
+  w.casenum = casenum++;
+  w.commands = new char[commands.size() + 1];
+  strcpy(w.commands, commands);
+  w.resent = false;
+  send_batch_case(w);
+}
+
+static void finish_batch_case(BatchWorker& w) {
+  delete[] w.commands;
+  w.commands = null;
+  w.casenum = -1;
+}
+
+static void copy_batch_result(ostream& os, const BatchResult& r) {
+  static W8 buf[65536];
+
+  sys_seek(r.spillfd, r.offset, SEEK_SET);
+  W64 remaining = r.length;
+  while (remaining) {
+    int n = sys_read(r.spillfd, buf, min(remaining, (W64)sizeof(buf)));
+    if (n <= 0) {
+      cerr << "Error: cannot read batch result from spill file", endl;
+      break;
+    }
+    os.write(buf, n);
+    remaining -= n;
+  }
+}
+
+static int run_batch(const dynarray<Waddr>& base_dump_pages) {
+  BatchCorpus corpus;
+  if (!corpus.open(config.batch)) return 1;
+
+  ostream outfile;
+  if (config.batch_output.set() && (!outfile.open(config.batch_output))) {
+    cerr << "Error: cannot open batch output file '", config.batch_output, "'", endl;
+    return 1;
+  }
+  ostream& out = (config.batch_output.set()) ? outfile : cout;
+
+  snapshot_base_image();
+
+  W64 cpumask[16];
+  setzero(cpumask);
+  dynarray<int> cpus;
+  if (sys_sched_getaffinity(0, sizeof(cpumask), cpumask) > 0) {
+    foreach (i, sizeof(cpumask) * 8) {
+      if (bit(cpumask[i / 64], i % 64)) cpus.push(i);
+    }
+  }
+
+  int jobs = (config.jobs) ? config.jobs : max((int)cpus.length, 1);
+  dynarray<BatchWorker> workers;
+  workers.resize(jobs);
+  foreach (i, jobs) {
+    workers[i].cmdfd = -1;
+    workers[i].donefd = -1;
+    workers[i].spillfd = -1;
+    workers[i].casenum = -1;
+    workers[i].commands = null;
+  }
 
-  if (!is) {
-    cerr << "get_core_freq_hz(): warning: cannot open /proc/cpuinfo. Is this a Linux machine?", endl;
-    core_freq_hz = hz;
-    return hz;
+  // Writes to a dead worker fail with EPIPE instead of killing the parent:
+  struct kernel_sigaction sa;
+  setzero(sa);
+  sa.k_sa_handler = (kernel_sighandler_t)SIG_IGN;
+  sys_rt_sigaction(SIGPIPE, &sa, null, sizeof(W64));
+
+  // Results of cases which failed in the parent (i.e. whose worker died):
+  stringbuf spillname;
+  spillname << (config.batch_output.set() ? (char*)config.batch_output : "/tmp/raspsim-batch"), ".", sys_getpid();
+  int errorfd = sys_open(spillname, O_RDWR | O_CREAT | O_TRUNC, 0600);
+  sys_unlink(spillname);
+  if (errorfd < 0) {
+    cerr << "Error: cannot create batch spill file '", spillname, "'", endl;
+    return 1;
   }
+  ostream errors(errorfd);
+
+  W64 start = rdtsc();
+  W64 casenum = 0;
+  W64 next_output = 0;
+  W64 total_cycles = 0;
+  W64 total_insns = 0;
+  W64 failed = 0;
+  Hashtable<W64, BatchResult> results;
+
+  foreach (i, jobs) {
+    if (!start_batch_worker(workers, i, (cpus.length) ? cpus[i % cpus.length] : -1, base_dump_pages)) return 1;
+  }
+  foreach (i, jobs) dispatch_batch_case(workers[i], corpus, casenum);
+
+  dynarray<struct pollfd> fds;
+  dynarray<int> polled;
+  fds.reserve(jobs);
+  polled.reserve(jobs);
+
+  for (;;) {
+    fds.clear();
+    polled.clear();
+    W64 now = rdtsc();
+    W64 next_deadline = 0;
+    foreach (i, jobs) {
+      if (workers[i].casenum < 0) continue;
+      struct pollfd pfd;
+      pfd.fd = workers[i].donefd;
+      pfd.events = POLLIN;
+      pfd.revents = 0;
+      fds.push(pfd);
+      polled.push(i);
+      W64 deadline = workers[i].deadline;
+      if (deadline && ((!next_deadline) || (deadline < next_deadline))) next_deadline = deadline;
+    }
+    if (fds.empty()) break;
+
+    int timeout = -1;
+    if (next_deadline) timeout = (next_deadline > now) ? (int)min(ticks_to_seconds(next_deadline - now) * 1000 + 1, 1000000.0) : 0;
+    if (sys_poll(fds.data, fds.length, timeout) < 0) continue;
+
+    now = rdtsc();
+    foreach (j, fds.length) {
+      BatchWorker& w = workers[polled[j]];
+      bool timed_out = (w.deadline && (now >= w.deadline));
+      if ((!fds[j].revents) && (!timed_out)) continue;
+
+      BatchDoneMessage done;
+      if (fds[j].revents && read_fully(w.donefd, &done, sizeof(done))) {
+        results.add(done.casenum, BatchResult(w.spillfd, done.offset, done.length));
+        total_cycles += done.cycles;
+        total_insns += done.insns;
+        finish_batch_case(w);
+        dispatch_batch_case(w, corpus, casenum);
+        continue;
+      }
 
-  while (is) {
-    char s[256];
-    is >> readline(s, sizeof(s));
+      // Hung, or exited without reading its command pipe:
+      pid_t pid = w.pid;
+      int status = 0;
+      sys_kill(pid, SIGKILL);
+      sys_wait4(pid, &status, 0, null);
+
+      // Results already reported from its spill file stay readable through the old handle:
+      if (w.cmdfd >= 0) sys_close(w.cmdfd);
+      sys_close(w.donefd);
+      w.cmdfd = -1;
+      w.donefd = -1;
+      w.spillfd = -1;
+      if (!start_batch_worker(workers, polled[j], w.cpu, base_dump_pages)) return 1;
+
+      // Never got the case, so it is not to blame (but only retried once):
+      if ((!w.sent) && (!w.resent)) {
+        w.resent = true;
+        send_batch_case(w);
+        continue;
+      }
 
-    int mhz;
-    int n = sscanf(s, "cpu MHz : %d", &mhz);
-    if (n == 1) {
-      hz = (W64)mhz * 1000000;
-      core_freq_hz = hz;
-      return hz;
+      if (timed_out) {
+        cerr << "Warning: batch worker ", pid, " on CPU ", w.cpu, " killed after ", config.batch_timeout, " s in case ", w.casenum, endl;
+      } else {
+        cerr << "Warning: batch worker ", pid, " on CPU ", w.cpu, " died (status 0x", hexstring(status, 32), ") in case ", w.casenum, endl;
+      }
+      failed++;
+
+      W64 offset = errors.where();
+      run_case(errors, w.casenum, true, base_dump_pages);
+      results.add(w.casenum, BatchResult(errorfd, offset, errors.where() - offset));
+
+      finish_batch_case(w);
+      dispatch_batch_case(w, corpus, casenum);
+    }
+
+    BatchResult* r;
+    while (r = results.get(next_output)) {
+      copy_batch_result(out, *r);
+      results.remove(next_output);
+      next_output++;
     }
   }
 
-  // Can't read either of these procfiles: abort
-  assert(false);
+  foreach (i, jobs) {
+    int status = 0;
+    sys_close(workers[i].donefd);
+    sys_wait4(workers[i].pid, &status, 0, null);
+  }
+
+  out << flush;
+
+  double seconds = ticks_to_seconds(rdtsc() - start);
+  stringbuf sb;
+  sb << "=== Batch: ", casenum, " cases (", failed, " failed) on ", jobs, " workers in ", floatstring(seconds, 0, 3), " s: ",
+    floatstring(casenum / seconds, 0, 1), " cases/sec, ", W64(total_cycles / seconds), " simulated cycles/sec, ",
+    W64(total_insns / seconds), " instructions/sec ===", endl;
+  logfile << sb, flush;
+  // The console only hears from batch mode when something failed:
+  if (failed) cerr << endl, sb, endl, flush;
   return 0;
 }
 
 //
-// Main simulation driver function
+// Fork server mode, using the AFL fork server protocol: once the shared
+// image from the command line is set up, the parent waits for a 4-byte
+// request on the control pipe, forks a child which inherits the fully
+// initialized simulator, reports the child's pid and then its wait
+// status on the status pipe. Only the child returns from this function;
+// it then reads its per-case commands from stdin. Crashing test cases
+// (e.g. failed asserts) only take down the child.
 //
-void switch_to_sim() {
-  static const bool DEBUG = 0;
+static const int FORKSRV_FD = 198;
+
+//
+// Attach the fuzzer's coverage bitmap, if any: afl-fuzz passes its
+// SysV shared memory id in __AFL_SHM_ID. Children inherit the mapping.
+//
+static void attach_afl_coverage_map() {
+  const char* shmid = getenv("__AFL_SHM_ID");
+  if (!shmid) return;
+
+  void* area = sys_shmat(strtoul(shmid, null, 10), null, 0);
+  if ((Waddr)area >= (Waddr)-4095) {
+    cerr << "Error: cannot attach AFL coverage map (shm id ", shmid, ", rc ", (W64s)(Waddr)area, ")", endl, flush;
+    sys_exit(1);
+  }
+  afl_area = (byte*)area;
 }
 
-bool handle_config_arg(char* line, dynarray<Waddr>* dump_pages) {
-  if (*line == '\0') return false;
-  dynarray<char*> toks;
-  toks.tokenize(line, " ");
-  if (toks.empty())
-    return false;
+//
+// A guest exception is what the fuzzer looks for: report it as a crash
+// by dying from the corresponding host signal.
+//
+static void exit_with_exception_signal(int exception) {
+  int sig;
+  switch (exception) {
+  case EXCEPTION_x86_divide: case EXCEPTION_x86_fpu: case EXCEPTION_x86_sse:
+    sig = SIGFPE; break;
+  case EXCEPTION_x86_invalid_opcode:
+    sig = SIGILL; break;
+  case EXCEPTION_x86_breakpoint:
+    sig = SIGTRAP; break;
+  case EXCEPTION_x86_unaligned:
+    sig = SIGBUS; break;
+  default:
+    sig = SIGSEGV; break;
+  }
 
-  if (toks[0][0] == '#') {
-    return false;
+  cerr << flush;
+  cout << flush;
+  logfile << flush;
+  sys_kill(sys_getpid(), sig);
+  sys_exit(1);
+}
+
+static void run_fork_server() {
+  W32 msg = 0;
+
+  attach_afl_coverage_map();
+
+  if (sys_write(FORKSRV_FD + 1, &msg, 4) != 4) {
+    cerr << "Error: fork server status pipe (fd ", FORKSRV_FD + 1, ") is not open", endl, flush;
+    sys_exit(1);
   }
 
-  if (toks[0][0] == 'M') { // allocate page M<addr> <prot>
-    if (toks.size() != 2) {
-      cerr << "Error: option ", line, " has wrong number of arguments", endl;
-      return true;
-    }
-    char* endp;
-    W64 addr = strtoull(toks[0] + 1, &endp, 16);
-    if (*endp != '\0' || lowbits(addr, 12)) {
-      cerr << "Error: invalid value ", toks[0], " ", endp, endl;
-      return true;
-    }
-    int prot = 0;
-    if (!strcmp(toks[1], "ro")) prot = PROT_READ;
-    else if (!strcmp(toks[1], "rw")) prot = PROT_READ | PROT_WRITE;
-    else if (!strcmp(toks[1], "rx")) prot = PROT_READ | PROT_EXEC;
-    else {
-      cerr << "Error: invalid mem prot ", toks[1], endl;
-      return true;
+  for (;;) {
+    // Fuzzer went away: exit quietly
+    if (sys_read(FORKSRV_FD, &msg, 4) != 4) sys_exit(0);
+
+    // Do not let the child inherit (and print again) any buffered output:
+    cerr << flush;
+    cout << flush;
+    logfile << flush;
+
+    pid_t pid = sys_fork();
+    if (pid < 0) {
+      cerr << "Error: fork server cannot fork (rc ", pid, ")", endl, flush;
+      sys_exit(1);
     }
-    asp.map(addr, 0x1000, prot);
-  } else if (toks[0][0] == 'W') { // write to mem W<addr> <hexbytes>, may not cross page boundaries
-    if (toks.size() != 2) {
-      cerr << "Error: option ", line, " has wrong number of arguments", endl;
-      return true;
+
+    if (!pid) {
+      sys_close(FORKSRV_FD);
+      sys_close(FORKSRV_FD + 1);
+      return;
     }
-    char* endp;
-    W64 addr = strtoull(toks[0] + 1, &endp, 16);
-    if (*endp != '\0') {
-      cerr << "Error: invalid value ", toks[0], endl;
-      return true;
+
+    if (sys_write(FORKSRV_FD + 1, &pid, 4) != 4) sys_exit(1);
+
+    int status = 0;
+    if (sys_wait4(pid, &status, 0, null) < 0) sys_exit(1);
+
+    if (sys_write(FORKSRV_FD + 1, &status, 4) != 4) sys_exit(1);
+  }
+}
+
+//
+// Embedding API (raspsim.h), built into libraspsim.a. Each raspsim_t
+// is a simulation instance; the one a call refers to is made current
+// first. Switching exchanges the registers, address space and
+// translation cache with those set aside in the instance, so each
+// instance keeps its translations across switches.
+//
+static int raspsim_instances = 0;
+
+//
+// The library is single-threaded: every call holds an ApiCall for its
+// duration, and a second call entering while one is in progress (from
+// another thread, or from a signal handler) ends the host process
+// rather than corrupting the current instance. This does not go through
+// assert_fail(), which dumps the core state the other call is using.
+//
+static volatile int api_call_busy = 0;
+
+struct ApiCall {
+  ApiCall() {
+    if (__sync_lock_test_and_set(&api_call_busy, 1)) {
+      cerr << "raspsim: overlapping calls into the library (it is single-threaded, see raspsim.h)", endl, flush;
+      sys_exit(1);
     }
+  }
+
+  ~ApiCall() { __sync_lock_release(&api_call_busy); }
+};
+
+static void activate(raspsim* instance) {
+  assert(api_call_busy);
+  if (instance == sim) return;
+  if (sim) {
+    sim->saved_ctx = ctx;
+    asp.swap(sim->saved_asp);
+    bbcache.swap(sim->saved_bbcache);
+  }
+  sim = instance;
+  if (sim) {
+    ctx = sim->saved_ctx;
+    asp.swap(sim->saved_asp);
+    bbcache.swap(sim->saved_bbcache);
+  }
+}
+
+extern "C" raspsim_t* raspsim_create(int argc, const char** argv) {
+  ApiCall call;
+  static bool initialized = false;
+
+  if (!initialized) {
+    ptl_mm_init();
+    call_global_constuctors();
+    configparser.setup();
+    CycleTimer::gethz();
+    init_uops();
+    init_decode();
+    initialized = true;
+  }
+
+  // The configuration is shared: it is set up with the first instance.
+  if (!raspsim_instances) {
+    config.reset();
+    config.log_filename = "/dev/null";
+    config.dumpcode_filename.reset();
+    config.quiet = 1;
+    if (configparser.parse(config, argc, (char**)argv) >= 0) return null;
+    handle_config_change(config, argc, (char**)argv);
+    if (!PTLsimMachine::getmachine(config.core_name)) return null;
+    stop_on_exception = true;
+  } else if (argc) {
+    return null;
+  }
+
+  activate(new raspsim());
+  asp.reset();
+  init_guest_context();
+  reset_sim_state();
+  raspsim_instances++;
+  return sim;
+}
+
+extern "C" void raspsim_destroy(raspsim_t* sim) {
+  ApiCall call;
+  // Torn down while current, as releasing guest pages also drops their
+  // translations and dirty bits:
+  activate(sim);
+  bbcache.flush();
+  Hashtable<Waddr, W8*>::Iterator iter(sim->code_pages);
+  KeyValuePair<Waddr, W8*>* kvp;
+  while (kvp = iter.next()) asp.free_page_data(kvp->value);
+  asp.release();
+
+  activate(null);
+  delete sim;
+  raspsim_instances--;
+  logfile.flush();
+}
+
+extern "C" int raspsim_command(raspsim_t* sim, const char* command) {
+  ApiCall call;
+  activate(sim);
+  stringbuf line;
+  line << command;
+  // D pages are read with raspsim_read() instead:
+  dynarray<Waddr> dump_pages(1);
+  return (handle_config_arg(line, &dump_pages)) ? -1 : 0;
+}
+
+extern "C" int raspsim_map(raspsim_t* sim, uint64_t addr, uint64_t length, int prot) {
+  ApiCall call;
+  if (lowbits(addr, 12) || (!length) || (prot & ~(PROT_READ|PROT_WRITE|PROT_EXEC))) return -1;
+  activate(sim);
+  asp.map(addr, length, prot);
+  return 0;
+}
+
+extern "C" int raspsim_unmap(raspsim_t* sim, uint64_t addr, uint64_t length) {
+  ApiCall call;
+  if (lowbits(addr, 12)) return -1;
+  activate(sim);
+  asp.unmap(addr, length);
+  return 0;
+}
+
+static bool guest_range_mapped(Waddr addr, Waddr length) {
+  for (Waddr page = floor(addr, PAGE_SIZE); page < addr + length; page += PAGE_SIZE) {
+    if (!asp.translate(page).data) return false;
+  }
+  return true;
+}
+
+extern "C" int raspsim_write(raspsim_t* sim, uint64_t addr, const void* data, size_t length) {
+  ApiCall call;
+  activate(sim);
+  if (!guest_range_mapped(addr, length)) return -1;
+
+  const W8* src = (const W8*)data;
+  while (length) {
     W8* mapped = (W8*)asp.page_virt_to_mapped(addr);
-    if (!mapped) {
-      cerr << "Error: page not mapped ", (void*) addr, endl;
-      return true;
-    }
-    Waddr arglen = strlen(toks[1]);
-    if ((arglen & 1) || arglen/2 > 4096-lowbits(addr, 12)) {
-      cerr << "Error: arg has odd size or crosses page boundary", (void*) addr, endl;
-      return true;
-    }
-    unsigned n = min((Waddr)(4096 - lowbits(addr, 12)), arglen/2);
+    Waddr n = min((Waddr)(PAGE_SIZE - lowbits(addr, 12)), (Waddr)length);
+    bool changed = false;
     foreach (i, n) {
-      char hex_byte[3] = {toks[1][i*2],toks[1][i*2+1], 0};
-      mapped[i] = strtoul(hex_byte, NULL, 16);
-    }
-  } else if (toks[0][0] == 'D') { // dump page D<page>
-    if (toks.size() != 1) {
-      cerr << "Error: option ", line, " has wrong number of arguments", endl;
-      return true;
-    }
-    char* endp;
-    W64 addr = strtoull(toks[0] + 1, &endp, 16);
-    if (*endp != '\0') {
-      cerr << "Error: invalid value ", toks[0], endl;
-      return true;
-    }
-    dump_pages->push(floor(addr, PAGE_SIZE));
-  } else if (!strcmp(toks[0], "Fnox87")) {
-    ctx.no_x87 = 1;
-  } else if (!strcmp(toks[0], "Fnosse")) {
-    ctx.no_sse = 1;
-  } else {
-    if (toks.size() != 2) {
-      cerr << "Error: option ", line, " has wrong number of arguments", endl;
-      return true;
-    }
-    int reg = -1;
-    foreach (j, sizeof(arch_reg_names) / sizeof(arch_reg_names[0])) {
-      if (!strcmp(toks[0], arch_reg_names[j])) {
-        reg = j; break;
-      }
-    }
-    if (reg < 0) {
-      cerr << "Error: invalid register ", toks[0], endl;
-      return true;
+      changed |= (mapped[i] != src[i]);
+      mapped[i] = src[i];
     }
-    char* endp;
-    W64 v = strtoull(toks[1], &endp, 0);
-    if (*endp != '\0') {
-      cerr << "Error: invalid value ", toks[1], endl;
-      return true;
+    // As for W: the page may still have translations from earlier runs
+    if (changed) {
+      bbcache.invalidate_page(addr >> 12, INVALIDATE_REASON_DMA);
+      asp.setrestore(addr >> 12);
     }
-    ctx.commitarf[reg] = v;
+    addr += n;
+    src += n;
+    length -= n;
   }
 
-  return false;
+  return 0;
+}
+
+extern "C" int raspsim_read(raspsim_t* sim, uint64_t addr, void* data, size_t length) {
+  ApiCall call;
+  activate(sim);
+  if (!guest_range_mapped(addr, length)) return -1;
+
+  W8* dest = (W8*)data;
+  while (length) {
+    // Demand-zero pages read as the zero page, without materializing them:
+    const W8* mapped = asp.translate(addr).data + lowbits(addr, 12);
+    Waddr n = min((Waddr)(PAGE_SIZE - lowbits(addr, 12)), (Waddr)length);
+    foreach (i, n) dest[i] = mapped[i];
+    addr += n;
+    dest += n;
+    length -= n;
+  }
+
+  return 0;
+}
+
+extern "C" int raspsim_reg_index(const char* name) {
+  foreach (i, ARCHREG_COUNT) {
+    if (!strcmp(name, arch_reg_names[i])) return i;
+  }
+  return -1;
+}
+
+extern "C" uint64_t raspsim_get_reg(raspsim_t* sim, int reg) {
+  ApiCall call;
+  assert(inrange(reg, 0, ARCHREG_COUNT-1));
+  activate(sim);
+  return ctx.commitarf[reg];
+}
+
+extern "C" void raspsim_set_reg(raspsim_t* sim, int reg, uint64_t value) {
+  ApiCall call;
+  assert(inrange(reg, 0, ARCHREG_COUNT-1));
+  activate(sim);
+  ctx.commitarf[reg] = value;
+}
+
+extern "C" void raspsim_snapshot(raspsim_t* sim) {
+  ApiCall call;
+  activate(sim);
+  if (!sim->base_ctx) sim->base_ctx = new Context();
+  *sim->base_ctx = ctx;
+  asp.snapshot();
+}
+
+extern "C" int raspsim_restore(raspsim_t* sim) {
+  ApiCall call;
+  if (!sim->base_ctx) return -1;
+  activate(sim);
+  retire_guest_pages(sim->code_pages);
+  ctx = *sim->base_ctx;
+  return 0;
+}
+
+extern "C" int raspsim_run(raspsim_t* sim, uint64_t max_cycles, uint64_t max_insns) {
+  ApiCall call;
+  activate(sim);
+  revalidate_code_pages(sim->code_pages);
+  reset_sim_state();
+
+  config.stop_at_cycle = (max_cycles) ? max_cycles : infinity;
+  config.stop_at_user_insns = (max_insns) ? max_insns : infinity;
+
+  // The guest's rounding and exception masks apply while simulating:
+  W32 host_mxcsr = x86_get_mxcsr();
+  x86_set_mxcsr(ctx.mxcsr | MXCSR_EXCEPTION_DISABLE_MASK);
+  simulate(config.core_name);
+  x86_set_mxcsr(host_mxcsr);
+
+  raspsim_stats_t& st = sim->last_run;
+  st.cycles = sim_cycle;
+  st.instructions = total_user_insns_committed;
+  st.uops = total_uops_committed;
+  st.basic_blocks = total_basic_blocks_committed;
+  st.decode_fast = stats.decoder.x86_decode_type[DECODE_TYPE_FAST];
+  st.decode_complex = stats.decoder.x86_decode_type[DECODE_TYPE_COMPLEX];
+  st.decode_x87 = stats.decoder.x86_decode_type[DECODE_TYPE_X87];
+  st.decode_sse = stats.decoder.x86_decode_type[DECODE_TYPE_SSE];
+  st.decode_assist = stats.decoder.x86_decode_type[DECODE_TYPE_ASSIST];
+
+  if (sim->guest_exception >= 0) return RASPSIM_RUN_EXCEPTION;
+  return (requested_switch_to_native) ? RASPSIM_RUN_EXIT : RASPSIM_RUN_LIMIT;
+}
+
+extern "C" int raspsim_exception(raspsim_t* sim, uint32_t* code, uint64_t* addr) {
+  ApiCall call;
+  if (code) *code = sim->guest_exception_code;
+  if (addr) *addr = sim->guest_exception_addr;
+  return sim->guest_exception;
+}
+
+extern "C" void raspsim_get_stats(raspsim_t* sim, raspsim_stats_t* st) {
+  ApiCall call;
+  *st = sim->last_run;
 }
 
 //
 // PTLsim main: called after ptlsim_preinit() brings up boot subsystems
 //
 int main(int argc, char** argv) {
+  environ = argv + argc + 1;
   ptl_mm_init();
   call_global_constuctors();
 
@@ -829,6 +3727,11 @@ int main(int argc, char** argv) {
   if (ptlsim_arg_count == 0) ptlsim_arg_count = argc;
   handle_config_change(config, ptlsim_arg_count - 1, argv+1);
 
+  if (parse_result_format(config.result_format)) sys_exit(1);
+  // Created on first use; an existing directory is fine:
+  if (config.result_cache.set()) sys_mkdir(config.result_cache, 0755);
+  stop_on_exception = (config.server || config.batch.set() || config.forkserver || (result_format != RESULT_FORMAT_TEXT));
+
   CycleTimer::gethz();
 
   init_uops();
@@ -836,30 +3739,9 @@ int main(int argc, char** argv) {
 
 
   // Set up initial context:
-  ctx.reset();
+  sim = new raspsim();
   asp.reset();
-  ctx.use32 = 1;
-  ctx.use64 = 1;
-  ctx.commitarf[REG_rsp] = 0;
-  ctx.commitarf[REG_rip] = 0x100000;
-  ctx.commitarf[REG_flags] = 0;
-  ctx.internal_eflags = 0;
-
-  ctx.seg[SEGID_CS].selector = 0x33;
-  ctx.seg[SEGID_SS].selector = 0x2b;
-  ctx.seg[SEGID_DS].selector = 0x00;
-  ctx.seg[SEGID_ES].selector = 0x00;
-  ctx.seg[SEGID_FS].selector = 0x00;
-  ctx.seg[SEGID_GS].selector = 0x00;
-  ctx.update_shadow_segment_descriptors();
-
-
-  // ctx.fxrstor(x87state);
-
-  ctx.vcpuid = 0;
-  ctx.running = 1;
-  ctx.commitarf[REG_ctx] = (Waddr)&ctx;
-  ctx.commitarf[REG_fpstack] = (Waddr)&ctx.fpstack;
+  init_guest_context();
 
   dynarray<Waddr> dump_pages;
 
@@ -867,32 +3749,42 @@ int main(int argc, char** argv) {
   bool parse_err = false;
   for (unsigned i = ptlsim_arg_count; i < argc; i++) {
     if (argv[i][0] == '@') {
-      stringbuf line;
       istream is(argv[i] + 1);
       if (!is) {
         cerr << "Warning: cannot open command list file '", argv[i], "'", endl;
         continue;
       }
 
-      for (;;) {
-        line.reset();
-        is >> line;
-        if (!is) break;
-
-        char* p = strchr(line, '#');
-        if (p) *p = 0;
-        parse_err |= handle_config_arg(line, &dump_pages);
-      }
+      parse_err |= handle_config_file(is, &dump_pages);
     } else {
       parse_err |= handle_config_arg(argv[i], &dump_pages);
     }
   }
 
+  if (config.forkserver && (!parse_err)) {
+    run_fork_server();
+    parse_err |= handle_config_file(cin, &dump_pages);
+  }
+
   if (parse_err) {
     cerr << "Error: could not parse all arguments", endl, flush;
     sys_exit(1);
   }
 
+  if (config.batch.set()) {
+    int rc = run_batch(dump_pages);
+    shutdown_subsystems();
+    logfile.flush();
+    sys_exit(rc);
+  }
+
+  if (config.server) {
+    run_server(dump_pages);
+    shutdown_subsystems();
+    logfile.flush();
+    sys_exit(0);
+  }
+
   // asp.map(0x100000, 0x1000, PROT_READ|PROT_WRITE|PROT_EXEC);
   // W64 endless_loop = 0x80cdc031c031;
   // // endless_loop = 0xfeeb;
@@ -910,41 +3802,27 @@ int main(int argc, char** argv) {
 
   bool done = false;
 
-  //
-  // Swap the FP control registers to the user process version, so FP uopimpls
-  // can use the real rounding control bits.
-  //
-  x86_set_mxcsr(ctx.mxcsr | MXCSR_EXCEPTION_DISABLE_MASK);
-
-  simulate(config.core_name);
+  simulate_case(dump_pages);
   capture_stats_snapshot("final");
   flush_stats();
 
-  cerr << "End state:", endl;
-  cerr << ctx, endl;
-  foreach (i, dump_pages.length) {
-    Waddr addr = dump_pages[i];
-    byte* mapped = (byte*)asp.page_virt_to_mapped(addr);
-    if (!mapped) {
-      cerr << "Error dumping memory: page not mapped ", (void*) addr, endl;
-    } else {
-      cerr << "Dump of memory at ", (void*) addr, ": ", endl;
-      cerr << bytestring(mapped, PAGE_SIZE), endl;
-    }
-  }
-  cerr << "Decoder stats:";
-  foreach(i, DECODE_TYPE_COUNT) {
-    cerr << " ", decode_type_names[i], "=", stats.decoder.x86_decode_type[i];
+  if (result_format != RESULT_FORMAT_TEXT) {
+    write_result(cout, 0, run_result(false), dump_pages);
+    cout << flush;
+  } else {
+    print_end_state(cerr, dump_pages);
   }
-  cerr << endl;
-  cerr << flush;
 
   cerr << endl, "=== Exiting after full simulation on tid ", sys_gettid(), " at rip ", (void*)(Waddr)ctx.commitarf[REG_rip], " (",
     sim_cycle, " cycles, ", total_user_insns_committed, " user commits, ", iterations, " iterations) ===", endl, endl;
   shutdown_subsystems();
   logfile.flush();
-  sys_exit(0);
+  if (config.forkserver && (sim->guest_exception >= 0)) exit_with_exception_signal(sim->guest_exception);
+  // Only reached after an exception with structured results or in fork server mode:
+  sys_exit((sim->guest_exception >= 0) ? 1 : 0);
 }
 
-bool inside_ptlsim = 1;
+// RASPsim is never injected into another process, so its heap can be
+// private; the fork server relies on children getting copy-on-write pages.
+bool inside_ptlsim = 0;
 bool requested_switch_to_native = 0;
@@ -0,0 +1,102 @@
+/*
+ * PTLsim: Cycle Accurate x86-64 Simulator
+ * RASPsim embedding API (libraspsim.a)
+ *
+ * The simulator runs inside the host program: guest memory and
+ * registers are accessed directly, without starting a process or
+ * parsing text. Each instance has its own guest registers, memory,
+ * base image and translation cache; the core models, statistics and
+ * configuration are shared, so instances are simulated one at a time.
+ *
+ * The library is single-threaded. Instances cannot run concurrently,
+ * even on different threads: only one call into the library may be in
+ * progress at any time, whichever instance it refers to. A host
+ * program that calls from several threads must serialize the calls
+ * itself; overlapping calls exit the host process, as failed
+ * internal assertions do.
+ */
+
+#ifndef _RASPSIM_H_
+#define _RASPSIM_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct raspsim raspsim_t;
+
+/* Guest memory protection (as PROT_xxx): */
+enum {
+  RASPSIM_PROT_READ  = 1,
+  RASPSIM_PROT_WRITE = 2,
+  RASPSIM_PROT_EXEC  = 4,
+};
+
+/* Result of raspsim_run(): */
+enum {
+  RASPSIM_RUN_EXIT      = 0,  /* guest executed int 0x80 */
+  RASPSIM_RUN_EXCEPTION = 1,  /* guest raised a CPU exception, see raspsim_exception() */
+  RASPSIM_RUN_LIMIT     = 2,  /* cycle or instruction budget reached */
+};
+
+typedef struct raspsim_stats {
+  uint64_t cycles;
+  uint64_t instructions;
+  uint64_t uops;
+  uint64_t basic_blocks;
+  uint64_t decode_fast;
+  uint64_t decode_complex;
+  uint64_t decode_x87;
+  uint64_t decode_sse;
+  uint64_t decode_assist;
+} raspsim_stats_t;
+
+/*
+ * Create a simulator instance. argv holds simulator options as on the
+ * command line (e.g. "-core", "seq"); the log goes to /dev/null and the
+ * console output is off (-quiet). The options apply to all instances,
+ * so they can only be given while no other instance exists. Returns
+ * NULL if they cannot be applied or are invalid.
+ */
+raspsim_t* raspsim_create(int argc, const char** argv);
+void raspsim_destroy(raspsim_t* sim);
+
+/* Apply one configuration command (as in @file, e.g. "Ecode.o" or "S7ff000 1000"; D is ignored). 0 on success */
+int raspsim_command(raspsim_t* sim, const char* command);
+
+/* Map demand-zero guest memory, or unmap it; addresses are page aligned. 0 on success */
+int raspsim_map(raspsim_t* sim, uint64_t addr, uint64_t length, int prot);
+int raspsim_unmap(raspsim_t* sim, uint64_t addr, uint64_t length);
+
+/* Copy to or from mapped guest memory, ignoring its protection. 0 on success, -1 if not all mapped */
+int raspsim_write(raspsim_t* sim, uint64_t addr, const void* data, size_t length);
+int raspsim_read(raspsim_t* sim, uint64_t addr, void* data, size_t length);
+
+/* Architectural registers, numbered as in the binary test case format ("rax" is 0, "rip", "flags", ...) */
+int raspsim_reg_index(const char* name);
+uint64_t raspsim_get_reg(raspsim_t* sim, int reg);
+void raspsim_set_reg(raspsim_t* sim, int reg, uint64_t value);
+
+/*
+ * Save the current memory and registers as the base image, and return
+ * to it (copying back only the pages written since, and unmapping
+ * pages mapped since).
+ */
+void raspsim_snapshot(raspsim_t* sim);
+int raspsim_restore(raspsim_t* sim);
+
+/* Simulate from the current state; 0 means no limit. Counters start from zero on each run. */
+int raspsim_run(raspsim_t* sim, uint64_t max_cycles, uint64_t max_insns);
+
+/* Exception vector of the last run (-1 if none), with error code and fault address */
+int raspsim_exception(raspsim_t* sim, uint32_t* code, uint64_t* addr);
+void raspsim_get_stats(raspsim_t* sim, raspsim_stats_t* stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _RASPSIM_H_ */
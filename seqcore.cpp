@@ -535,10 +535,18 @@ struct SequentialCore {
   Context& ctx;
   CommitRecord* cmtrec;
 
-  SequentialCore(): ctx(contextof(0)), cmtrec(null) { }
-  SequentialCore(Context& ctx_, CommitRecord* cmtrec_ = null): ctx(ctx_), cmtrec(cmtrec_) { }
+  SequentialCore(): ctx(contextof(0)), cmtrec(null), chain_from(null) { }
+  SequentialCore(Context& ctx_, CommitRecord* cmtrec_ = null): ctx(ctx_), cmtrec(cmtrec_), chain_from(null) { }
 
   BasicBlock* current_basic_block;
+
+  //
+  // Direct block chaining: the last block to run to its end, which
+  // stays valid as long as bbcache.generation is chain_generation,
+  // links to its successors, so loops need no bbcache lookups.
+  //
+  BasicBlock* chain_from;
+  W64 chain_generation;
   int bytes_in_current_insn;
   int current_uop_in_macro_op;
   W64 current_uuid;
@@ -593,6 +601,7 @@ struct SequentialCore {
   void reset_fetch(W64 realrip) {
     arf[REG_rip] = realrip;
     current_basic_block = null;
+    chain_from = null;
   }
 
   enum {
@@ -740,6 +749,7 @@ struct SequentialCore {
     W64 physaddr = addrgen<1>(uop, state, origaddr, ra, rb, rc, pteupdate, addr, exception, pfec, pteused, annul);
 
     if unlikely ((status = handle_common_exceptions<1>(uop, state, origaddr, addr, exception, pfec, pteused)) != ISSUE_COMPLETED) return status;
+    if unlikely (warming_machine && (!annul)) warming_machine->warm_access(addr, physaddr);
 
     //
     // At this point all operands are valid, so merge the data and mark the store as valid.
@@ -814,6 +824,7 @@ struct SequentialCore {
     W64 physaddr = addrgen<0>(uop, state, origaddr, ra, rb, rc, pteupdate, addr, exception, pfec, pteused, annul);
 
     if unlikely ((status = handle_common_exceptions<0>(uop, state, origaddr, addr, exception, pfec, pteused)) != ISSUE_COMPLETED) return status;
+    if unlikely (warming_machine && (!annul)) warming_machine->warm_access(addr, physaddr);
 
     state.physaddr = (annul) ? 0xffffffffffffffffULL : (physaddr >> 3);
 
@@ -1009,6 +1020,12 @@ struct SequentialCore {
     ctx.propagate_x86_exception(ctx.x86_exception, ctx.error_code, ctx.cr2);
 
     external_to_core_state(ctx);
+#ifndef PTLSIM_HYPERVISOR
+    if (requested_switch_to_native) {
+      logfile << "Exception requested switch to native mode at rip ", (void*)(Waddr)ctx.commitarf[REG_rip], endl;
+      return false;
+    }
+#endif
 
     return true;
   }
@@ -1070,6 +1087,33 @@ struct SequentialCore {
     return current_basic_block;
   }
 
+  BasicBlock* chained_successor(Waddr rip) {
+    if unlikely ((!chain_from) || (chain_generation != bbcache.generation)) return null;
+
+    BasicBlock* bb = chain_from->chain[rip == chain_from->rip_not_taken];
+    if unlikely ((!bb) || (chain_from->chaingen != chain_generation) || (bb->rip.rip != rip)) return null;
+
+    stats.decoder.chaining.hits++;
+    bb->use(sim_cycle);
+    return bb;
+  }
+
+  void link_successor(BasicBlock* bb) {
+    // The lookup may have translated, and so reclaimed, chain_from:
+    if unlikely ((!chain_from) || (chain_generation != bbcache.generation)) return;
+
+    if unlikely (chain_from->chaingen != chain_generation) {
+      if (chain_from->chain[0] || chain_from->chain[1]) stats.decoder.chaining.flushes++;
+      chain_from->chain[0] = null;
+      chain_from->chain[1] = null;
+      chain_from->chaingen = chain_generation;
+    }
+
+    // Indirect branches keep their last target in the taken slot:
+    chain_from->chain[bb->rip.rip == chain_from->rip_not_taken] = bb;
+    stats.decoder.chaining.links++;
+  }
+
   //
   // Execute one basic block sequentially
   //
@@ -1095,6 +1139,7 @@ struct SequentialCore {
 
     if unlikely (!bb->synthops) synth_uops_for_bb(*bb);
     bb->hitcount++;
+    if unlikely (warming_machine) warming_machine->warm_fetch(bb->rip, bb->bytes);
 
     TransOpBuffer unaligned_ldst_buf;
     unaligned_ldst_buf.index = -1;
@@ -1258,6 +1303,7 @@ struct SequentialCore {
         state.brreg.ripseq = uop.ripseq;
         assert((void*)synthop);
         synthop(state, radata, rbdata, rcdata, raflags, rbflags, rcflags); 
+        if unlikely (warming_machine) warming_machine->warm_branch(uop, rip, state.reg.rddata);
 
         if unlikely (config.event_log_enabled) {
           SequentialCoreEvent* event = eventlog.add(EVENT_BRANCH, ctx.vcpuid, uop, rip, current_uop_in_macro_op, current_uuid, total_user_insns_committed);
@@ -1358,6 +1404,7 @@ struct SequentialCore {
 
       if likely (uop.eom) {
         arf[REG_rip] = (uop.rd == REG_rip) ? state.reg.rddata : (arf[REG_rip] + bytes_in_current_insn);
+        if unlikely (br) afl_trace_branch(arf[REG_rip]);
         // Do not commit transactional memory: that's up to the caller:
         // if unlikely (cmtrec) transactmem.commit();
       }
@@ -1403,12 +1450,19 @@ struct SequentialCore {
 
   int execute() {
     Waddr rip = arf[REG_rip];
-    
-    current_basic_block = fetch_or_translate_basic_block(rip);
+
+    current_basic_block = chained_successor(rip);
+    if unlikely (!current_basic_block) {
+      current_basic_block = fetch_or_translate_basic_block(rip);
+      link_successor(current_basic_block);
+    }
 
     bool exiting = 0;
 
+    // Anything freed from here on (SMC, exceptions, assists) breaks the chain:
+    chain_generation = bbcache.generation;
     int result = execute(current_basic_block, (config.stop_at_user_insns - total_user_insns_committed));
+    chain_from = (result == SEQEXEC_OK) ? current_basic_block : null;
     
     switch (result) {
     case SEQEXEC_OK:
@@ -63,6 +63,18 @@ struct PTLsimStats { // rootnode:
     W64 basicblocks;
   } summary;
 
+  //
+  // Statistical sampling (-sample): summary.cycles is then the estimate
+  //
+  struct sampling {
+    W64 samples;
+    W64 period;
+    W64 measured_insns;
+    W64 measured_cycles;
+    double cpi;
+    double cpi_halfwidth;
+  } sampling;
+
   struct simulator {
     // Compile time information
     struct version {
@@ -140,7 +152,31 @@ struct PTLsimStats { // rootnode:
       W64 invalidates[INVALIDATE_REASON_COUNT]; // label: invalidate_reason_names
     } pagecache;
 
+    // Persistent basic block store (-bbstore)
+    struct bbstore {
+      W64 hits;
+      W64 misses;
+      W64 inserts;
+    } bbstore;
+
     W64 reclaim_rounds;
+
+    // Direct block chaining (seq core)
+    struct chaining {
+      W64 hits;       // successor found through the link of the previous block
+      W64 links;      // successors linked after a bbcache lookup
+      W64 flushes;    // stale links dropped after an invalidation
+    } chaining;
+
+    // CLOCK eviction from the basic block cache
+    struct eviction {
+      W64 blocks;
+      W64 bytes;
+      W64 scanned;          // blocks passed by the clock hand
+      W64 second_chances;   // referenced since the last pass: kept
+      W64 in_use;           // still in the pipeline: kept
+      W64 over_budget;      // rounds started by -bbcache-budget
+    } eviction;
   } decoder;
 
   OutOfOrderCoreStats ooocore;
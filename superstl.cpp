@@ -1359,6 +1359,35 @@ ostream& operator ,(ostream& os, const vec8w& v) {
   return os << v;
 }
 
+int host_simd = HOST_SIMD_SSE2;
+
+//
+// Find the widest SIMD extension the associative searches can use:
+// the CPU must support it and the OS must save its register state.
+//
+int detect_host_simd() {
+  static int detected = -1;
+  if likely (detected >= 0) return detected;
+
+  detected = HOST_SIMD_SSE2;
+
+  W32 eax, ebx, ecx, edx;
+  cpuid(0, eax, ebx, ecx, edx);
+  if unlikely (eax < 7) return detected;
+  cpuid(1, eax, ebx, ecx, edx);
+  if unlikely (!bit(ecx, 27)) return detected; // OSXSAVE
+
+  W32 xcr0, xcr0hi;
+  asm("xgetbv" : "=a" (xcr0), "=d" (xcr0hi) : "c" (0));
+  asm("cpuid" : "=a" (eax), "=b" (ebx), "=c" (ecx), "=d" (edx) : "0" (7), "2" (0));
+
+  // XCR0: SSE and AVX state, then also opmask and upper zmm state
+  if (bit(ebx, 5) && ((xcr0 & 0x06) == 0x06)) detected = HOST_SIMD_AVX2;
+  if (bit(ebx, 5) && bit(ebx, 16) && bit(ebx, 30) && bit(ebx, 31) && ((xcr0 & 0xe6) == 0xe6)) detected = HOST_SIMD_AVX512;
+
+  return detected;
+}
+
 const byte byte_to_vec16b[256][16] alignto(16) = {
   {0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00},
   {0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01},
@@ -828,6 +828,14 @@ namespace superstl {
       reserved = 0;
     }
 
+    // Exchange contents without copying the elements:
+    void swap(dynarray<T>& other) {
+      ::swap(data, other.data);
+      ::swap(length, other.length);
+      ::swap(reserved, other.reserved);
+      ::swap(granularity, other.granularity);
+    }
+
     inline int capacity() const { return reserved; }
     inline bool empty() const { return (length == 0); }
     inline void clear() { resize(0); }
@@ -1635,20 +1643,20 @@ namespace superstl {
     void insertop(size_t i, size_t n, T v) {
       T& lw = w[wordof(i)];
       T lm = (bitmask(n) << bitof(i));
-      lw = (lw & ~lm) | ((v << i) & lm);
+      lw = (lw & ~lm) | ((v << bitof(i)) & lm);
 
       if unlikely ((bitof(i) + n) > BITS_PER_WORD) {
-        T& hw = w[wordof(i+1)];
+        T& hw = w[wordof(i) + 1];
         T hm = (bitmask(n) >> (BITS_PER_WORD - bitof(i)));
         hw = (hw & ~hm) | ((v >> (BITS_PER_WORD - bitof(i))) & hm);
       }
     }
 
     void accumop(size_t i, size_t n, T v) {
-      w[wordof(i)] |= (v << i);
+      w[wordof(i)] |= (v << bitof(i));
 
       if unlikely ((bitof(i) + n) > BITS_PER_WORD)
-        w[wordof(i+1)] |= (v >> (BITS_PER_WORD - bitof(i)));
+        w[wordof(i) + 1] |= (v >> (BITS_PER_WORD - bitof(i)));
     }
 
     // find index of first "1" bit starting from low end
@@ -2690,6 +2698,409 @@ namespace superstl {
     return ((Hashtable<K, T, setcount, KM>&)ht).print(os);
   }
 
+  //
+  // Open addressing hashtable laid out as a Swiss table: slots are
+  // probed in groups of 16, and each slot has a control byte holding
+  // 7 bits of its key's hash (or EMPTY or DELETED). One pcmpeqb finds
+  // the candidates in a group, so a lookup rarely compares more than
+  // one key, and never follows a pointer to do so.
+  //
+  // The table grows incrementally: once it is 7/8 full, a table twice
+  // the size takes over, and the old one is still searched until each
+  // insertion has moved a few of its groups across. Entries are never
+  // moved otherwise, so entries can be removed while iterating (but
+  // not added).
+  //
+  template <typename K>
+  struct OpenHashtableKeyManager {
+    static inline W64 hash(const K& key);
+    static inline bool equal(const K& a, const K& b) { return (a == b); }
+  };
+
+  //
+  // Fibonacci hashing: the high bits of the product depend on all bits
+  // of the key, even for keys like page addresses whose low bits are all
+  // zero; bswap moves them to where OpenHashtable takes its bits from.
+  //
+  static inline W64 mixbits64(W64 x) {
+    return bswap(x * 0x9e3779b97f4a7c15ULL);
+  }
+
+  template <>
+  struct OpenHashtableKeyManager<W64> {
+    static inline W64 hash(W64 key) { return mixbits64(key); }
+    static inline bool equal(W64 a, W64 b) { return (a == b); }
+  };
+
+  template <typename K, typename V, typename KM = OpenHashtableKeyManager<K> >
+  struct OpenHashtable {
+    typedef KeyValuePair<K, V> entry_t;
+
+    static const int GROUP_SIZE = 16;
+    static const int MIN_GROUPS = 4;
+    // Groups of the old table moved per insertion while growing:
+    static const int MIGRATE_GROUPS = 4;
+
+    // Control bytes: a full slot holds the low 7 bits of the hash
+    static const byte EMPTY = 0x80;
+    static const byte DELETED = 0xfe;
+
+    struct Table {
+      byte* ctrl;
+      entry_t* slots;
+      int groups;
+      int count;
+      int used; // full and deleted slots
+
+      void reset() { ctrl = null; slots = null; groups = 0; count = 0; used = 0; }
+      int capacity() const { return groups * GROUP_SIZE; }
+      int limit() const { return capacity() - (capacity() / 8); }
+    };
+
+  protected:
+    Table cur;
+    Table old;
+    int migrated;
+
+  public:
+    int count;
+
+    OpenHashtable() {
+      cur.reset();
+      old.reset();
+      migrated = 0;
+      count = 0;
+    }
+
+    ~OpenHashtable() { clear(); }
+
+  protected:
+    static inline W32 match(const byte* group, byte b) {
+      typedef char v16qs __attribute__ ((vector_size(16)));
+      v16qs g = *(const v16qs*)group;
+      v16qs t = {b, b, b, b, b, b, b, b, b, b, b, b, b, b, b, b};
+      return __builtin_ia32_pmovmskb128((v16qs)(g == t));
+    }
+
+    static entry_t* find(const Table& t, const K& key, W64 h) {
+      if unlikely (!t.ctrl) return null;
+
+      int mask = t.groups - 1;
+      int g = (h >> 7) & mask;
+
+      // Triangular steps visit every group of a power of two sized table
+      for (int step = 1; ; step++) {
+        const byte* group = t.ctrl + (g * GROUP_SIZE);
+        W32 hits = match(group, h & 0x7f);
+        while (hits) {
+          entry_t* e = &t.slots[(g * GROUP_SIZE) + lsbindex32(hits)];
+          if likely (KM::equal(e->key, key)) return e;
+          hits &= (hits - 1);
+        }
+        if likely (match(group, EMPTY)) return null;
+        g = (g + step) & mask;
+      }
+    }
+
+    static entry_t* place(Table& t, const K& key, const V& value, W64 h) {
+      int mask = t.groups - 1;
+      int g = (h >> 7) & mask;
+      int i;
+
+      for (int step = 1; ; step++) {
+        const byte* group = t.ctrl + (g * GROUP_SIZE);
+        W32 avail = match(group, EMPTY) | match(group, DELETED);
+        if likely (avail) { i = (g * GROUP_SIZE) + lsbindex32(avail); break; }
+        g = (g + step) & mask;
+      }
+
+      if (t.ctrl[i] == EMPTY) t.used++;
+      t.ctrl[i] = h & 0x7f;
+      t.slots[i].key = key;
+      t.slots[i].value = value;
+      t.count++;
+      return &t.slots[i];
+    }
+
+    static void erase(Table& t, entry_t* e) {
+      int i = e - t.slots;
+      //
+      // Probes stop at the first group with an empty slot, so a slot
+      // can only be emptied if its group already stops them:
+      //
+      if (match(t.ctrl + (i & ~(GROUP_SIZE-1)), EMPTY)) {
+        t.ctrl[i] = EMPTY;
+        t.used--;
+      } else {
+        t.ctrl[i] = DELETED;
+      }
+      t.count--;
+    }
+
+    static void free_table(Table& t) {
+      delete[] t.ctrl;
+      delete[] t.slots;
+      t.reset();
+    }
+
+    void migrate(int n) {
+      while (old.ctrl && (n-- > 0)) {
+        int base = migrated * GROUP_SIZE;
+        foreach (j, GROUP_SIZE) {
+          int i = base + j;
+          if (old.ctrl[i] & 0x80) continue;
+          place(cur, old.slots[i].key, old.slots[i].value, KM::hash(old.slots[i].key));
+          // Not EMPTY: later groups may still be reached through this one
+          old.ctrl[i] = DELETED;
+          old.count--;
+        }
+
+        if ((++migrated) == old.groups) {
+          free_table(old);
+          migrated = 0;
+        }
+      }
+    }
+
+    void grow() {
+      while (old.ctrl) migrate(old.groups);
+
+      // Mostly deleted slots: rehash at the same size
+      int groups = (cur.count >= (cur.capacity() / 2)) ? (cur.groups * 2) : cur.groups;
+      groups = max(groups, MIN_GROUPS);
+
+      //
+      // The allocation may reclaim memory by removing entries from
+      // this very table, so only take the new table over afterwards.
+      //
+      Table t;
+      t.reset();
+      t.groups = groups;
+      t.slots = new entry_t[t.capacity()];
+      t.ctrl = new byte[t.capacity()];
+      memset(t.ctrl, EMPTY, t.capacity());
+
+      if (cur.ctrl) old = cur;
+      cur = t;
+      migrated = 0;
+    }
+
+    entry_t* lookup(const K& key, Table*& table) {
+      W64 h = KM::hash(key);
+      table = &cur;
+      entry_t* e = find(cur, key, h);
+      if likely (e || (!old.ctrl)) return e;
+      table = &old;
+      return find(old, key, h);
+    }
+
+  public:
+    V* get(const K& key) {
+      W64 h = KM::hash(key);
+      entry_t* e = find(cur, key, h);
+      if unlikely ((!e) && old.ctrl) e = find(old, key, h);
+      return (e) ? &e->value : null;
+    }
+
+    V* operator ()(const K& key) {
+      return get(key);
+    }
+
+    V* add(const K& key, const V& value) {
+      Table* t;
+      entry_t* e = lookup(key, t);
+      if unlikely (e) {
+        e->value = value;
+        return &e->value;
+      }
+
+      if unlikely (cur.used >= cur.limit()) grow();
+      migrate(MIGRATE_GROUPS);
+
+      e = place(cur, key, value, KM::hash(key));
+      count++;
+      return &e->value;
+    }
+
+    bool remove(const K& key, V& value) {
+      Table* t;
+      entry_t* e = lookup(key, t);
+      if unlikely (!e) return false;
+
+      value = e->value;
+      erase(*t, e);
+      count--;
+      return true;
+    }
+
+    bool remove(const K& key) {
+      V dummy;
+      return remove(key, dummy);
+    }
+
+    void clear() {
+      free_table(cur);
+      free_table(old);
+      migrated = 0;
+      count = 0;
+    }
+
+    // Exchange contents; nothing points into the tables themselves:
+    void swap(OpenHashtable<K, V, KM>& other) {
+      ::swap(cur, other.cur);
+      ::swap(old, other.old);
+      ::swap(migrated, other.migrated);
+      ::swap(count, other.count);
+    }
+
+    struct Iterator {
+      OpenHashtable<K, V, KM>* ht;
+      Table* table;
+      int slot;
+
+      Iterator() { }
+
+      Iterator(OpenHashtable<K, V, KM>* ht) {
+        reset(ht);
+      }
+
+      Iterator(OpenHashtable<K, V, KM>& ht) {
+        reset(&ht);
+      }
+
+      void reset(OpenHashtable<K, V, KM>* ht) {
+        this->ht = ht;
+        table = &ht->cur;
+        slot = 0;
+      }
+
+      void reset(OpenHashtable<K, V, KM>& ht) {
+        reset(&ht);
+      }
+
+      entry_t* next() {
+        for (;;) {
+          if unlikely (slot >= table->capacity()) {
+            if (table == &ht->old) return null;
+            table = &ht->old;
+            slot = 0;
+            continue;
+          }
+
+          int i = slot++;
+          if (!(table->ctrl[i] & 0x80)) return &table->slots[i];
+        }
+      }
+    };
+
+    dynarray<entry_t>& getentries(dynarray<entry_t>& a) {
+      a.resize(count);
+      int n = 0;
+      Iterator iter(this);
+      entry_t* e;
+      while (e = iter.next()) {
+        assert(n < count);
+        a[n++] = *e;
+      }
+      return a;
+    }
+
+    ostream& print(ostream& os) {
+      os << "OpenHashtable of ", cur.capacity(), " slots containing ", count, " entries:", endl;
+      Iterator iter(this);
+      entry_t* e;
+      while (e = iter.next()) {
+        os << "  ", e->key, " -> ", e->value, endl;
+      }
+      return os;
+    }
+  };
+
+  template <typename K, typename V, typename KM>
+  static inline ostream& operator <<(ostream& os, const OpenHashtable<K, V, KM>& ht) {
+    return ((OpenHashtable<K, V, KM>&)ht).print(os);
+  }
+
+  //
+  // OpenHashtable of pointers to objects holding their own keys (as
+  // SelfHashtable, but LM only needs keyof()).
+  //
+  template <typename K, typename T, typename LM, typename KM = OpenHashtableKeyManager<K> >
+  struct OpenSelfHashtable: public OpenHashtable<K, T*, KM> {
+    typedef OpenHashtable<K, T*, KM> base_t;
+    typedef typename base_t::entry_t entry_t;
+    typedef typename base_t::Table Table;
+
+    T* get(const K& key) {
+      T** p = base_t::get(key);
+      return (p) ? *p : null;
+    }
+
+    T* operator ()(const K& key) {
+      return get(key);
+    }
+
+    T* add(T* obj) {
+      base_t::add(LM::keyof(obj), obj);
+      return obj;
+    }
+
+    T& add(T& obj) {
+      return *add(&obj);
+    }
+
+    // Only removes obj itself, not another object with the same key
+    T* remove(T* obj) {
+      Table* t;
+      entry_t* e = base_t::lookup(LM::keyof(obj), t);
+      if unlikely ((!e) || (e->value != obj)) return obj;
+      base_t::erase(*t, e);
+      base_t::count--;
+      return obj;
+    }
+
+    T& remove(T& obj) {
+      return *remove(&obj);
+    }
+
+    struct Iterator: public base_t::Iterator {
+      Iterator() { }
+
+      Iterator(OpenSelfHashtable<K, T, LM, KM>* ht) {
+        reset(ht);
+      }
+
+      Iterator(OpenSelfHashtable<K, T, LM, KM>& ht) {
+        reset(&ht);
+      }
+
+      void reset(OpenSelfHashtable<K, T, LM, KM>* ht) {
+        base_t::Iterator::reset(ht);
+      }
+
+      void reset(OpenSelfHashtable<K, T, LM, KM>& ht) {
+        base_t::Iterator::reset(&ht);
+      }
+
+      T* next() {
+        entry_t* e = base_t::Iterator::next();
+        return (e) ? e->value : null;
+      }
+    };
+
+    dynarray<T*>& getentries(dynarray<T*>& a) {
+      a.resize(base_t::count);
+      int n = 0;
+      Iterator iter(this);
+      T* t;
+      while (t = iter.next()) {
+        assert(n < base_t::count);
+        a[n++] = t;
+      }
+      return a;
+    }
+  };
+
   template <typename T, int N, int setcount>
   struct FixedValueHashtable {
     typedef int ptr_t;
@@ -17,6 +17,7 @@ declare_syscall6(__NR_mmap, void*, sys_mmap, void *, start, size_t, length, int,
 declare_syscall4(__NR_ptrace, W64, sys_ptrace, int, request, pid_t, pid, W64, addr, W64, data);
 declare_syscall3(__NR_lseek, W64, sys_seek, int, fd, W64, offset, unsigned int, origin);
 declare_syscall2(__NR_arch_prctl, W64, sys_arch_prctl, int, code, void*, addr);
+declare_syscall3(__NR_shmat, void*, sys_shmat, int, shmid, const void*, shmaddr, int, shmflg);
 
 #else
 
@@ -55,14 +56,22 @@ declare_syscall1(__NR_close, int, sys_close, int, fd);
 declare_syscall3(__NR_read, ssize_t, sys_read, int, fd, void*, buf, size_t, count);
 declare_syscall3(__NR_write, ssize_t, sys_write, int, fd, const void*, buf, size_t, count);
 declare_syscall1(__NR_unlink, int, sys_unlink, const char*, pathname);
+declare_syscall2(__NR_mkdir, int, sys_mkdir, const char*, pathname, int, mode);
 declare_syscall2(__NR_rename, int, sys_rename, const char*, oldpath, const char*, newpath);
 
-declare_syscall1(__NR_exit, void, sys_exit, int, code);
+// Ends the whole process, not just the calling thread (the library may run in a threaded host):
+declare_syscall1(__NR_exit_group, void, sys_exit, int, code);
 declare_syscall1(__NR_brk, void*, sys_brk, void*, p);
 declare_syscall0(__NR_fork, pid_t, sys_fork);
 declare_syscall3(__NR_execve, int, sys_execve, const char*, filename, const char**, argv, const char**, envp);
+declare_syscall1(__NR_pipe, int, sys_pipe, int*, fds);
+declare_syscall3(__NR_poll, int, sys_poll, struct pollfd*, fds, unsigned int, nfds, int, timeout);
+declare_syscall3(__NR_getdents64, int, sys_getdents64, int, fd, void*, dirp, unsigned int, count);
+declare_syscall3(__NR_sched_getaffinity, int, sys_sched_getaffinity, pid_t, pid, size_t, size, void*, mask);
+declare_syscall3(__NR_sched_setaffinity, int, sys_sched_setaffinity, pid_t, pid, size_t, size, const void*, mask);
 
 declare_syscall0(__NR_getpid, pid_t, sys_getpid);
+declare_syscall2(__NR_kill, int, sys_kill, pid_t, pid, int, sig);
 declare_syscall0(__NR_getppid, pid_t, sys_getppid);
 declare_syscall0(__NR_gettid, pid_t, sys_gettid);
 declare_syscall1(__NR_uname, int, sys_uname, struct utsname*, buf);
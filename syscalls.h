@@ -19,6 +19,7 @@ extern "C" {
   ssize_t sys_fdatasync(int fd);
   W64 sys_seek(int fd, W64 offset, unsigned int origin);
   int sys_unlink(const char* pathname);
+  int sys_mkdir(const char* pathname, int mode);
   int sys_rename(const char* oldpath, const char* newpath);
   
   void* sys_mmap(void* start, size_t length, int prot, int flags, int fd, W64 offset);
@@ -33,10 +34,18 @@ extern "C" {
   
   pid_t sys_fork();
   int sys_execve(const char* filename, const char** argv, const char** envp);
+  int sys_pipe(int* fds);
+  struct pollfd;
+  int sys_poll(struct pollfd* fds, unsigned int nfds, int timeout);
+  int sys_getdents64(int fd, void* dirp, unsigned int count);
+  int sys_sched_getaffinity(pid_t pid, size_t size, void* mask);
+  int sys_sched_setaffinity(pid_t pid, size_t size, const void* mask);
   
   pid_t sys_gettid();
   pid_t sys_getppid();
   pid_t sys_getpid();
+  int sys_kill(pid_t pid, int sig);
+  void* sys_shmat(int shmid, const void* shmaddr, int shmflg);
   void sys_exit(int code);
   void* sys_brk(void* newbrk);
   int sys_readlink(const char *path, char *buf, size_t bufsiz);
@@ -0,0 +1,78 @@
+#!/usr/bin/env python3
+#
+# Truncated or corrupt basic block store files (-bbstore <file>) must be
+# ignored as a whole, never crash raspsim, read outside the mapped file
+# or loop on a cyclic hash chain. A store made by a run is damaged in
+# various ways; each run with it must still simulate correctly and log
+# that the store was ignored.
+#
+# Usage: test_bad_store.py [path to raspsim]
+#
+
+import os, struct, subprocess, sys, tempfile
+
+RASPSIM = os.path.abspath(sys.argv[1] if len(sys.argv) > 1 else "./raspsim")
+
+# mov eax, 0x112233; mov ebx, 0x445566; int 0x80
+CODE = "b833221100bb66554400cd80"
+COMMANDS = ["M200000 rx", "W200000 " + CODE, "rip 0x200000"]
+
+HEADER = struct.Struct("<QIIQIIII")  # magic, version, reserved, decoder hash, bb size, transop size, buckets, entries
+
+def run(store, log):
+  args = [RASPSIM, "-logfile", log, "-quiet", "-bbstore", store] + COMMANDS
+  try:
+    p = subprocess.run(args, stdout=subprocess.PIPE, stderr=subprocess.PIPE, timeout=60)
+  except subprocess.TimeoutExpired:
+    return "timeout", ""
+  return p.returncode, p.stdout.decode(errors="replace") + p.stderr.decode(errors="replace")
+
+def damaged(data):
+  magic, version, reserved, dhash, bbsize, tosize, buckets, entries = HEADER.unpack_from(data)
+  first = HEADER.size + 4 * buckets
+  heads = [i for i in range(buckets) if struct.unpack_from("<I", data, HEADER.size + 4 * i)[0]]
+  head = HEADER.size + 4 * heads[0]
+  entry = struct.unpack_from("<I", data, head)[0]
+
+  def put(fmt, offset, value):
+    d = bytearray(data)
+    struct.pack_into(fmt, d, offset, value)
+    return bytes(d)
+
+  return [
+    ("truncated in the bucket table", data[:HEADER.size + 8]),
+    ("truncated in the first entry", data[:first + 16]),
+    ("truncated in the last entry", data[:-8]),
+    ("bucket beyond the file", put("<I", head, len(data) + 64)),
+    ("bucket wraps", put("<I", head, 0xfffffff8)),
+    ("bucket into the header", put("<I", head, 8)),
+    ("chain loops back", put("<I", entry, entry)),
+    ("entry size beyond the file", put("<H", entry + 8, 0xfff8)),
+    ("code window beyond the entry", put("<H", entry + 10, 0xffff)),
+    ("bucket count too large", put("<I", 32, 0x40000000)),
+    ("other decoder build", put("<Q", 16, dhash ^ 1)),
+  ]
+
+failed = 0
+with tempfile.TemporaryDirectory() as tmp:
+  store = os.path.join(tmp, "bb.store")
+  log = os.path.join(tmp, "log")
+  rc, out = run(store, log)
+  if (rc != 0) or (not os.path.exists(store)):
+    print("FAIL  making the store (rc %s)" % rc)
+    sys.exit(1)
+  data = open(store, "rb").read()
+
+  for name, contents in [("valid store", data)] + damaged(data):
+    with open(store, "wb") as f: f.write(contents)
+    rc, out = run(store, log)
+    logtext = open(log, errors="replace").read() if os.path.exists(log) else ""
+    passed = (rc == 0) and ("rax    0x0000000000112233" in out) and ("rbx    0x0000000000445566" in out)
+    if name != "valid store":
+      passed = passed and ("ignored" in logtext)
+    print("%s  %s (rc %s)" % ("ok  " if passed else "FAIL", name, rc))
+    if not passed:
+      failed += 1
+      print("\n".join("    " + l for l in out.splitlines()[-5:]))
+
+sys.exit(1 if failed else 0)
@@ -0,0 +1,52 @@
+#!/bin/bash
+#
+# Simulation throughput benchmark. Runs each raspsim binary on a workload
+# (a command list, e.g. loop-200k.txt) ROUNDS times, interleaving the
+# binaries so host noise hits them alike, and prints the minimum and
+# median user CPU time, the simulated cycles, simulated cycles per CPU
+# second and the median ratio to the first binary. Passing the same
+# binary twice gives a noise control.
+#
+# Usage: [ROUNDS=9] [CORE=ooo] bench.sh <workload> <raspsim> [<raspsim>...] [-- <extra raspsim args>]
+#
+# Example:
+#   CORE=seq tests/bench/bench.sh tests/bench/loop-200k.txt ./raspsim /tmp/raspsim.old
+#
+
+rounds=${ROUNDS:-9}
+core=${CORE:-ooo}
+workload=$1; shift
+bins=()
+while [ $# -gt 0 ] && [ "$1" != "--" ]; do bins+=("$1"); shift; done
+[ "$1" = "--" ] && shift
+extra=("$@")
+
+if [ -z "$workload" ] || [ ${#bins[@]} -eq 0 ]; then
+  sed -n '3,14s/^# \{0,1\}//p' "$0"
+  exit 1
+fi
+
+out=$(mktemp)
+times=$(mktemp)
+TIMEFORMAT=%3U
+for r in $(seq $rounds); do
+  for i in "${!bins[@]}"; do
+    { time "${bins[$i]}" -core $core -logfile /dev/null "${extra[@]}" @"$workload" > $out 2>&1 ; } 2> $out.time
+    c=$(grep -o 'Stopped after [0-9]*' $out | grep -o '[0-9]*$')
+    if [ -z "$c" ]; then echo "${bins[$i]}: run failed:"; tail -5 $out; rm -f $out $out.time $times; exit 1; fi
+    echo "$i $c $(tr -d . < $out.time | sed 's/^0*//')" >> $times
+  done
+done
+
+printf "%-32s %8s %8s %12s %14s %7s\n" binary "min ms" "med ms" cycles cycles/sec ratio
+sort -n -k1,1 -k3,3 $times | awk -v n=${#bins[@]} -v rounds=$rounds -v names="${bins[*]}" '
+  { ms[$1, cnt[$1]++] = $3 + 0; cycles[$1] = $2 }
+  END {
+    split(names, b, " ")
+    base = ms[0, int(rounds / 2)]
+    for (i = 0; i < n; i++) {
+      med = ms[i, int(rounds / 2)]
+      printf "%-32s %8d %8d %12d %14d %7.3f\n", b[i + 1], ms[i, 0], med, cycles[i], cycles[i] * 1000 / (med > 0 ? med : 1), med / (base > 0 ? base : 1)
+    }
+  }'
+rm -f $out $out.time $times
@@ -0,0 +1,119 @@
+//
+// Lookup latency of OpenHashtable against the chained Hashtable
+//
+// First replays random add/remove/get operations on both tables and checks
+// they agree, then times get() over three key patterns (guest pages in three
+// regions, basic block rips, sparse random pages) at 64 to 65536 keys, in
+// shuffled order. chained(64) is Hashtable's default set count, which
+// AddressSpace::mapped_mem used; chained(16384) is the old basic block cache
+// size. Results are in rdtsc ticks per lookup.
+//
+// Build and run: make bench_hashtable && ./bench_hashtable
+//
+
+#include <globals.h>
+#include <superstl.h>
+
+static W64 rng = 88172645463325252ULL;
+static W64 rnd() { rng ^= rng << 13; rng ^= rng >> 7; rng ^= rng << 17; return rng; }
+
+template <typename H>
+static double bench_lookup(H& h, W64* keys, int n, int lookups) {
+  W64 sum = 0;
+  W64 t0 = rdtsc();
+  int i = 0;
+  foreach (j, lookups) {
+    W8** p = h.get(keys[i]);
+    sum += (p) ? (W64)*p : 1;
+    if unlikely (++i == n) i = 0;
+  }
+  W64 t1 = rdtsc();
+  // Keep the lookups from being optimized away
+  if (sum == 12345) cout << " ";
+  return (double)(t1 - t0) / (double)lookups;
+}
+
+static void run(const char* name, W64* keys, int n) {
+  // chained(64) degrades linearly with n: give it fewer lookups
+  int lookups = max(n, 4000000);
+  int slowlookups = max(n, 4000000 / max(1, n / 256));
+
+  Hashtable<W64, W8*> chained64;
+  Hashtable<W64, W8*, 16384> chained16k;
+  OpenHashtable<W64, W8*> open;
+  foreach (i, n) {
+    chained64.add(keys[i], (W8*)(keys[i] + 1));
+    chained16k.add(keys[i], (W8*)(keys[i] + 1));
+    open.add(keys[i], (W8*)(keys[i] + 1));
+  }
+
+  W64* order = new W64[n];
+  foreach (i, n) order[i] = keys[i];
+  foreach (i, n) { int j = rnd() % n; W64 t = order[i]; order[i] = order[j]; order[j] = t; }
+
+  cout << padstring(name, -20), intstring(n, 6), " keys: chained(64) ", floatstring(bench_lookup(chained64, order, n, slowlookups), 8, 1),
+    "  chained(16384) ", floatstring(bench_lookup(chained16k, order, n, lookups), 8, 1),
+    "  open ", floatstring(bench_lookup(open, order, n, lookups), 8, 1), endl, flush;
+  delete[] order;
+}
+
+static void check_against_chained() {
+  Hashtable<W64, W8*, 1024> ref;
+  OpenHashtable<W64, W8*> open;
+
+  foreach (i, 2000000) {
+    W64 k = (rnd() % 50000) << 12;
+    int op = rnd() % 4;
+    if (op < 2) {
+      ref.add(k, (W8*)(Waddr)i);
+      open.add(k, (W8*)(Waddr)i);
+    } else if (op == 2) {
+      W8* a = null; W8* b = null;
+      bool ra = ref.remove(k, a);
+      bool rb = open.remove(k, b);
+      assert(ra == rb);
+      assert(a == b);
+    } else {
+      W8** a = ref.get(k);
+      W8** b = open.get(k);
+      assert((!a) == (!b));
+      if (a) assert(*a == *b);
+    }
+    assert(ref.count == open.count);
+  }
+
+  int n = 0;
+  OpenHashtable<W64, W8*>::Iterator iter(open);
+  KeyValuePair<W64, W8*>* kvp;
+  while ((kvp = iter.next())) {
+    assert(ref.get(kvp->key) && (*ref.get(kvp->key) == kvp->value));
+    n++;
+  }
+  assert(n == open.count);
+  cout << "2M random operations agree with Hashtable (", n, " entries left)", endl, flush;
+}
+
+int main(int argc, char** argv) {
+  check_against_chained();
+
+  static const int N = 65536;
+  W64* keys = new W64[N];
+  int sizes[] = {64, 1024, 16384, 65536};
+
+  cout << "rdtsc ticks per lookup:", endl;
+  foreach (s, lengthof(sizes)) {
+    int n = sizes[s];
+    // Guest pages: stack, heap and binary, consecutive pages in each
+    foreach (i, n) keys[i] = ((i % 3 == 0) ? 0x400000ULL : (i % 3 == 1) ? 0x7ff000000000ULL : 0x10000000ULL) + ((W64)(i / 3) << 12);
+    run("pages (3 regions)", keys, n);
+    // Basic block rips: about one block per 24 bytes of code
+    foreach (i, n) keys[i] = 0x400000ULL + (i * 24) + (rnd() % 16);
+    run("rips", keys, n);
+    // Sparse random pages
+    foreach (i, n) keys[i] = (rnd() & 0x7fffffff) << 12;
+    run("random pages", keys, n);
+  }
+
+  delete[] keys;
+  return 0;
+}
@@ -0,0 +1,105 @@
+//
+// Cost of the associative tag searches in logic.h at each host_simd
+// level the host supports: the issue queue broadcast (invalidate_each()
+// over the 4 operand tag arrays, 16 bit tags), a single issue queue
+// match() and a TLB lookup (40 bit tags), for 16 to 128 entries. Results
+// are in rdtsc ticks per operation; sizes the wide searches are not used
+// for (see avx2_blocks and avx512_blocks) repeat the SSE2 time.
+//
+// Build and run: make bench_tagmatch && ./bench_tagmatch
+//
+
+#include <globals.h>
+#include <superstl.h>
+#include <logic.h>
+
+static W64 rng = 0x9e3779b97f4a7c15ULL;
+static W64 rnd() { rng ^= rng << 13; rng ^= rng >> 7; rng ^= rng << 17; return rng; }
+
+static const char* simd_names[] = {"sse2", "avx2", "avx512"};
+static const int OPERANDS = 4; // per issue queue entry (MAX_OPERANDS)
+static const int ITERATIONS = 1000000;
+
+// Keeps the results from being optimized away
+static W64 sink = 0;
+
+template <int size>
+static double bench_broadcast(int level) {
+  typedef FullyAssociativeTags16bit<size, size> A;
+  A arrays[OPERANDS];
+  W16 targets[256];
+  foreach (i, lengthof(targets)) targets[i] = rnd() % (size * 2);
+
+  host_simd = level;
+  W64 t0 = rdtsc();
+  foreach (it, ITERATIONS) {
+    // Refill a slot so the broadcasts keep finding something to invalidate
+    int slot = it % size;
+    foreach (op, OPERANDS) arrays[op].insertslot(slot, (W16)((slot + it) % (size * 2)));
+    A::invalidate_each(arrays, OPERANDS, A::prep(targets[it & 255]));
+  }
+  W64 t1 = rdtsc();
+  foreach (op, OPERANDS) sink += arrays[op].valid.popcount();
+  host_simd = HOST_SIMD_SSE2;
+  return double(t1 - t0) / ITERATIONS;
+}
+
+template <int size>
+static double bench_match(int level) {
+  typedef FullyAssociativeTags16bit<size, size> A;
+  A tags;
+  foreach (i, size) tags.insertslot(i, (W16)(i * 3));
+  W16 targets[256];
+  foreach (i, lengthof(targets)) targets[i] = rnd() % (size * 3);
+
+  host_simd = level;
+  W64 t0 = rdtsc();
+  foreach (it, ITERATIONS) sink += tags.match(A::prep(targets[it & 255])).popcount();
+  W64 t1 = rdtsc();
+  host_simd = HOST_SIMD_SSE2;
+  return double(t1 - t0) / ITERATIONS;
+}
+
+template <int size>
+static double bench_tlb(int level) {
+  typedef FullyAssociativeTagsNbitOneHot<size, 40> A;
+  A tags;
+  W64 targets[256];
+  foreach (i, size) tags.insertslot(i, 0x7ff000000ULL + i * 17);
+  foreach (i, lengthof(targets)) targets[i] = 0x7ff000000ULL + (rnd() % (size * 34));
+
+  host_simd = level;
+  W64 t0 = rdtsc();
+  foreach (it, ITERATIONS) sink += tags.match(targets[it & 255]);
+  W64 t1 = rdtsc();
+  host_simd = HOST_SIMD_SSE2;
+  return double(t1 - t0) / ITERATIONS;
+}
+
+template <int size>
+static void run(int levels) {
+  cout << intstring(size, 4), " entries:";
+  cout << "  broadcast";
+  foreach (level, levels + 1) cout << " ", floatstring(bench_broadcast<size>(level), 6, 1);
+  cout << "  match";
+  foreach (level, levels + 1) cout << " ", floatstring(bench_match<size>(level), 6, 1);
+  cout << "  TLB";
+  foreach (level, levels + 1) cout << " ", floatstring(bench_tlb<size>(level), 6, 1);
+  cout << endl, flush;
+}
+
+int main(int argc, char** argv) {
+  int levels = detect_host_simd();
+
+  cout << "rdtsc ticks per operation, for";
+  foreach (level, levels + 1) cout << " ", simd_names[level];
+  cout << ":", endl;
+
+  run<16>(levels);
+  run<32>(levels);
+  run<64>(levels);
+  run<128>(levels);
+
+  if (sink == 1) cout << " ";
+  return 0;
+}
@@ -0,0 +1,35 @@
+#
+# Benchmark guest: a loop of 8-byte loads, multiplies, stores and a data
+# dependent branch over an 8 KB array at 0x400000, ending with a load from
+# the read-only page at 0x500000 and int 0x80. loop-*.txt hold its code as
+# a W command, with the iteration count (rcx) set to 2000, 200000 and
+# 2000000. To rebuild the hex after changing it:
+#
+#   as loop.s -o loop.o && objcopy -O binary -j .text loop.o loop.bin && xxd -p loop.bin | tr -d '\n'
+#
+.intel_syntax noprefix
+.text
+start:
+  mov rcx, 2000
+  mov rsi, 0x400000
+  xor rax, rax
+  xor rbx, rbx
+loop:
+  mov rdx, [rsi + rbx*8]
+  add rdx, rcx
+  imul rdx, rdx, 7
+  mov [rsi + rbx*8], rdx
+  test rdx, 1
+  jz even
+  add rax, rdx
+  jmp next
+even:
+  sub rax, rdx
+next:
+  inc rbx
+  and rbx, 1023
+  dec rcx
+  jnz loop
+  mov rdi, 0x500000
+  mov rdi, [rdi]
+  int 0x80
@@ -0,0 +1,89 @@
+#!/usr/bin/env python3
+#
+# Malformed binary test cases and packs (B<file>, B<file> <index>) must
+# be rejected with an error, never crash raspsim or read outside the
+# mapped file. The offsets below are chosen so that naive
+# "offset + size > filesize" checks wrap around and pass.
+#
+# Usage: test_bad_cases.py [path to raspsim]
+#
+
+import os, struct, subprocess, sys, tempfile
+
+RASPSIM = os.path.abspath(sys.argv[1] if len(sys.argv) > 1 else "./raspsim")
+
+CASE_MAGIC = 0x4553414350534152  # "RASPCASE"
+PACK_MAGIC = 0x4b43415050534152  # "RASPPACK"
+ARCHREG_COUNT = 64
+REG_rip = 56
+HEADER_SIZE = 560
+SEGMENT_SIZE = 32
+PROT_RX = 5
+HUGE = 2**64
+
+def case(segments=(), dumps=(), segment_offset=None, dump_offset=None, segment_count=None, dump_count=None, regs=None, payload=b""):
+    regs = regs or {}
+    regmask = 0
+    values = [0] * ARCHREG_COUNT
+    for r, v in regs.items():
+        regmask |= 1 << r
+        values[r] = v
+    segtab = b"".join(struct.pack("<QQIIQ", *s) for s in segments)
+    dumptab = b"".join(struct.pack("<Q", d) for d in dumps)
+    if segment_offset is None: segment_offset = HEADER_SIZE
+    if dump_offset is None: dump_offset = HEADER_SIZE + len(segtab)
+    if segment_count is None: segment_count = len(segments)
+    if dump_count is None: dump_count = len(dumps)
+    hdr = struct.pack("<QIIQ", CASE_MAGIC, 1, 0, regmask) + struct.pack("<%dQ" % ARCHREG_COUNT, *values)
+    hdr += struct.pack("<IIQQ", segment_count, dump_count, segment_offset % HUGE, dump_offset % HUGE)
+    assert len(hdr) == HEADER_SIZE
+    return hdr + segtab + dumptab + payload
+
+def pack(entries, cases):
+    data = struct.pack("<QII", PACK_MAGIC, 1, len(entries)) + b"".join(struct.pack("<QQ", o % HUGE, s % HUGE) for o, s in entries)
+    return data + b"".join(cases)
+
+code = bytes.fromhex("b833221100cd80")  # mov eax, 0x112233; int 0x80
+code_offset = HEADER_SIZE + SEGMENT_SIZE
+good = case(segments=[(0x200000, len(code), PROT_RX, 0, code_offset)], regs={REG_rip: 0x200000}, payload=code)
+
+tests = [
+  # name, file contents, pack index (or None), expected to load
+  ("valid case", good, None, True),
+  ("truncated header", good[:HEADER_SIZE - 1], None, False),
+  ("segment table offset wraps", case(segments=[(0x200000, 4096, PROT_RX, 0, 0)], segment_offset=HUGE - 8), None, False),
+  ("segment table too long", case(segment_offset=HEADER_SIZE, segment_count=0xffffffff), None, False),
+  ("dump table offset wraps", case(dumps=[0x200000], dump_offset=HUGE - 4), None, False),
+  ("segment payload offset wraps", case(segments=[(0x200000, 4096, PROT_RX, 0, HUGE - 4096)]), None, False),
+  ("segment payload beyond file", case(segments=[(0x200000, 4096, PROT_RX, 0, HEADER_SIZE)]), None, False),
+  ("segment address wraps", case(segments=[(HUGE - 4096, 8192, 3, 0, 0)]), None, False),
+  ("segment beyond address space", case(segments=[(2**48 - 4096, 8192, 3, 0, 0)]), None, False),
+  ("valid pack case", pack([(32, len(good))], [good]), 0, True),
+  ("pack index out of range", pack([(32, len(good))], [good]), 1, False),
+  ("pack entry offset wraps", pack([(HUGE - 16, len(good) + 32)], [good]), 0, False),
+  ("pack entry size wraps", pack([(32, HUGE - 16)], [good]), 0, False),
+  ("pack entry beyond file", pack([(32, len(good) + 1)], [good]), 0, False),
+]
+
+failed = 0
+with tempfile.TemporaryDirectory() as tmp:
+  for name, data, index, ok in tests:
+    path = os.path.join(tmp, "case.bin")
+    with open(path, "wb") as f: f.write(data)
+    args = [RASPSIM, "-logfile", "/dev/null", "-quiet", "B" + path + ("" if index is None else " %d" % index)]
+    try:
+      p = subprocess.run(args, stdout=subprocess.PIPE, stderr=subprocess.PIPE, timeout=60)
+      out = p.stdout.decode(errors="replace") + p.stderr.decode(errors="replace")
+      rc = p.returncode
+    except subprocess.TimeoutExpired:
+      out, rc = "", "timeout"
+    if ok:
+      passed = (rc == 0) and ("rax    0x0000000000112233" in out)
+    else:
+      passed = (rc == 1) and ("Error:" in out)
+    print("%s  %s (rc %s)" % ("ok  " if passed else "FAIL", name, rc))
+    if not passed:
+      failed += 1
+      print("\n".join("    " + l for l in out.splitlines()[-5:]))
+
+sys.exit(1 if failed else 0)
@@ -0,0 +1,141 @@
+//
+// Checks the AVX2 and AVX-512 associative searches in logic.h against
+// the SSE2 ones: for issue queue tag arrays (8 and 16 bit tags) and TLB
+// tag arrays of 16 to 128 entries, filled with random tags and holes,
+// match(), search() and invalidate_each() must give the same result at
+// every host_simd level the host supports.
+//
+// Build and run: make test_tagmatch && ./test_tagmatch (part of make check)
+//
+
+#include <globals.h>
+#include <superstl.h>
+#include <logic.h>
+
+static W64 rng = 0x2545f4914f6cdd1dULL;
+static W64 rnd() { rng ^= rng << 13; rng ^= rng >> 7; rng ^= rng << 17; return rng; }
+
+static const char* simd_names[] = {"sse2", "avx2", "avx512"};
+static const int OPERANDS = 4; // per issue queue entry (MAX_OPERANDS)
+static int failures = 0;
+
+static void report(const char* what, int size, bool ok) {
+  cout << ((ok) ? "ok    " : "FAIL  "), what, " ", size, " entries", endl;
+  if (!ok) failures++;
+}
+
+//
+// Issue queue tags (FullyAssociativeTags8bit, FullyAssociativeTags16bit):
+// <operandcount> arrays of unique tags, some slots invalidated.
+//
+template <typename A, int size, int operandcount>
+static bool check_issueq_tags(int levels, int tagbits) {
+  bool ok = true;
+
+  foreach (round, 200) {
+    A arrays[operandcount];
+    W64 tagmask = (W64(1) << tagbits) - 1;
+
+    foreach (op, operandcount) {
+      // Unique tags: a random permutation of a random subset
+      foreach (i, size) {
+        if ((rnd() % 4) == 0) continue;
+        arrays[op].insertslot(i, (typename A::base_t)((i * 37 + round + op * 11) & tagmask));
+      }
+      foreach (i, size) if ((rnd() % 8) == 0) arrays[op].invalidateslot(i);
+    }
+
+    foreach (t, 16) {
+      typename A::base_t target = (typename A::base_t)(rnd() & tagmask);
+      typename A::vec_t targetvec = A::prep(target);
+
+      host_simd = HOST_SIMD_SSE2;
+      bitvec<size> ref[operandcount];
+      int refsearch[operandcount];
+      foreach (op, operandcount) {
+        ref[op] = arrays[op].match(targetvec);
+        refsearch[op] = arrays[op].search(target);
+      }
+
+      A refinv[operandcount];
+      foreach (op, operandcount) refinv[op] = arrays[op];
+      A::invalidate_each(refinv, operandcount, targetvec);
+
+      for (int level = HOST_SIMD_AVX2; level <= levels; level++) {
+        host_simd = level;
+        foreach (op, operandcount) {
+          if (arrays[op].match(targetvec) != ref[op]) ok = false;
+          if (arrays[op].search(target) != refsearch[op]) ok = false;
+        }
+
+        A inv[operandcount];
+        foreach (op, operandcount) inv[op] = arrays[op];
+        A::invalidate_each(inv, operandcount, targetvec);
+        foreach (op, operandcount) if (inv[op].valid != refinv[op].valid) ok = false;
+      }
+    }
+  }
+
+  host_simd = HOST_SIMD_SSE2;
+  return ok;
+}
+
+//
+// TLB tags (FullyAssociativeTagsNbitOneHot): unique page numbers.
+//
+template <int size, int width>
+static bool check_tlb_tags(int levels) {
+  typedef FullyAssociativeTagsNbitOneHot<size, width> A;
+  bool ok = true;
+
+  foreach (round, 200) {
+    A tags;
+    W64 tagmask = (W64(1) << width) - 1;
+    W64 base = rnd() & tagmask;
+    W64 present[size];
+    int count = 0;
+
+    foreach (i, size) {
+      if ((rnd() % 4) == 0) continue;
+      W64 tag = (base + (i * 7919)) & tagmask;
+      tags.insertslot(i, tag);
+      present[count++] = tag;
+    }
+
+    foreach (t, 32) {
+      W64 target = ((t & 1) && count) ? present[rnd() % count] : (rnd() & tagmask);
+
+      host_simd = HOST_SIMD_SSE2;
+      int ref = tags.match(target);
+
+      for (int level = HOST_SIMD_AVX2; level <= levels; level++) {
+        host_simd = level;
+        if (tags.match(target) != ref) ok = false;
+      }
+    }
+  }
+
+  host_simd = HOST_SIMD_SSE2;
+  return ok;
+}
+
+template <int size>
+static void check_size(int levels) {
+  report("issue queue, 8 bit tags,", size, check_issueq_tags<FullyAssociativeTags8bit<size, size>, size, OPERANDS>(levels, 8));
+  report("issue queue, 16 bit tags,", size, check_issueq_tags<FullyAssociativeTags16bit<size, size>, size, OPERANDS>(levels, 16));
+  report("TLB, 40 bit tags,", size, check_tlb_tags<size, 40>(levels));
+}
+
+int main(int argc, char** argv) {
+  int levels = detect_host_simd();
+  cout << "Host supports ", simd_names[levels], "; checking against sse2", endl;
+  if (levels == HOST_SIMD_SSE2) cout << "(no wider searches to check on this host)", endl;
+
+  check_size<16>(levels);
+  check_size<32>(levels);
+  check_size<64>(levels);
+  check_size<128>(levels);
+
+  if (failures) cout << failures, " checks failed", endl;
+  return (failures) ? 1 : 0;
+}